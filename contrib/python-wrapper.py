@@ -62,6 +62,24 @@ class LoopStatus():
 # The sent/received KB/sec values are averaged over 5 seconds; see PERIOD in nethogs.h.
 # https://github.com/raboof/nethogs/blob/master/src/nethogs.h#L43
 # sent_bytes and recv_bytes are a running total
+NETHOGS_HIST_BUCKETS = 64
+
+class NethogsMonitorRecordExt(ctypes.Structure):
+    """ctypes version of the struct of the same name from libnethogs.h"""
+    _fields_ = (('sent_pps', ctypes.c_float),
+                ('recv_pps', ctypes.c_float),
+                ('size_hist', ctypes.c_uint32 * NETHOGS_HIST_BUCKETS),
+                ('gap_hist', ctypes.c_uint32 * NETHOGS_HIST_BUCKETS),
+                ('sent_retransmits', ctypes.c_uint64),
+                ('recv_retransmits', ctypes.c_uint64),
+                ('sent_zero_windows', ctypes.c_uint64),
+                ('recv_zero_windows', ctypes.c_uint64),
+                ('syns', ctypes.c_uint64),
+                ('fins', ctypes.c_uint64),
+                ('rsts', ctypes.c_uint64),
+                ('handshake_rtt_ms', ctypes.c_float),
+                )
+
 class NethogsMonitorRecord(ctypes.Structure):
     """ctypes version of the struct of the same name from libnethogs.h"""
     _fields_ = (('record_id', ctypes.c_int),
@@ -73,6 +91,11 @@ class NethogsMonitorRecord(ctypes.Structure):
                 ('recv_bytes', ctypes.c_uint64),
                 ('sent_kbs', ctypes.c_float),
                 ('recv_kbs', ctypes.c_float),
+                ('sent_peak_1ms_kbs', ctypes.c_float),
+                ('recv_peak_1ms_kbs', ctypes.c_float),
+                ('sent_peak_10ms_kbs', ctypes.c_float),
+                ('recv_peak_10ms_kbs', ctypes.c_float),
+                ('ext', ctypes.POINTER(NethogsMonitorRecordExt)),
                 )
 
 
@@ -153,6 +176,8 @@ def network_activity_callback(action, data):
     print('Device name: {}'.format(data.contents.device_name.decode('ascii')))
     print('Sent/Recv bytes: {} / {}'.format(data.contents.sent_bytes, data.contents.recv_bytes))
     print('Sent/Recv kbs: {} / {}'.format(data.contents.sent_kbs, data.contents.recv_kbs))
+    print('Sent/Recv packets/s: {} / {}'.format(data.contents.ext.contents.sent_pps,
+                                                 data.contents.ext.contents.recv_pps))
     print('-' * 30)
 
 #############       Main begins here      ##############
@@ -7,7 +7,7 @@ all: nethogs decpcap_test
 CFLAGS?=-Wall -Wextra
 CXXFLAGS?=-Wall -Wextra -Wno-missing-field-initializers
 
-OBJS=packet.o connection.o process.o decpcap.o cui.o inode2prog.o conninode.o devices.o
+OBJS=packet.o connection.o process.o decpcap.o cui.o inode2prog.o conninode.o devices.o sockdiag.o tcbpf.o conntrack.o governor.o pool.o xsk.o
 
 NCURSES_LIBS?=-lncurses
 
@@ -31,8 +31,14 @@ nethogs: main.cpp nethogs.cpp $(OBJS)
 nethogs_testsum: nethogs_testsum.cpp $(OBJS)
 	$(CXX) $(CPPFLAGS) $(CXXFLAGS) $(LDFLAGS) nethogs_testsum.cpp $(OBJS) -o nethogs_testsum -lpcap -lm ${NCURSES_LIBS} -DVERSION=\"$(VERSION)\"
 
-decpcap_test: decpcap_test.cpp decpcap.o
-	$(CXX) $(CPPFLAGS) $(CXXFLAGS) $(LDFLAGS) decpcap_test.cpp decpcap.o -o decpcap_test -lpcap -lm
+decpcap_test: decpcap_test.cpp decpcap.o xsk.o
+	$(CXX) $(CPPFLAGS) $(CXXFLAGS) $(LDFLAGS) decpcap_test.cpp decpcap.o xsk.o -o decpcap_test -lpcap -lm
+parse_test: parse_test.cpp decpcap.o xsk.o
+	$(CXX) $(CPPFLAGS) $(CXXFLAGS) $(LDFLAGS) parse_test.cpp decpcap.o xsk.o -o parse_test -lpcap -lm
+sample_test: sample_test.cpp nethogs.cpp $(filter-out cui.o,$(OBJS))
+	$(CXX) $(CPPFLAGS) $(CXXFLAGS) $(LDFLAGS) sample_test.cpp $(filter-out cui.o,$(OBJS)) -o sample_test -lpcap -lm -DVERSION=\"$(VERSION)\"
+linger_test: linger_test.cpp nethogs.cpp $(filter-out cui.o,$(OBJS))
+	$(CXX) $(CPPFLAGS) $(CXXFLAGS) $(LDFLAGS) linger_test.cpp $(filter-out cui.o,$(OBJS)) -o linger_test -lpcap -lm -DVERSION=\"$(VERSION)\"
 
 #-lefence
 
@@ -42,22 +48,34 @@ packet.o: packet.cpp packet.h nethogs.h
 	$(CXX) $(CPPFLAGS) $(CXXFLAGS) -c packet.cpp
 connection.o: connection.cpp connection.h nethogs.h
 	$(CXX) $(CPPFLAGS) $(CXXFLAGS) -c connection.cpp
-decpcap.o: decpcap.c decpcap.h
+decpcap.o: decpcap.c decpcap.h xsk.h
 	$(CC) $(CPPFLAGS) $(CFLAGS) -c decpcap.c
+xsk.o: xsk.c xsk.h
+	$(CC) $(CPPFLAGS) $(CFLAGS) -c xsk.c
 inode2prog.o: inode2prog.cpp inode2prog.h nethogs.h
 	$(CXX) $(CPPFLAGS) $(CXXFLAGS) -c inode2prog.cpp
 conninode.o: conninode.cpp nethogs.h conninode.h
 	$(CXX) $(CPPFLAGS) $(CXXFLAGS) -c conninode.cpp
+sockdiag.o: sockdiag.cpp sockdiag.h nethogs.h
+	$(CXX) $(CPPFLAGS) $(CXXFLAGS) -c sockdiag.cpp
+tcbpf.o: tcbpf.cpp tcbpf.h nethogs.h
+	$(CXX) $(CPPFLAGS) $(CXXFLAGS) -c tcbpf.cpp
+conntrack.o: conntrack.cpp conntrack.h nethogs.h
+	$(CXX) $(CPPFLAGS) $(CXXFLAGS) -c conntrack.cpp
+governor.o: governor.cpp governor.h nethogs.h decpcap.h
+	$(CXX) $(CPPFLAGS) $(CXXFLAGS) -c governor.cpp
+pool.o: pool.cpp pool.h
+	$(CXX) $(CPPFLAGS) $(CXXFLAGS) -c pool.cpp
 #devices.o: devices.cpp devices.h
 #	$(CXX) $(CXXFLAGS) -c devices.cpp
 cui.o: cui.cpp cui.h nethogs.h
 	$(CXX) $(CPPFLAGS) $(CXXFLAGS) -c cui.cpp -DVERSION=\"$(VERSION)\"
 
-TESTS=conninode_test
+TESTS=conninode_test parse_test sample_test linger_test
 
 .PHONY: test
 test: $(TESTS)
-	for test in $(TESTS); do echo $$test ; ./$$test ; done
+	for test in $(TESTS); do echo $$test ; ./$$test || exit 1 ; done
 
 .PHONY: clean
 clean:
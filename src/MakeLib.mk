@@ -34,7 +34,7 @@ else
   CXXFLAGS?=-Wall -Wextra -Wno-missing-field-initializers --std=c++0x -O3 -fPIC $(VISIBILITY) $(CXXINCLUDES)
 endif
 
-OBJ_NAMES= libnethogs.o packet.o connection.o process.o decpcap.o inode2prog.o conninode.o devices.o
+OBJ_NAMES= libnethogs.o packet.o connection.o process.o decpcap.o inode2prog.o conninode.o devices.o sockdiag.o tcbpf.o conntrack.o governor.o pool.o xsk.o
 OBJS=$(addprefix $(ODIR)/,$(OBJ_NAMES))
 
 #$(info $(OBJS))
@@ -83,10 +83,14 @@ $(ODIR)/connection.o: connection.cpp connection.h nethogs.h
 	@mkdir -p $(ODIR)
 	$(CXX) $(CPPFLAGS) $(CXXFLAGS) -o $@ -c connection.cpp
 
-$(ODIR)/decpcap.o: decpcap.c decpcap.h
+$(ODIR)/decpcap.o: decpcap.c decpcap.h xsk.h
 	@mkdir -p $(ODIR)
 	$(CC) $(CPPFLAGS) $(CFLAGS) -o $@ -c decpcap.c
 
+$(ODIR)/xsk.o: xsk.c xsk.h
+	@mkdir -p $(ODIR)
+	$(CC) $(CPPFLAGS) $(CFLAGS) -o $@ -c xsk.c
+
 $(ODIR)/inode2prog.o: inode2prog.cpp inode2prog.h nethogs.h
 	@mkdir -p $(ODIR)
 	$(CXX) $(CPPFLAGS) $(CXXFLAGS) -o $@ -c inode2prog.cpp
@@ -95,6 +99,26 @@ $(ODIR)/conninode.o: conninode.cpp nethogs.h conninode.h
 	@mkdir -p $(ODIR)
 	$(CXX) $(CPPFLAGS) $(CXXFLAGS) -o $@ -c conninode.cpp
 
+$(ODIR)/sockdiag.o: sockdiag.cpp sockdiag.h nethogs.h
+	@mkdir -p $(ODIR)
+	$(CXX) $(CPPFLAGS) $(CXXFLAGS) -o $@ -c sockdiag.cpp
+
+$(ODIR)/tcbpf.o: tcbpf.cpp tcbpf.h nethogs.h
+	@mkdir -p $(ODIR)
+	$(CXX) $(CPPFLAGS) $(CXXFLAGS) -o $@ -c tcbpf.cpp
+
+$(ODIR)/conntrack.o: conntrack.cpp conntrack.h nethogs.h
+	@mkdir -p $(ODIR)
+	$(CXX) $(CPPFLAGS) $(CXXFLAGS) -o $@ -c conntrack.cpp
+
+$(ODIR)/governor.o: governor.cpp governor.h nethogs.h
+	@mkdir -p $(ODIR)
+	$(CXX) $(CPPFLAGS) $(CXXFLAGS) -o $@ -c governor.cpp
+
+$(ODIR)/pool.o: pool.cpp pool.h
+	@mkdir -p $(ODIR)
+	$(CXX) $(CPPFLAGS) $(CXXFLAGS) -o $@ -c pool.cpp
+
 $(ODIR)/devices.o: devices.cpp devices.h
 	@mkdir -p $(ODIR)
 	$(CXX) $(CXXFLAGS) -o $@ -c devices.cpp
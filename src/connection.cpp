@@ -22,6 +22,7 @@
 
 #include <iostream>
 #include <cassert>
+#include <algorithm>
 #ifdef __APPLE__
 #include <sys/malloc.h>
 #elif __FreeBSD__
@@ -32,75 +33,188 @@
 #include "nethogs.h"
 #include "connection.h"
 #include "process.h"
+#include "sockdiag.h"
 
 ConnList *connections = NULL;
 extern Process *unknownudp;
 
-void PackList::add(Packet *p) {
-  if (content == NULL) {
-    content = new PackListNode(new Packet(*p));
+void PackList::advance(u_int64_t slot) {
+  if (slot <= head)
     return;
+
+  if (slot - head >= PERIOD_BUCKETS) {
+    memset(buckets, 0, sizeof(buckets));
+    sum = 0;
+  } else {
+    for (u_int64_t i = head + 1; i <= slot; i++) {
+      sum -= buckets[i % PERIOD_BUCKETS];
+      buckets[i % PERIOD_BUCKETS] = 0;
+    }
   }
+  head = slot;
+}
 
-  if (content->val->time.tv_sec == p->time.tv_sec) {
-    content->val->len += p->len;
+/* adds to a bucket, which saturates rather than wraps around. Returns what
+ * was added, for the sum */
+static u_int32_t bucket_add(u_int32_t *bucket, u_int64_t len) {
+  u_int32_t const added = std::min(len, (u_int64_t)(UINT32_MAX - *bucket));
+  *bucket += added;
+  return added;
+}
+
+void PackList::add(u_int64_t time, u_int64_t len) {
+  u_int64_t slot = time / BUCKET_NSEC;
+
+  advance(slot);
+  /* older than the whole ring, can't happen with monotonic timestamps */
+  if (slot + PERIOD_BUCKETS <= head)
     return;
+
+  sum += bucket_add(&buckets[slot % PERIOD_BUCKETS], len);
+}
+
+void PackList::spread(u_int64_t from, u_int64_t to, u_int64_t bytes) {
+  u_int64_t first = from / BUCKET_NSEC;
+  u_int64_t last = std::max(first, (u_int64_t)(to / BUCKET_NSEC));
+  u_int64_t n = last - first + 1;
+
+  advance(last);
+  /* the share of the buckets that are already gone is dropped with them */
+  u_int64_t slot = first;
+  if (head + 1 > PERIOD_BUCKETS)
+    slot = std::max(slot, (u_int64_t)(head + 1 - PERIOD_BUCKETS));
+  for (; slot <= last; slot++) {
+    u_int64_t share = bytes / n + (slot - first < bytes % n ? 1 : 0);
+    sum += bucket_add(&buckets[slot % PERIOD_BUCKETS], share);
   }
+}
 
-  /* store copy of packet, so that original may be freed */
-  content = new PackListNode(new Packet(*p), content);
+void PackList::merge(PackList &other) {
+  u_int64_t slot = std::max(head, other.head);
+  advance(slot);
+  other.advance(slot);
+  for (int i = 0; i < PERIOD_BUCKETS; i++)
+    sum += bucket_add(&buckets[i], other.buckets[i]);
+  memset(other.buckets, 0, sizeof(other.buckets));
+  other.sum = 0;
 }
 
 /* sums up the total bytes used and removes 'old' packets */
-u_int64_t PackList::sumanddel(timeval t) {
-  u_int64_t retval = 0;
-  PackListNode *current = content;
-  PackListNode *previous = NULL;
+u_int64_t PackList::sumanddel(u_int64_t t) {
+  advance(t / BUCKET_NSEC);
+  return sum;
+}
 
-  while (current != NULL) {
-    // std::cout << "Comparing " << current->val->time.tv_sec << " <= " <<
-    // t.tv_sec - PERIOD << endl;
-    if (current->val->time.tv_sec <= t.tv_sec - PERIOD) {
-      if (current == content)
-        content = NULL;
-      else if (previous != NULL)
-        previous->next = NULL;
-      delete current;
-      return retval;
+const u_int64_t PeakCounter::width[PEAK_WINDOWS] = {NSEC_PER_MSEC,
+                                                     10 * NSEC_PER_MSEC};
+
+void PeakCounter::add(u_int64_t time, u_int64_t len) {
+  for (int i = 0; i < PEAK_WINDOWS; i++) {
+    u_int64_t s = time / width[i];
+    if (s != slot[i]) {
+      slot[i] = s;
+      bytes[i] = 0;
     }
-    retval += current->val->len;
-    previous = current;
-    current = current->next;
+    bytes[i] += len;
+    if (bytes[i] > peak[i])
+      peak[i] = bytes[i];
   }
-  return retval;
 }
 
-/* packet may be deleted by caller */
-Connection::Connection(Packet *packet) {
-  assert(packet != NULL);
+void PeakCounter::take(u_int64_t peaks[PEAK_WINDOWS]) {
+  for (int i = 0; i < PEAK_WINDOWS; i++) {
+    peaks[i] = peak[i];
+    peak[i] = 0;
+  }
+}
+
+void TcpHealth::add(const tcp_hdr *tcp, u_int32_t payload, bool outgoing,
+                    u_int64_t time) {
+  int dir = outgoing ? 0 : 1;
+  u_int32_t seq = ntohl(tcp->th_seq);
+  /* SYN and FIN take up one sequence number each */
+  u_int32_t len = payload + ((tcp->th_flags & TH_SYN) ? 1 : 0) +
+                  ((tcp->th_flags & TH_FIN) ? 1 : 0);
+
+  if (tcp->th_flags & TH_SYN)
+    syns++;
+  if (tcp->th_flags & TH_FIN)
+    fins++;
+  if (tcp->th_flags & TH_RST) {
+    rsts++;
+    return;
+  }
+  if (tcp->th_win == 0)
+    zerowindows[dir]++;
+
+  if (len > 0) {
+    bool valid = seen & (1 << dir);
+    if (valid && (int32_t)(seq - nxt[dir]) < 0)
+      retransmits[dir]++;
+    if (!valid || (int32_t)(seq + len - nxt[dir]) > 0)
+      nxt[dir] = seq + len;
+    seen |= 1 << dir;
+  }
+
+  if (outgoing && (tcp->th_flags & TH_SYN)) {
+    synseq = seq;
+    syntime = time;
+  } else if (!outgoing && syntime != 0 && (tcp->th_flags & TH_ACK) &&
+             ntohl(tcp->th_ack) == synseq + 1) {
+    rtt = std::max((u_int64_t)1, (time - syntime) / 1000);
+    syntime = 0;
+  }
+}
+
+void TcpHealth::addto(TcpStats *stats) const {
+  for (int i = 0; i < 2; i++) {
+    stats->retransmits[i] += retransmits[i];
+    stats->zerowindows[i] += zerowindows[i];
+  }
+  stats->syns += syns;
+  stats->fins += fins;
+  stats->rsts += rsts;
+  if (rtt != 0) {
+    stats->rtt_sum += rtt;
+    stats->rtt_count++;
+  }
+}
+
+void Connection::init(Packet *packet) {
   connections = new ConnList(this, connections);
   sent_packets = new PackList();
   recv_packets = new PackList();
   sumSent = 0;
   sumRecv = 0;
-  if (DEBUG) {
-    std::cout << "New connection, with package len " << packet->len
-              << std::endl;
-  }
-  if (packet->Outgoing()) {
-    sumSent += packet->len;
-    sent_packets->add(packet);
+  pktsSent = 0;
+  pktsRecv = 0;
+  sampledVariance = 0;
+  fins = 0;
+  closetime = 0;
+  gaps = histgaps ? new LogHistogram() : NULL;
+  tcp = tcphealth ? new TcpHealth() : NULL;
+  if (packet->Outgoing())
     refpacket = new Packet(*packet);
-  } else {
-    sumRecv += packet->len;
-    recv_packets->add(packet);
+  else
     refpacket = packet->newInverted();
-  }
-  lastpacket = packet->time.tv_sec;
+  lastpacket = packet->time;
   if (DEBUG)
     std::cout << "New reference packet created at " << refpacket << std::endl;
 }
 
+/* packet may be deleted by caller */
+Connection::Connection(Packet *packet, bool account) {
+  assert(packet != NULL);
+  init(packet);
+  if (!account)
+    return;
+  if (DEBUG) {
+    std::cout << "New connection, with package len " << packet->len
+              << std::endl;
+  }
+  this->account(packet);
+}
+
 Connection::~Connection() {
   if (DEBUG)
     std::cout << "Deleting connection" << std::endl;
@@ -111,6 +225,9 @@ Connection::~Connection() {
     delete sent_packets;
   if (recv_packets != NULL)
     delete recv_packets;
+  delete gaps;
+  delete tcp;
+  sockdiag_forget(this);
 
   ConnList *curr_conn = connections;
   ConnList *prev_conn = NULL;
@@ -133,22 +250,57 @@ Connection::~Connection() {
 
 /* the packet will be freed by the calling code */
 void Connection::add(Packet *packet) {
-  lastpacket = packet->time.tv_sec;
+  if (gaps != NULL)
+    gaps->add((packet->time - lastpacket) / 1000);
+  lastpacket = packet->time;
+  account(packet);
+}
+
+void Connection::addcounts(bool outgoing, u_int64_t bytes,
+                           u_int64_t packets, u_int64_t from, u_int64_t to) {
+  if (outgoing) {
+    sumSent += bytes;
+    pktsSent += packets;
+    sent_packets->spread(from, to, bytes);
+  } else {
+    sumRecv += bytes;
+    pktsRecv += packets;
+    recv_packets->spread(from, to, bytes);
+  }
+  lastpacket = std::max(lastpacket, to);
+}
+
+/* with sampling, a packet stands for the packet->sample - 1 that weren't
+ * captured as well, so the bytes and packets are scaled up to keep the
+ * estimates unbiased. Each of the packets it stands for was kept with a
+ * chance of 1 in N, which adds (N - 1) * len^2 to the variance of the
+ * bytes (Horvitz-Thompson): N * (N - 1) * len^2 per packet seen, at the
+ * rate it was seen at. The size histogram keeps the packets as seen. */
+void Connection::account(Packet *packet) {
+  u_int32_t const rate = packet->sample;
+  u_int64_t const bytes = (u_int64_t)packet->len * rate;
+
+  sizes.add(packet->len);
+  sampledVariance += (double)rate * (rate - 1) * packet->len * packet->len;
   if (packet->Outgoing()) {
     if (DEBUG) {
       std::cout << "Outgoing: " << packet->len << std::endl;
     }
-    sumSent += packet->len;
-    sent_packets->add(packet);
+    sumSent += bytes;
+    pktsSent += rate;
+    sent_packets->add(packet->time, bytes);
+    sent_peaks.add(packet->time, bytes);
   } else {
     if (DEBUG) {
       std::cout << "Incoming: " << packet->len << std::endl;
     }
-    sumRecv += packet->len;
+    sumRecv += bytes;
+    pktsRecv += rate;
     if (DEBUG) {
       std::cout << "sumRecv now: " << sumRecv << std::endl;
     }
-    recv_packets->add(packet);
+    recv_packets->add(packet->time, bytes);
+    recv_peaks.add(packet->time, bytes);
   }
 }
 
@@ -242,9 +394,32 @@ Connection *findConnection(Packet *packet, short int packettype) {
  * Returns sum of sent packages (by address)
  *	   sum of received packages (by address)
  */
-void Connection::sumanddel(timeval t, u_int64_t *recv, u_int64_t *sent) {
+void Connection::sumanddel(u_int64_t t, u_int64_t *recv, u_int64_t *sent) {
   (*sent) = (*recv) = 0;
 
   *sent = sent_packets->sumanddel(t);
   *recv = recv_packets->sumanddel(t);
 }
+
+void Connection::addflags(u_int8_t flags, bool outgoing, u_int64_t time) {
+  if ((flags & TH_SYN) && !(flags & TH_ACK)) {
+    /* the tuple is being reused */
+    fins = 0;
+    closetime = 0;
+  }
+  if (flags & TH_FIN)
+    fins |= outgoing ? 1 : 2;
+  if (closetime == 0 && ((flags & TH_RST) || fins == 3))
+    closetime = time;
+}
+
+void Connection::mergepackets(PackList *recv, PackList *sent) {
+  recv->merge(*recv_packets);
+  sent->merge(*sent_packets);
+}
+
+void Connection::takepeaks(u_int64_t recv[PEAK_WINDOWS],
+                           u_int64_t sent[PEAK_WINDOWS]) {
+  recv_peaks.take(recv);
+  sent_peaks.take(sent);
+}
@@ -23,52 +23,171 @@
 #define __CONNECTION_H
 
 #include <iostream>
+#include <cstring>
 #include "packet.h"
 
-class PackListNode {
+/* the bytes of the last PERIOD, as a ring of BUCKET_MSEC-wide buckets
+ * with a running sum, so neither adding a packet nor summing up depends
+ * on the number of packets or buckets */
+class PackList {
 public:
-  PackListNode(Packet *m_val, PackListNode *m_next = NULL) {
-    val = m_val;
-    next = m_next;
+  POOLED(PackList)
+
+  PackList() {
+    memset(buckets, 0, sizeof(buckets));
+    head = 0;
+    sum = 0;
   }
-  ~PackListNode() {
-    delete val;
-    if (next != NULL)
-      delete next;
+
+  /* sums up the total bytes used and removes 'old' packets */
+  u_int64_t sumanddel(u_int64_t t);
+
+  void add(u_int64_t time, u_int64_t len);
+
+  /* adds 'bytes' spread evenly over the buckets from 'from' to 'to' */
+  void spread(u_int64_t from, u_int64_t to, u_int64_t bytes);
+
+  /* adds the bytes of another list, which is emptied */
+  void merge(PackList &other);
+
+private:
+  /* moves the head to the bucket of 'slot', emptying the ones passed */
+  void advance(u_int64_t slot);
+
+  /* saturate at UINT32_MAX, which is over 200 GB/s for a bucket */
+  u_int32_t buckets[PERIOD_BUCKETS];
+  /* number of the newest bucket, counted in BUCKET_NSEC since the epoch */
+  u_int64_t head;
+  u_int64_t sum;
+};
+
+/* the most bytes seen within one aligned window of each of the
+ * PEAK_WINDOWS sizes since the last take() */
+class PeakCounter {
+public:
+  PeakCounter() {
+    memset(slot, 0, sizeof(slot));
+    memset(bytes, 0, sizeof(bytes));
+    memset(peak, 0, sizeof(peak));
   }
-  PackListNode *next;
-  Packet *val;
+
+  void add(u_int64_t time, u_int64_t len);
+
+  /* fills in the peaks, in bytes per window, and starts over */
+  void take(u_int64_t peaks[PEAK_WINDOWS]);
+
+  /* width of each window in nanoseconds */
+  static const u_int64_t width[PEAK_WINDOWS];
+
+private:
+  u_int64_t slot[PEAK_WINDOWS];
+  u_int64_t bytes[PEAK_WINDOWS];
+  u_int64_t peak[PEAK_WINDOWS];
 };
 
-class PackList {
+/* keep a histogram of the gaps between packets per connection */
+extern bool histgaps;
+/* track the TCP health of each connection */
+extern bool tcphealth;
+/* 1 in samplerate packets is captured, see dp_setsample. Each Packet has
+ * the rate it was captured at */
+extern unsigned int samplerate;
+
+/* counts of values in HIST_BUCKETS log-spaced buckets: each power of two
+ * is split in four, so a bucket is within 25% of its lower bound, and the
+ * last bucket takes everything from 7 * 2^14 up */
+class LogHistogram {
 public:
-  PackList() { content = NULL; }
-  PackList(Packet *m_val) {
-    assert(m_val != NULL);
-    content = new PackListNode(m_val);
+  POOLED(LogHistogram)
+
+  LogHistogram() { memset(count, 0, sizeof(count)); }
+
+  static int bucket(u_int64_t value) {
+    if (value < 4)
+      return value;
+    int msb = 63 - __builtin_clzll(value);
+    int i = ((msb - 1) << 2) + ((value >> (msb - 2)) & 3);
+    return i < HIST_BUCKETS ? i : HIST_BUCKETS - 1;
   }
-  ~PackList() {
-    if (content != NULL)
-      delete content;
+  /* the smallest value that goes into bucket i */
+  static u_int64_t lower(int i) {
+    return i < 4 ? i : (u_int64_t)(4 + (i & 3)) << ((i >> 2) - 1);
   }
 
-  /* sums up the total bytes used and removes 'old' packets */
-  u_int64_t sumanddel(timeval t);
+  void add(u_int64_t value) { count[bucket(value)]++; }
+  void merge(const LogHistogram &other) {
+    for (int i = 0; i < HIST_BUCKETS; i++)
+      count[i] += other.count[i];
+  }
+
+  u_int32_t count[HIST_BUCKETS];
+};
+
+/* TCP health counters, summed up over connections. Indexed [0] for what
+ * was sent, [1] for what was received */
+struct TcpStats {
+  /* segments that repeat sequence space already seen */
+  u_int64_t retransmits[2];
+  /* segments advertising a zero window */
+  u_int64_t zerowindows[2];
+  u_int64_t syns;
+  u_int64_t fins;
+  u_int64_t rsts;
+  /* handshake round trips, in microseconds */
+  u_int64_t rtt_sum;
+  u_int64_t rtt_count;
+};
+
+/* the TCP state of a connection, as far as it can be followed from the
+ * headers: the next sequence number in each direction, and the time of our
+ * SYN (or SYN-ACK) until it's acknowledged, which gives the round trip of
+ * the handshake */
+class TcpHealth {
+public:
+  POOLED(TcpHealth)
+
+  TcpHealth() {
+    memset(nxt, 0, sizeof(nxt));
+    memset(retransmits, 0, sizeof(retransmits));
+    memset(zerowindows, 0, sizeof(zerowindows));
+    synseq = 0;
+    syntime = 0;
+    rtt = 0;
+    syns = fins = rsts = 0;
+    seen = 0;
+  }
 
-  /* calling code may delete packet */
-  void add(Packet *p);
+  /* 'payload' is the number of data bytes in the segment */
+  void add(const tcp_hdr *tcp, u_int32_t payload, bool outgoing,
+           u_int64_t time);
+  void addto(TcpStats *stats) const;
 
 private:
-  PackListNode *content;
+  u_int32_t nxt[2];
+  u_int32_t retransmits[2];
+  u_int32_t zerowindows[2];
+  u_int32_t synseq;
+  u_int64_t syntime;
+  /* microseconds, 0 until known */
+  u_int32_t rtt;
+  u_int16_t syns;
+  u_int16_t fins;
+  u_int16_t rsts;
+  /* bit per direction: nxt is valid */
+  u_int8_t seen;
 };
 
 class Connection {
 public:
+  POOLED(Connection)
+
   /* constructs a connection, makes a copy of
    * the packet as 'refpacket', and adds the
    * packet to the packlist */
   /* packet may be deleted by caller */
-  Connection(Packet *packet);
+  /* with 'account' false the packet only names the flow, which starts out
+   * empty, for counters added with addcounts */
+  Connection(Packet *packet, bool account = true);
 
   ~Connection();
 
@@ -79,11 +198,30 @@ public:
    */
   void add(Packet *packet);
 
-  int getLastPacket() { return lastpacket; }
+  /* adds 'bytes' and 'packets' that the kernel counted between 'from' and
+   * 'to', spread evenly over that time. There are no packets to go by, so
+   * the peaks and histograms are left alone */
+  void addcounts(bool outgoing, u_int64_t bytes, u_int64_t packets,
+                 u_int64_t from, u_int64_t to);
+
+  u_int64_t getLastPacket() { return lastpacket; }
+
+  /* notes the SYN, FIN and RST flags of a segment */
+  void addflags(u_int8_t flags, bool outgoing, u_int64_t time);
+  /* true when the connection was closed more than CLOSELINGER ago */
+  bool isClosed(u_int64_t t) {
+    return closetime != 0 && closetime + CLOSELINGER * NSEC_PER_SEC <= t;
+  }
 
   /* sums up the total bytes used
    * and removes 'old' packets. */
-  void sumanddel(timeval curtime, u_int64_t *recv, u_int64_t *sent);
+  void sumanddel(u_int64_t curtime, u_int64_t *recv, u_int64_t *sent);
+
+  /* the biggest bursts since the last call, see PeakCounter */
+  void takepeaks(u_int64_t recv[PEAK_WINDOWS], u_int64_t sent[PEAK_WINDOWS]);
+
+  /* moves the bytes of the last PERIOD into the given lists */
+  void mergepackets(PackList *recv, PackList *sent);
 
   /* for checking if a packet is part of this connection */
   /* the reference packet is always *outgoing*. */
@@ -92,11 +230,36 @@ public:
   /* total sum or sent/received bytes */
   u_int64_t sumSent;
   u_int64_t sumRecv;
+  /* total number of sent/received packets */
+  u_int64_t pktsSent;
+  u_int64_t pktsRecv;
+  /* the variance of sumSent + sumRecv, for the error of the estimates
+   * when sampling */
+  double sampledVariance;
+
+  /* sizes of all packets, and the gaps between them in microseconds
+   * (NULL unless histgaps is set) */
+  LogHistogram sizes;
+  LogHistogram *gaps;
+
+  /* NULL unless tcphealth is set */
+  TcpHealth *tcp;
 
 private:
+  /* sets up the lists and counters, and the reference packet */
+  void init(Packet *packet);
+  /* accounts a packet to the totals, the lists and the peaks */
+  void account(Packet *packet);
+
   PackList *sent_packets;
   PackList *recv_packets;
-  int lastpacket;
+  PeakCounter sent_peaks;
+  PeakCounter recv_peaks;
+  u_int64_t lastpacket;
+  /* FIN seen: bit 0 sent, bit 1 received */
+  u_int8_t fins;
+  /* when both FINs or a RST were seen, 0 while open */
+  u_int64_t closetime;
 };
 
 /* Find the connection this packet belongs to */
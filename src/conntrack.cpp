@@ -0,0 +1,463 @@
+/*
+ * conntrack.cpp
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ *USA.
+ *
+ */
+
+#include <iostream>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <string>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "nethogs.h"
+#include "conntrack.h"
+#include "packet.h"
+#include "connection.h"
+#include "process.h"
+
+#ifdef __linux__
+#include <endian.h>
+#include <linux/netlink.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nfnetlink_conntrack.h>
+
+extern local_addr *local_addrs;
+extern ProcList *processes;
+
+/* the pseudo-device of the pseudo-processes, which also tells them apart */
+static const char ct_device[] = "conntrack";
+
+#define ATTR_DATA(attr) ((const char *)(attr) + NLA_HDRLEN)
+#define ATTR_LEN(attr) ((int)(attr)->nla_len - NLA_HDRLEN)
+
+struct ct_tuple {
+  in6_addr src;
+  in6_addr dst;
+  u_int16_t sport;
+  u_int16_t dport;
+  u_int8_t protocol;
+};
+
+/* one conntrack entry; index 0 of the counters is the original direction,
+ * 1 the reply direction */
+struct ct_flow {
+  u_int32_t id;
+  int family;
+  ct_tuple orig;
+  ct_tuple reply;
+  bool counters;
+  u_int64_t bytes[2];
+  u_int64_t packets[2];
+};
+
+/* the counters of an entry at the previous poll or event */
+struct ct_entry {
+  u_int64_t bytes[2];
+  u_int64_t packets[2];
+  unsigned generation;
+};
+
+static std::map<u_int32_t, ct_entry> ct_entries;
+static unsigned ct_generation = 0;
+static bool ct_started = false;
+static u_int64_t ct_last_poll = 0;
+static int ct_events = -1;
+/* the pseudo-processes by name, refreshed at each poll */
+static std::map<std::string, Process *> ct_processes;
+
+/* indexes the nested attributes in 'attr' by type, up to 'max' */
+static void ct_parse(const nlattr *attr, int len, const nlattr **tb,
+                     int max) {
+  memset(tb, 0, (max + 1) * sizeof(nlattr *));
+  while (len >= NLA_HDRLEN && attr->nla_len >= NLA_HDRLEN &&
+         attr->nla_len <= len) {
+    int type = attr->nla_type & NLA_TYPE_MASK;
+    if (type <= max)
+      tb[type] = attr;
+    len -= NLA_ALIGN(attr->nla_len);
+    attr = (const nlattr *)((const char *)attr + NLA_ALIGN(attr->nla_len));
+  }
+}
+
+static void ct_nested(const nlattr *attr, const nlattr **tb, int max) {
+  ct_parse((const nlattr *)ATTR_DATA(attr), ATTR_LEN(attr), tb, max);
+}
+
+static bool ct_tuple_parse(const nlattr *attr, ct_tuple *tuple) {
+  const nlattr *tb[CTA_TUPLE_MAX + 1];
+  const nlattr *ip[CTA_IP_MAX + 1];
+  const nlattr *proto[CTA_PROTO_MAX + 1];
+
+  memset(tuple, 0, sizeof(ct_tuple));
+  ct_nested(attr, tb, CTA_TUPLE_MAX);
+  if (tb[CTA_TUPLE_IP] == NULL || tb[CTA_TUPLE_PROTO] == NULL)
+    return false;
+
+  ct_nested(tb[CTA_TUPLE_IP], ip, CTA_IP_MAX);
+  if (ip[CTA_IP_V4_SRC] != NULL && ip[CTA_IP_V4_DST] != NULL) {
+    memcpy(&tuple->src, ATTR_DATA(ip[CTA_IP_V4_SRC]), sizeof(in_addr));
+    memcpy(&tuple->dst, ATTR_DATA(ip[CTA_IP_V4_DST]), sizeof(in_addr));
+  } else if (ip[CTA_IP_V6_SRC] != NULL && ip[CTA_IP_V6_DST] != NULL) {
+    memcpy(&tuple->src, ATTR_DATA(ip[CTA_IP_V6_SRC]), sizeof(in6_addr));
+    memcpy(&tuple->dst, ATTR_DATA(ip[CTA_IP_V6_DST]), sizeof(in6_addr));
+  } else {
+    return false;
+  }
+
+  ct_nested(tb[CTA_TUPLE_PROTO], proto, CTA_PROTO_MAX);
+  if (proto[CTA_PROTO_NUM] == NULL)
+    return false;
+  tuple->protocol = *(const u_int8_t *)ATTR_DATA(proto[CTA_PROTO_NUM]);
+  if (proto[CTA_PROTO_SRC_PORT] != NULL)
+    tuple->sport =
+        ntohs(*(const u_int16_t *)ATTR_DATA(proto[CTA_PROTO_SRC_PORT]));
+  if (proto[CTA_PROTO_DST_PORT] != NULL)
+    tuple->dport =
+        ntohs(*(const u_int16_t *)ATTR_DATA(proto[CTA_PROTO_DST_PORT]));
+  return true;
+}
+
+static bool ct_counters_parse(const nlattr *attr, u_int64_t *bytes,
+                              u_int64_t *packets) {
+  const nlattr *tb[CTA_COUNTERS_MAX + 1];
+  u_int64_t value;
+
+  ct_nested(attr, tb, CTA_COUNTERS_MAX);
+  if (tb[CTA_COUNTERS_BYTES] == NULL || tb[CTA_COUNTERS_PACKETS] == NULL)
+    return false;
+  memcpy(&value, ATTR_DATA(tb[CTA_COUNTERS_BYTES]), sizeof(value));
+  *bytes = be64toh(value);
+  memcpy(&value, ATTR_DATA(tb[CTA_COUNTERS_PACKETS]), sizeof(value));
+  *packets = be64toh(value);
+  return true;
+}
+
+static bool ct_flow_parse(const nlmsghdr *nlh, ct_flow *flow) {
+  const nfgenmsg *nfg = (const nfgenmsg *)NLMSG_DATA(nlh);
+  const nlattr *tb[CTA_MAX + 1];
+
+  if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(nfgenmsg)))
+    return false;
+  ct_parse((const nlattr *)((const char *)nfg + NLMSG_ALIGN(sizeof(nfgenmsg))),
+           nlh->nlmsg_len - NLMSG_LENGTH(NLMSG_ALIGN(sizeof(nfgenmsg))), tb,
+           CTA_MAX);
+  if (tb[CTA_ID] == NULL || tb[CTA_TUPLE_ORIG] == NULL ||
+      tb[CTA_TUPLE_REPLY] == NULL)
+    return false;
+
+  flow->id = ntohl(*(const u_int32_t *)ATTR_DATA(tb[CTA_ID]));
+  flow->family = nfg->nfgen_family;
+  if (!ct_tuple_parse(tb[CTA_TUPLE_ORIG], &flow->orig) ||
+      !ct_tuple_parse(tb[CTA_TUPLE_REPLY], &flow->reply))
+    return false;
+  flow->counters =
+      tb[CTA_COUNTERS_ORIG] != NULL && tb[CTA_COUNTERS_REPLY] != NULL &&
+      ct_counters_parse(tb[CTA_COUNTERS_ORIG], &flow->bytes[0],
+                        &flow->packets[0]) &&
+      ct_counters_parse(tb[CTA_COUNTERS_REPLY], &flow->bytes[1],
+                        &flow->packets[1]);
+  return true;
+}
+
+static bool ct_islocal(int family, const in6_addr *addr) {
+  if (local_addrs == NULL)
+    return false;
+  if (family == AF_INET) {
+    in_addr_t addr4;
+    memcpy(&addr4, addr, sizeof(addr4));
+    return local_addrs->contains(addr4);
+  }
+  return local_addrs->contains(*addr);
+}
+
+static Packet *ct_packet(int family, const in6_addr *host, u_int16_t port,
+                         bool outgoing, u_int32_t len, u_int64_t time) {
+  direction dir = outgoing ? dir_outgoing : dir_incoming;
+  if (family == AF_INET) {
+    in_addr host4, any4;
+    memcpy(&host4, host, sizeof(host4));
+    any4.s_addr = INADDR_ANY;
+    if (outgoing)
+      return new Packet(host4, port, any4, 0, len, time, dir);
+    return new Packet(any4, 0, host4, port, len, time, dir);
+  }
+  if (outgoing)
+    return new Packet(*host, port, in6addr_any, 0, len, time, dir);
+  return new Packet(in6addr_any, 0, *host, port, len, time, dir);
+}
+
+/* finds or makes the pseudo-process of an internal host and port */
+static Process *ct_process(int family, const in6_addr *host,
+                           u_int8_t protocol, u_int16_t port) {
+  char addr[INET6_ADDRSTRLEN];
+  char name[INET6_ADDRSTRLEN + 16];
+  inet_ntop(family, host, addr, sizeof(addr));
+  if (protocol == IPPROTO_TCP || protocol == IPPROTO_UDP)
+    snprintf(name, sizeof(name), "%s %s/%u", addr,
+             protocol == IPPROTO_TCP ? "tcp" : "udp", port);
+  else
+    snprintf(name, sizeof(name), "%s proto %u", addr, protocol);
+
+  Process *&proc = ct_processes[name];
+  if (proc == NULL) {
+    proc = new Process(0, ct_device, name);
+    processes = new ProcList(proc, processes);
+  }
+  return proc;
+}
+
+/* adds the growth of a group in one direction over [from, to] to the one
+ * connection of its pseudo-process */
+static void ct_add(Process *proc, int family, const in6_addr *host,
+                   u_int16_t port, bool outgoing, u_int64_t bytes,
+                   u_int64_t packets, u_int64_t from, u_int64_t to) {
+  if (proc->connections == NULL) {
+    Packet *packet = ct_packet(family, host, port, outgoing, 0, to);
+    proc->connections = new ConnList(new Connection(packet, false), NULL);
+    delete packet;
+  }
+  proc->connections->getVal()->addcounts(outgoing, bytes, packets, from, to);
+}
+
+/* accounts the growth of a forwarded entry to the internal host: the
+ * source of the original direction, or for port forwards to this host, the
+ * source of the reply direction */
+static void ct_account(const ct_flow *flow, const u_int64_t *bytes,
+                       const u_int64_t *packets, u_int64_t from,
+                       u_int64_t to) {
+  if (ct_islocal(flow->family, &flow->orig.src) ||
+      ct_islocal(flow->family, &flow->reply.src))
+    return;
+
+  bool inbound = ct_islocal(flow->family, &flow->orig.dst);
+  const in6_addr *host = inbound ? &flow->reply.src : &flow->orig.src;
+  u_int16_t port = inbound ? flow->reply.sport : flow->orig.dport;
+  int sent = inbound ? 1 : 0;
+
+  Process *proc = ct_process(flow->family, host, flow->orig.protocol, port);
+  if (bytes[sent] != 0)
+    ct_add(proc, flow->family, host, port, true, bytes[sent],
+              packets[sent], from, to);
+  if (bytes[1 - sent] != 0)
+    ct_add(proc, flow->family, host, port, false, bytes[1 - sent],
+              packets[1 - sent], from, to);
+}
+
+/* handles an entry from the dump or an event */
+static void ct_message(const nlmsghdr *nlh, bool event, u_int64_t from,
+                       u_int64_t to) {
+  ct_flow flow;
+  if (!ct_flow_parse(nlh, &flow))
+    return;
+
+  bool destroyed = NFNL_MSG_TYPE(nlh->nlmsg_type) == IPCTNL_MSG_CT_DELETE;
+  std::map<u_int32_t, ct_entry>::iterator it = ct_entries.find(flow.id);
+  bool known = it != ct_entries.end();
+
+  if (!flow.counters || (event && !destroyed)) {
+    /* a new entry starts from zero */
+    if (!known && flow.counters) {
+      ct_entry entry;
+      memset(&entry, 0, sizeof(entry));
+      entry.generation = ct_generation;
+      ct_entries[flow.id] = entry;
+    }
+    return;
+  }
+
+  u_int64_t bytes[2], packets[2];
+  for (int i = 0; i < 2; i++) {
+    bytes[i] = flow.bytes[i];
+    packets[i] = flow.packets[i];
+    if (known && bytes[i] >= it->second.bytes[i] &&
+        packets[i] >= it->second.packets[i]) {
+      bytes[i] -= it->second.bytes[i];
+      packets[i] -= it->second.packets[i];
+    } else if (!known && !ct_started) {
+      /* don't count what went through before we started */
+      bytes[i] = packets[i] = 0;
+    }
+  }
+
+  if (destroyed) {
+    if (known)
+      ct_entries.erase(it);
+  } else {
+    ct_entry &entry = ct_entries[flow.id];
+    memcpy(entry.bytes, flow.bytes, sizeof(entry.bytes));
+    memcpy(entry.packets, flow.packets, sizeof(entry.packets));
+    entry.generation = ct_generation;
+  }
+
+  if (bytes[0] != 0 || bytes[1] != 0)
+    ct_account(&flow, bytes, packets, from, to);
+}
+
+bool conntrack_open() {
+  ct_events = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                     NETLINK_NETFILTER);
+  if (ct_events < 0)
+    return false;
+
+  sockaddr_nl local;
+  memset(&local, 0, sizeof(local));
+  local.nl_family = AF_NETLINK;
+  local.nl_groups = (1 << (NFNLGRP_CONNTRACK_NEW - 1)) |
+                    (1 << (NFNLGRP_CONNTRACK_DESTROY - 1));
+  if (bind(ct_events, (sockaddr *)&local, sizeof(local)) < 0) {
+    close(ct_events);
+    ct_events = -1;
+    return false;
+  }
+  int rcvbuf = 1 << 20;
+  setsockopt(ct_events, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+  FILE *acct = fopen("/proc/sys/net/netfilter/nf_conntrack_acct", "r");
+  if (acct != NULL) {
+    if (fgetc(acct) == '0')
+      std::cerr << "Conntrack accounting is off, so no bytes will be seen. "
+                   "Enable it with 'sysctl -w "
+                   "net.netfilter.nf_conntrack_acct=1'."
+                << std::endl;
+    fclose(acct);
+  }
+  return true;
+}
+
+void conntrack_close() {
+  if (ct_events >= 0)
+    close(ct_events);
+  ct_events = -1;
+  /* the next conntrack_open starts over */
+  ct_entries.clear();
+  ct_processes.clear();
+  ct_started = false;
+  ct_last_poll = 0;
+}
+
+/* reads the pending events; lost ones (ENOBUFS) are made up for by the
+ * dump, except for the bytes of entries destroyed in between */
+static void ct_read_events(u_int64_t from, u_int64_t to) {
+  long buffer[8192];
+  while (true) {
+    ssize_t len = recv(ct_events, buffer, sizeof(buffer), 0);
+    if (len < 0) {
+      if (errno == ENOBUFS)
+        continue;
+      return;
+    }
+    for (const nlmsghdr *nlh = (const nlmsghdr *)buffer; NLMSG_OK(nlh, len);
+         nlh = NLMSG_NEXT(nlh, len))
+      ct_message(nlh, true, from, to);
+  }
+}
+
+static bool ct_dump(u_int64_t from, u_int64_t to) {
+  int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_NETFILTER);
+  if (fd < 0)
+    return false;
+
+  struct {
+    nlmsghdr nlh;
+    nfgenmsg nfg;
+  } request;
+  memset(&request, 0, sizeof(request));
+  request.nlh.nlmsg_len = NLMSG_LENGTH(sizeof(nfgenmsg));
+  request.nlh.nlmsg_type = (NFNL_SUBSYS_CTNETLINK << 8) | IPCTNL_MSG_CT_GET;
+  request.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+  request.nfg.nfgen_family = AF_UNSPEC;
+  request.nfg.version = NFNETLINK_V0;
+
+  sockaddr_nl kernel;
+  memset(&kernel, 0, sizeof(kernel));
+  kernel.nl_family = AF_NETLINK;
+  if (sendto(fd, &request, request.nlh.nlmsg_len, 0, (sockaddr *)&kernel,
+             sizeof(kernel)) < 0) {
+    close(fd);
+    return false;
+  }
+
+  bool ok = true;
+  bool done = false;
+  long buffer[8192];
+  while (!done) {
+    ssize_t len = recv(fd, buffer, sizeof(buffer), 0);
+    if (len < 0) {
+      ok = false;
+      break;
+    }
+    for (const nlmsghdr *nlh = (const nlmsghdr *)buffer; NLMSG_OK(nlh, len);
+         nlh = NLMSG_NEXT(nlh, len)) {
+      if (nlh->nlmsg_type == NLMSG_DONE) {
+        done = true;
+        break;
+      }
+      if (nlh->nlmsg_type == NLMSG_ERROR) {
+        ok = false;
+        done = true;
+        break;
+      }
+      ct_message(nlh, false, from, to);
+    }
+  }
+
+  close(fd);
+  return ok;
+}
+
+bool conntrack_poll(u_int64_t now) {
+  /* the pseudo-processes that haven't timed out */
+  ct_processes.clear();
+  for (ProcList *current = processes; current != NULL;
+       current = current->getNext()) {
+    if (current->getVal()->devicename == ct_device)
+      ct_processes[current->getVal()->name] = current->getVal();
+  }
+
+  u_int64_t from = ct_last_poll ? ct_last_poll : now;
+  ct_last_poll = now;
+  ct_generation++;
+
+  if (ct_events >= 0)
+    ct_read_events(from, now);
+  if (!ct_dump(from, now))
+    return false;
+  ct_started = true;
+
+  /* forget the entries that went without an event */
+  for (std::map<u_int32_t, ct_entry>::iterator it = ct_entries.begin();
+       it != ct_entries.end();) {
+    if (it->second.generation != ct_generation)
+      ct_entries.erase(it++);
+    else
+      ++it;
+  }
+  return true;
+}
+#else
+bool conntrack_open() { return false; }
+
+bool conntrack_poll(u_int64_t) { return false; }
+
+void conntrack_close() {}
+#endif
@@ -0,0 +1,43 @@
+/*
+ * conntrack.h
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ *USA.
+ *
+ */
+
+#ifndef __CONNTRACK_H
+#define __CONNTRACK_H
+
+#include <sys/types.h>
+
+/* the forwarding backend: reads the byte counters of netfilter's connection
+ * tracking (nf_conntrack_acct) through ctnetlink, and accounts forwarded
+ * traffic to one pseudo-process per internal host and port. Connections
+ * from or to the host itself are left to the other backends, so getLocal()
+ * must have been called for all local interfaces. */
+
+/* subscribes to the events of new and destroyed conntrack entries. Returns
+ * false when ctnetlink isn't available */
+bool conntrack_open();
+
+/* accounts the forwarded traffic since the previous call. Returns false
+ * when the conntrack table can't be dumped */
+bool conntrack_poll(u_int64_t now);
+
+/* unsubscribes, and forgets the entries seen so far */
+void conntrack_close();
+
+#endif
@@ -32,11 +32,12 @@
 #include <ncurses.h>
 #include "nethogs.h"
 #include "process.h"
+#include "governor.h"
 
 std::string *caption;
 extern const char version[];
 extern ProcList *processes;
-extern timeval curtime;
+extern u_int64_t curtime;
 
 extern Process *unknowntcp;
 extern Process *unknownudp;
@@ -47,8 +48,12 @@ extern bool sortRecv;
 extern int viewMode;
 extern bool showcommandline;
 
+/* show the histograms of the top process instead of the table */
+static bool showhistograms = false;
+
 extern unsigned refreshlimit;
 extern unsigned refreshcount;
+extern float cpulimit;
 
 #define PID_MAX 4194303
 
@@ -77,6 +82,11 @@ public:
     devicename = n_devicename;
     m_pid = pid;
     m_uid = uid;
+    memset(sent_peak, 0, sizeof(sent_peak));
+    memset(recv_peak, 0, sizeof(recv_peak));
+    sent_error = 0;
+    recv_error = 0;
+    process = NULL;
     assert(m_pid >= 0);
   }
 
@@ -85,7 +95,14 @@ public:
 
   double sent_value;
   double recv_value;
+  /* peak kb/s per PeakCounter window, in the kb/s view */
+  float sent_peak[PEAK_WINDOWS];
+  float recv_peak[PEAK_WINDOWS];
+  /* the 95% error of the kb/s when sampling */
+  float sent_error;
+  float recv_error;
   const char *devicename;
+  Process *process;
 
 private:
   const char *m_name;
@@ -207,8 +224,13 @@ void Line::show(int row, unsigned int proglen, unsigned int devlen) {
   mvprintw(row, column_offset_sent, COLUMN_FORMAT_SENT, sent_value);
 
   mvprintw(row, column_offset_received, COLUMN_FORMAT_RECEIVED, recv_value);
-  if (viewMode == VIEWMODE_KBPS) {
+  if (viewMode == VIEWMODE_KBPS || viewMode == VIEWMODE_PEAK_1MS ||
+      viewMode == VIEWMODE_PEAK_10MS) {
     mvaddstr(row, column_offset_unit, "KB/sec");
+  } else if (viewMode == VIEWMODE_PACKETS) {
+    mvaddstr(row, column_offset_unit, "pkt/s ");
+  } else if (viewMode == VIEWMODE_RETRANSMITS) {
+    mvaddstr(row, column_offset_unit, "retx  ");
   } else if (viewMode == VIEWMODE_TOTAL_MB) {
     mvaddstr(row, column_offset_unit, "MB    ");
   } else if (viewMode == VIEWMODE_TOTAL_KB) {
@@ -222,7 +244,13 @@ void Line::log() {
   std::cout << m_name;
   if (showcommandline && m_cmdline)
     std::cout << ' ' << m_cmdline;
-  std::cout << '/' << m_pid << '/' << m_uid << "\t" << sent_value << "\t" << recv_value << std::endl;
+  std::cout << '/' << m_pid << '/' << m_uid << "\t" << sent_value << "\t" << recv_value;
+  if (viewMode == VIEWMODE_KBPS)
+    for (int i = 0; i < PEAK_WINDOWS; i++)
+      std::cout << "\t" << sent_peak[i] << "\t" << recv_peak[i];
+  if (viewMode == VIEWMODE_KBPS && samplerate > 1)
+    std::cout << "\t" << sent_error << "\t" << recv_error;
+  std::cout << std::endl;
 }
 
 int get_devlen(Line *lines[], int nproc, int rows)
@@ -310,16 +338,76 @@ void ui_tick() {
   case 'm':
     /* switch mode: total vs kb/s */
     viewMode = (viewMode + 1) % VIEWMODE_COUNT;
+    /* there are no retransmits to show without -T */
+    if (viewMode == VIEWMODE_RETRANSMITS && !tcphealth)
+      viewMode = (viewMode + 1) % VIEWMODE_COUNT;
+    break;
+  case 'h':
+    /* histograms of the top process */
+    showhistograms = !showhistograms;
     break;
   }
 }
 
+/* prints the non-empty buckets as 'lower bound:count' */
+static void log_histogram(const char *what, const LogHistogram &hist) {
+  std::cout << "\t" << what;
+  for (int i = 0; i < HIST_BUCKETS; i++)
+    if (hist.count[i] != 0)
+      std::cout << "\t" << LogHistogram::lower(i) << ':' << hist.count[i];
+  std::cout << std::endl;
+}
+
+/* prints the TCP health of a process on one line */
+static void log_tcpstats(Process *proc) {
+  TcpStats stats;
+  proc->gettcpstats(&stats);
+  std::cout << "\ttcp\t" << stats.retransmits[0] << "\t" << stats.retransmits[1]
+            << "\t" << stats.zerowindows[0] << "\t" << stats.zerowindows[1]
+            << "\t" << stats.syns << "\t" << stats.fins << "\t" << stats.rsts
+            << "\t"
+            << (stats.rtt_count ? stats.rtt_sum / 1000.0 / stats.rtt_count : 0)
+            << std::endl;
+}
+
+/* the packet size and gap histograms of one process, as a table per
+ * histogram starting at 'row' */
+static void show_histograms(Process *proc, int row, int rows, int cols) {
+  LogHistogram sizes, gaps;
+  proc->gethistograms(&sizes, &gaps);
+
+  attron(A_REVERSE);
+  mvprintw(row, 0, "%-*.*s", cols / 2, cols / 2, "     SIZE (B)    PACKETS");
+  if (histgaps)
+    mvprintw(row, cols / 2, "%-*.*s", cols - cols / 2, cols - cols / 2,
+             "     GAP (us)    PACKETS");
+  attroff(A_REVERSE);
+
+  int sizerow = row + 1, gaprow = row + 1;
+  for (int i = 0; i < HIST_BUCKETS; i++) {
+    unsigned long long lower = LogHistogram::lower(i);
+    if (sizes.count[i] != 0 && sizerow < rows)
+      mvprintw(sizerow++, 0, "%13llu %10u", lower, sizes.count[i]);
+    if (histgaps && gaps.count[i] != 0 && gaprow < rows)
+      mvprintw(gaprow++, cols / 2, "%13llu %10u", lower, gaps.count[i]);
+  }
+}
+
 void show_trace(Line *lines[], int nproc) {
   std::cout << "\nRefreshing:\n";
 
   /* print them */
   for (int i = 0; i < nproc; i++) {
     lines[i]->log();
+    if (viewMode == VIEWMODE_PACKETS) {
+      LogHistogram sizes, gaps;
+      lines[i]->process->gethistograms(&sizes, &gaps);
+      log_histogram("sizes", sizes);
+      if (histgaps)
+        log_histogram("gaps", gaps);
+    }
+    if (tcphealth)
+      log_tcpstats(lines[i]->process);
     delete lines[i];
   }
 
@@ -360,12 +448,53 @@ void show_ncurses(Line *lines[], int nproc) {
 
   proglen = cols - 50 - devlen;
 
+  bool peaks = viewMode == VIEWMODE_PEAK_1MS || viewMode == VIEWMODE_PEAK_10MS;
+
   erase();
   mvprintw(0, 0, "%s", caption->c_str());
+  if (peaks)
+    printw(", peaks over %s windows",
+           viewMode == VIEWMODE_PEAK_1MS ? "1 ms" : "10 ms");
+  if (governor_level() > 0)
+    printw(", CPU limit %g%%: reduced fidelity (level %d)", cpulimit,
+           governor_level());
+  if (samplerate > 1) {
+    printw(", sampling 1 in %u packets", samplerate);
+    if (viewMode == VIEWMODE_KBPS && nproc > 0 && !showhistograms)
+      mvprintw(1, 0, "top line within %.3f sent, %.3f received KB/sec (95%%)",
+               lines[0]->sent_error, lines[0]->recv_error);
+  }
+  if (showhistograms && nproc > 0) {
+    mvprintw(2, 0, "Packets of %s (pid %d, %s), press 'h' for all processes",
+             lines[0]->process->name, lines[0]->process->pid,
+             lines[0]->devicename);
+    if (tcphealth) {
+      TcpStats stats;
+      lines[0]->process->gettcpstats(&stats);
+      mvprintw(3, 0,
+               "TCP: retransmits %llu sent, %llu received; zero windows %llu "
+               "sent, %llu received; SYN %llu FIN %llu RST %llu; handshake "
+               "%.3f ms",
+               (unsigned long long)stats.retransmits[0],
+               (unsigned long long)stats.retransmits[1],
+               (unsigned long long)stats.zerowindows[0],
+               (unsigned long long)stats.zerowindows[1],
+               (unsigned long long)stats.syns, (unsigned long long)stats.fins,
+               (unsigned long long)stats.rsts,
+               stats.rtt_count ? stats.rtt_sum / 1000.0 / stats.rtt_count : 0);
+    }
+    show_histograms(lines[0]->process, 5, rows, cols);
+    for (int i = 0; i < nproc; i++)
+      delete lines[i];
+    refresh();
+    return;
+  }
+
   attron(A_REVERSE);
   mvprintw(2, 0,
-           "    PID USER     %-*.*s  %-*.*s       SENT      RECEIVED       ",
-           proglen, proglen, "PROGRAM",devlen,devlen,"DEV");
+           "    PID USER     %-*.*s  %-*.*s%11s%14s       ",
+           proglen, proglen, "PROGRAM",devlen,devlen,"DEV",
+           peaks ? "PEAK SENT" : "SENT", peaks ? "PEAK RECEIVED" : "RECEIVED");
   attroff(A_REVERSE);
 
   /* print them */
@@ -381,8 +510,12 @@ void show_ncurses(Line *lines[], int nproc) {
   int totalrow = std::min(rows - 1, 3 + 1 + i);
   mvprintw(totalrow, 0, "  TOTAL        %-*.*s %-*.*s    %11.3f %11.3f ",
            proglen, proglen, "", devlen,devlen, "", sent_global, recv_global);
-  if (viewMode == VIEWMODE_KBPS) {
+  if (viewMode == VIEWMODE_KBPS || peaks) {
     mvprintw(3 + 1 + i, cols - COLUMN_WIDTH_UNIT, "KB/sec ");
+  } else if (viewMode == VIEWMODE_PACKETS) {
+    mvprintw(3 + 1 + i, cols - COLUMN_WIDTH_UNIT, "pkt/s  ");
+  } else if (viewMode == VIEWMODE_RETRANSMITS) {
+    mvprintw(3 + 1 + i, cols - COLUMN_WIDTH_UNIT, "retx   ");
   } else if (viewMode == VIEWMODE_TOTAL_B) {
     mvprintw(3 + 1 + i, cols - COLUMN_WIDTH_UNIT, "B      ");
   } else if (viewMode == VIEWMODE_TOTAL_KB) {
@@ -397,10 +530,14 @@ void show_ncurses(Line *lines[], int nproc) {
 
 // Display all processes and relevant network traffic using show function
 void do_refresh() {
-  refreshconninode();
+  if (refreshcount % conninodeevery == 0) {
+    refreshconninode();
+    retry_unknown(curtime);
+  }
   refreshcount++;
 
-  if (viewMode == VIEWMODE_KBPS) {
+  if (viewMode == VIEWMODE_KBPS || viewMode == VIEWMODE_PEAK_1MS ||
+      viewMode == VIEWMODE_PEAK_10MS || viewMode == VIEWMODE_PACKETS) {
     remove_timed_out_processes();
   }
 
@@ -425,6 +562,19 @@ void do_refresh() {
 
     if (viewMode == VIEWMODE_KBPS) {
       curproc->getVal()->getkbps(&value_recv, &value_sent);
+    } else if (viewMode == VIEWMODE_PEAK_1MS ||
+               viewMode == VIEWMODE_PEAK_10MS) {
+      curproc->getVal()->getkbps(&value_recv, &value_sent);
+      curproc->getVal()->getpeakkbps(viewMode == VIEWMODE_PEAK_1MS ? 0 : 1,
+                                     &value_recv, &value_sent);
+    } else if (viewMode == VIEWMODE_PACKETS) {
+      curproc->getVal()->getkbps(&value_recv, &value_sent);
+      curproc->getVal()->getpps(&value_recv, &value_sent);
+    } else if (viewMode == VIEWMODE_RETRANSMITS) {
+      TcpStats stats;
+      curproc->getVal()->gettcpstats(&stats);
+      value_sent = stats.retransmits[0];
+      value_recv = stats.retransmits[1];
     } else if (viewMode == VIEWMODE_TOTAL_KB) {
       curproc->getVal()->gettotalkb(&value_recv, &value_sent);
     } else if (viewMode == VIEWMODE_TOTAL_MB) {
@@ -441,6 +591,14 @@ void do_refresh() {
     lines[n] = new Line(curproc->getVal()->name, curproc->getVal()->cmdline,
                         value_recv, value_sent, curproc->getVal()->pid, uid,
                         curproc->getVal()->devicename);
+    lines[n]->process = curproc->getVal();
+    if (viewMode == VIEWMODE_KBPS) {
+      for (int w = 0; w < PEAK_WINDOWS; w++)
+        curproc->getVal()->getpeakkbps(w, &lines[n]->recv_peak[w],
+                                       &lines[n]->sent_peak[w]);
+      curproc->getVal()->geterrorkbps(&lines[n]->recv_error,
+                                      &lines[n]->sent_error);
+    }
     curproc = curproc->next;
     n++;
   }
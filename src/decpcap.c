@@ -21,53 +21,116 @@
  */
 
 #include <sys/types.h>
+#include <sys/socket.h>
 #include <net/ethernet.h>
 #include <net/if.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
 #include <netinet/ip6.h>
 #include <netinet/tcp.h>
+#include <netinet/udp.h>
 #include <string.h> // for memcpy
+#include <time.h>
 #include <pcap.h>
 #include "decpcap.h"
+#include "xsk.h"
 
 #define DP_DEBUG 0
+
+/* ethertypes not (always) provided by net/ethernet.h */
+#ifndef ETHERTYPE_VLAN
+#define ETHERTYPE_VLAN 0x8100 /* IEEE 802.1Q VLAN tag */
+#endif
+#define DP_ETHERTYPE_QINQ 0x88a8     /* IEEE 802.1ad service tag */
+#define DP_ETHERTYPE_QINQ_OLD 0x9100 /* pre-standard QinQ service tag */
+#define DP_ETHERTYPE_MPLS 0x8847     /* MPLS unicast */
+#define DP_ETHERTYPE_MPLS_MC 0x8848  /* MPLS multicast */
+#define DP_ETHERTYPE_TEB 0x6558      /* transparent ethernet bridging */
+
+/* well-known UDP ports of tunnel encapsulations */
+#define DP_PORT_VXLAN 4789
+#define DP_PORT_VXLAN_LINUX 8472 /* default of older linux kernels */
+#define DP_PORT_GENEVE 6081
+
 bool catchall = false;
+
+void dp_setlinktype(struct dp_handle *handle);
+
 /* functions to set up a handle (which is basically just a pcap handle) */
 
-struct dp_handle *dp_fillhandle(pcap_t *phandle) {
+struct dp_handle *dp_newhandle(pcap_t *phandle, struct dp_xsk *xsk,
+                               int linktype) {
   struct dp_handle *retval =
       (struct dp_handle *)malloc(sizeof(struct dp_handle));
   int i;
   retval->pcap_handle = phandle;
+  retval->xsk = xsk;
 
   for (i = 0; i < dp_n_packet_types; i++) {
     retval->callback[i] = NULL;
   }
 
-  retval->linktype = pcap_datalink(retval->pcap_handle);
+  retval->linktype = linktype;
+  retval->nano = false;
+  retval->live = false;
+  retval->ts_offset = 0;
+  retval->last_ts = 0;
+  retval->vlan = DP_VLAN_NONE;
+  retval->vlan_bytes = NULL;
+  retval->frame = NULL;
+  retval->end = NULL;
+  retval->decap = false;
+  retval->decap_overhead = 0;
+  retval->l3 = NULL;
+  retval->l3_end = NULL;
+  retval->l3_family = 0;
+  retval->ifindex = 0;
+  retval->direction = dp_dir_unknown;
+  retval->batch_callback = NULL;
+  retval->batch = NULL;
+  retval->userdata = NULL;
+  retval->userdata_size = 0;
+  retval->filter.bf_len = 0;
+  retval->filter.bf_insns = NULL;
+  retval->expression = NULL;
+  retval->net = 0;
+  retval->sample = 1;
+  retval->sample_threshold = 0;
+  retval->sample_seed = 0;
+  retval->device = NULL;
+  retval->snaplen = 0;
+  retval->promisc = 0;
+  retval->to_ms = 0;
+  retval->buffer_size = 0;
+  retval->immediate = false;
+  retval->nonblock = false;
+  retval->replaced_received = 0;
+  retval->replaced_dropped = 0;
+  memset(retval->frags, 0, sizeof(retval->frags));
+  retval->frag_l4 = false;
 
-  switch (retval->linktype) {
-  case (DLT_EN10MB):
-    fprintf(stdout, "Ethernet link detected\n");
-    break;
-  case (DLT_PPP):
-    fprintf(stdout, "PPP link detected\n");
-    break;
-  case (DLT_LINUX_SLL):
-    fprintf(stdout, "Linux Cooked Socket link detected\n");
-    break;
-  default:
-    fprintf(stdout, "No PPP or Ethernet link: %d\n", retval->linktype);
-    // TODO maybe error? or 'other' callback?
-    break;
-  }
+  dp_setlinktype(retval);
+
+  return retval;
+}
 
+struct dp_handle *dp_fillhandle(pcap_t *phandle) {
+  struct dp_handle *retval =
+      dp_newhandle(phandle, NULL, pcap_datalink(phandle));
+#ifdef PCAP_TSTAMP_PRECISION_NANO
+  retval->nano = pcap_get_tstamp_precision(phandle) ==
+                 PCAP_TSTAMP_PRECISION_NANO;
+#endif
   return retval;
 }
 
 struct dp_handle *dp_open_offline(char *fname, char *ebuf) {
+#ifdef PCAP_TSTAMP_PRECISION_NANO
+  pcap_t *temp = pcap_open_offline_with_tstamp_precision(
+      fname, PCAP_TSTAMP_PRECISION_NANO, ebuf);
+#else
   pcap_t *temp = pcap_open_offline(fname, ebuf);
+#endif
 
   if (temp == NULL) {
     return NULL;
@@ -76,13 +139,82 @@ struct dp_handle *dp_open_offline(char *fname, char *ebuf) {
   return dp_fillhandle(temp);
 }
 
+/*
+ * prefers timestamps taken by the NIC (which libpcap gets through
+ * SO_TIMESTAMPING) over those taken by the kernel when the packet is queued,
+ * and nanoseconds over microseconds. Both are converted to the monotonic
+ * clock in dp_pcap_callback.
+ */
+void dp_set_tstamp(pcap_t *temp) {
+#ifdef PCAP_TSTAMP_PRECISION_NANO
+  int *types;
+  int ntypes = pcap_list_tstamp_types(temp, &types);
+  int i;
+
+  for (i = 0; i < ntypes; i++) {
+    if (types[i] == PCAP_TSTAMP_ADAPTER) {
+      pcap_set_tstamp_type(temp, PCAP_TSTAMP_ADAPTER);
+      break;
+    }
+  }
+  if (ntypes > 0)
+    pcap_free_tstamp_types(types);
+
+  pcap_set_tstamp_precision(temp, PCAP_TSTAMP_PRECISION_NANO);
+#else
+  (void)temp;
+#endif
+}
+
+/* creates and activates a live capture, see dp_open_live */
+pcap_t *dp_activate(const char *device, int snaplen, int promisc, int to_ms,
+                    int buffer_size, bool immediate, char *errbuf) {
+  pcap_t *temp = pcap_create(device, errbuf);
+
+  if (temp == NULL) {
+    return NULL;
+  }
+
+  pcap_set_snaplen(temp, snaplen);
+  pcap_set_promisc(temp, promisc);
+  pcap_set_timeout(temp, to_ms);
+  if (buffer_size > 0)
+    pcap_set_buffer_size(temp, buffer_size);
+#ifdef PCAP_TSTAMP_PRECISION_NANO
+  /* both came with libpcap 1.5 */
+  if (immediate)
+    pcap_set_immediate_mode(temp, 1);
+#else
+  (void)immediate;
+#endif
+  dp_set_tstamp(temp);
+
+  int status = pcap_activate(temp);
+  if (status < 0) {
+    snprintf(errbuf, DP_ERRBUF_SIZE, "%s: %s", pcap_statustostr(status),
+             pcap_geterr(temp));
+    pcap_close(temp);
+    return NULL;
+  }
+
+#ifdef DLT_LINUX_SLL2
+  /* on the 'any' device, prefer the v2 cooked header: it tells which
+   * interface each packet came from. Older libpcaps keep the v1 header. */
+  if (strcmp(device, "any") == 0)
+    pcap_set_datalink(temp, DLT_LINUX_SLL2);
+#endif
+  return temp;
+}
+
 struct dp_handle *dp_open_live(const char *device, int snaplen, int promisc,
-                               int to_ms, char *filter, char *errbuf) {
+                               int to_ms, int buffer_size, bool immediate,
+                               char *filter, char *errbuf) {
   struct bpf_program fp; // compiled filter program
   bpf_u_int32 maskp; // subnet mask
   bpf_u_int32 netp; // interface IP
 
-  pcap_t *temp = pcap_open_live(device, snaplen, promisc, to_ms, errbuf);
+  pcap_t *temp = dp_activate(device, snaplen, promisc, to_ms, buffer_size,
+                             immediate, errbuf);
 
   if (temp == NULL) {
     return NULL;
@@ -113,7 +245,32 @@ struct dp_handle *dp_open_live(const char *device, int snaplen, int promisc,
 
   }
 
-  return dp_fillhandle(temp);
+  struct dp_handle *retval = dp_fillhandle(temp);
+  retval->live = true;
+  if (filter != NULL) {
+    retval->filter = fp;
+    retval->expression = strdup(filter);
+    retval->net = netp;
+  }
+  retval->device = strdup(device);
+  retval->snaplen = snaplen;
+  retval->promisc = promisc;
+  retval->to_ms = to_ms;
+  retval->buffer_size = buffer_size;
+  retval->immediate = immediate;
+  return retval;
+}
+
+struct dp_handle *dp_open_xdp(const char *device, char *errbuf) {
+  struct dp_xsk *xsk = xsk_open(device, errbuf, DP_ERRBUF_SIZE);
+
+  if (xsk == NULL) {
+    return NULL;
+  }
+
+  struct dp_handle *retval = dp_newhandle(NULL, xsk, DLT_EN10MB);
+  retval->live = true;
+  return retval;
 }
 
 /* functions to add callbacks */
@@ -123,13 +280,277 @@ void dp_addcb(struct dp_handle *handle, enum dp_packet_type type,
   handle->callback[type] = callback;
 }
 
+void dp_setbatch(struct dp_handle *handle, dp_batch_callback callback) {
+  if (handle->batch == NULL) {
+    handle->batch = (struct dp_batch *)malloc(sizeof(struct dp_batch));
+    handle->batch->count = 0;
+  }
+  handle->batch_callback = callback;
+}
+
+/* the load of a random number, SKF_AD_OFF + SKF_AD_RANDOM of linux/filter.h */
+#define DP_SKF_AD_RANDOM (0xfffff000 + 56)
+
+void dp_sample_program(const struct bpf_program *filter, int linktype,
+                       u_int32_t threshold, struct bpf_program *sampled) {
+  u_int32_t tail = filter->bf_len;
+  bpf_u_int32 snaplen = 0;
+  sampled->bf_len = tail + 4;
+  sampled->bf_insns =
+      (struct bpf_insn *)malloc(sampled->bf_len * sizeof(struct bpf_insn));
+  for (u_int32_t i = 0; i < tail; i++) {
+    struct bpf_insn insn = filter->bf_insns[i];
+    if (insn.code == (BPF_RET | BPF_K) && insn.k != 0) {
+      snaplen = insn.k;
+      insn.code = BPF_JMP | BPF_JA;
+      insn.jt = insn.jf = 0;
+      insn.k = tail - i - 1;
+    }
+    sampled->bf_insns[i] = insn;
+  }
+
+  /* libpcap moves the loads of a cooked capture back by the header it
+   * puts in front of the packets, which the kernel filter doesn't see */
+  bpf_u_int32 random = DP_SKF_AD_RANDOM;
+  if (linktype == DLT_LINUX_SLL)
+    random += 16;
+#ifdef DLT_LINUX_SLL2
+  if (linktype == DLT_LINUX_SLL2)
+    random += 20;
+#endif
+  struct bpf_insn pick[4] = {
+      {BPF_LD | BPF_W | BPF_ABS, 0, 0, random},
+      {BPF_JMP | BPF_JGE | BPF_K, 1, 0, threshold},
+      {BPF_RET | BPF_K, 0, 0, snaplen},
+      {BPF_RET | BPF_K, 0, 0, 0},
+  };
+  memcpy(sampled->bf_insns + tail, pick, sizeof(pick));
+}
+
+#ifdef __linux__
+/* sets the filter of the handle followed by a random pick, see
+ * dp_sample_program */
+bool dp_sample_filter(struct dp_handle *handle, u_int32_t threshold) {
+  struct bpf_program all;
+  struct bpf_program *filter = &handle->filter;
+
+  if (filter->bf_len == 0) {
+    if (pcap_compile(handle->pcap_handle, &all, "", 1, 0) == -1)
+      return false;
+    filter = &all;
+  }
+
+  struct bpf_program sampled;
+  dp_sample_program(filter, handle->linktype, threshold, &sampled);
+  int status = pcap_setfilter(handle->pcap_handle, &sampled);
+  free(sampled.bf_insns);
+  if (filter == &all)
+    pcap_freecode(&all);
+  return status == 0;
+}
+#endif
+
+/* xorshift32: random enough to pick packets */
+bool dp_sampled_out(struct dp_handle *handle) {
+  u_int32_t x = handle->sample_seed;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  handle->sample_seed = x;
+  return x >= handle->sample_threshold;
+}
+
+/* sets the filter of dp_open_live again, or none at all */
+int dp_setfilter(struct dp_handle *handle) {
+  struct bpf_program all;
+
+  if (handle->filter.bf_len != 0)
+    return pcap_setfilter(handle->pcap_handle, &handle->filter);
+  if (pcap_compile(handle->pcap_handle, &all, "", 1, 0) == -1)
+    return -1;
+  int status = pcap_setfilter(handle->pcap_handle, &all);
+  pcap_freecode(&all);
+  return status;
+}
+
+bool dp_setsample(struct dp_handle *handle, u_int32_t rate) {
+  /* whether the filter of the kernel samples now */
+  bool const kernel = handle->sample > 1 && handle->sample_threshold == 0;
+  u_int32_t const threshold = rate > 1 ? 0xffffffffU / rate : 0;
+
+  /* the packets already queued are dispatched at the rate they were
+   * captured at */
+  if (rate != handle->sample && handle->live && handle->nonblock &&
+      handle->userdata != NULL)
+    dp_dispatch(handle, -1, handle->userdata, handle->userdata_size);
+  handle->sample = rate;
+  handle->sample_threshold = 0;
+#ifdef __linux__
+  if (rate > 1 && handle->live && handle->pcap_handle != NULL &&
+      dp_sample_filter(handle, threshold))
+    return true;
+#endif
+  if (kernel)
+    dp_setfilter(handle);
+  if (rate > 1) {
+    handle->sample_threshold = threshold;
+    handle->sample_seed = (u_int32_t)dp_clock() | 1;
+  }
+  return false;
+}
+
+void dp_count_vlans(struct dp_handle *handle) {
+  if (handle->vlan_bytes == NULL)
+    handle->vlan_bytes = (u_int64_t *)calloc(DP_N_VLANS, sizeof(u_int64_t));
+}
+
+void dp_setdecap(struct dp_handle *handle, bool decap) {
+  handle->decap = decap;
+}
+
 /* functions for parsing the payloads */
 
+void dp_parse_ethernet(struct dp_handle *handle, const dp_header *header,
+                       const u_char *packet);
+void dp_parse_ethertype(struct dp_handle *handle, const dp_header *header,
+                        const u_char *payload, u_int16_t protocol);
+
+/*
+ * tunnels: the encapsulated packet at 'inner' is parsed as if it was
+ * captured by itself. Everything in front of it is tunnel overhead.
+ * 'protocol' is the ethertype of the inner packet, DP_ETHERTYPE_TEB for
+ * a whole ethernet frame.
+ */
+void dp_parse_tunnel(struct dp_handle *handle, const dp_header *header,
+                     const u_char *inner, u_int16_t protocol) {
+  dp_header inner_header = *header;
+
+  /* a later fragment: the packet inside isn't there */
+  if (handle->frag_l4)
+    return;
+  u_int32_t overhead = inner - handle->frame;
+  if (inner >= handle->end || overhead >= header->len)
+    return;
+  inner_header.len = header->len - overhead;
+  inner_header.caplen = handle->end - inner;
+  handle->decap_overhead += overhead;
+  handle->frame = inner;
+
+  if (protocol == DP_ETHERTYPE_TEB)
+    dp_parse_ethernet(handle, &inner_header, inner);
+  else
+    dp_parse_ethertype(handle, &inner_header, inner, protocol);
+}
+
+/* returns the packet inside a VXLAN or GENEVE datagram, or NULL */
+const u_char *dp_udp_tunnel(struct dp_handle *handle, const u_char *packet,
+                            u_int16_t *protocol) {
+  const struct udphdr *udp = (struct udphdr *)packet;
+  const u_char *tunnel = packet + sizeof(struct udphdr);
+
+  if (tunnel + 8 > handle->end)
+    return NULL;
+
+  switch (ntohs(udp->uh_dport)) {
+  case DP_PORT_VXLAN:
+  case DP_PORT_VXLAN_LINUX:
+    /* 8 bytes: flags (I bit set for a valid VNI), 24-bit VNI */
+    if ((tunnel[0] & 0x08) == 0)
+      return NULL;
+    *protocol = DP_ETHERTYPE_TEB;
+    return tunnel + 8;
+  case DP_PORT_GENEVE:
+    /* 8 bytes plus options: version and options length, flags, protocol */
+    if ((tunnel[0] >> 6) != 0)
+      return NULL;
+    *protocol = (tunnel[2] << 8) | tunnel[3];
+    return tunnel + 8 + ((tunnel[0] & 0x3f) << 2);
+  default:
+    return NULL;
+  }
+}
+
+/* GRE (RFC 2784/2890): flags and version, protocol, optional fields */
+void dp_parse_gre(struct dp_handle *handle, const dp_header *header,
+                  const u_char *packet) {
+  const u_char *inner = packet + 4;
+
+  /* version 1 is PPTP's enhanced GRE, not supported */
+  if (packet + 4 > handle->end || (packet[1] & 0x07) != 0)
+    return;
+  if (packet[0] & 0x80) /* checksum present */
+    inner += 4;
+  if (packet[0] & 0x20) /* key present */
+    inner += 4;
+  if (packet[0] & 0x10) /* sequence number present */
+    inner += 4;
+  dp_parse_tunnel(handle, header, inner, (packet[2] << 8) | packet[3]);
+}
+
+void dp_flush(struct dp_handle *handle) {
+  if (handle->batch->count == 0)
+    return;
+  handle->batch_callback(handle->userdata, handle->batch);
+  handle->batch->count = 0;
+}
+
+/* adds a TCP or UDP packet to the batch, and hands the batch over when it's
+ * full. 'packet' is the transport header */
+void dp_batch_add(struct dp_handle *handle, const dp_header *header,
+                  u_int8_t protocol, const u_char *packet) {
+  struct dp_batch *batch = handle->batch;
+  int i = batch->count;
+  int addrlen = handle->l3_family == AF_INET ? 4 : 16;
+
+  if (handle->l3 == NULL)
+    return;
+
+  batch->ts[i] = header->ts;
+  batch->len[i] = header->len;
+  batch->family[i] = handle->l3_family;
+  batch->protocol[i] = protocol;
+  batch->direction[i] = handle->direction;
+  /* TCP and UDP both start with the two ports */
+  batch->sport[i] = (packet[0] << 8) | packet[1];
+  batch->dport[i] = (packet[2] << 8) | packet[3];
+  if (addrlen == 4) {
+    const struct ip *ip = (const struct ip *)handle->l3;
+    memcpy(batch->src[i], &ip->ip_src, 4);
+    memcpy(batch->dst[i], &ip->ip_dst, 4);
+  } else {
+    const struct ip6_hdr *ip6 = (const struct ip6_hdr *)handle->l3;
+    memcpy(batch->src[i], &ip6->ip6_src, 16);
+    memcpy(batch->dst[i], &ip6->ip6_dst, 16);
+  }
+  batch->ifindex[i] = handle->ifindex;
+  batch->sample[i] = handle->sample;
+
+  if (protocol == IPPROTO_TCP) {
+    const u_char *data = packet + ((packet[12] >> 4) << 2);
+    memcpy(batch->tcp[i], packet, sizeof(batch->tcp[i]));
+    /* a later fragment's header comes from the fragment cache, and has no
+     * payload in this frame */
+    batch->payload[i] =
+        !handle->frag_l4 && data < handle->l3_end ? handle->l3_end - data : 0;
+  }
+
+  if (++batch->count == DP_BATCH)
+    dp_flush(handle);
+}
+
 void dp_parse_tcp(struct dp_handle *handle, const dp_header *header,
                   const u_char *packet) {
   // const struct tcphdr * tcp = (struct tcphdr *) packet;
   // u_char * payload = (u_char *) packet + sizeof (struct tcphdr);
 
+  if (packet + sizeof(struct tcphdr) > handle->end)
+    return;
+
+  if (handle->batch_callback != NULL) {
+    dp_batch_add(handle, header, IPPROTO_TCP, packet);
+    return;
+  }
+
   if (handle->callback[dp_packet_tcp] != NULL) {
     int done =
         (handle->callback[dp_packet_tcp])(handle->userdata, header, packet);
@@ -141,14 +562,113 @@ void dp_parse_tcp(struct dp_handle *handle, const dp_header *header,
 
 void dp_parse_udp(struct dp_handle *handle, const dp_header *header,
                   const u_char *packet) {
+  const u_char *inner = NULL;
+  u_int16_t protocol = 0;
+  dp_header outer = *header;
+
+  if (packet + sizeof(struct udphdr) > handle->end)
+    return;
 
-  if (handle->callback[dp_packet_udp] != NULL) {
+  /* a later fragment of a tunnel datagram is accounted to the tunnel as a
+   * whole, the packet inside isn't there */
+  if (handle->decap && !handle->frag_l4) {
+    inner = dp_udp_tunnel(handle, packet, &protocol);
+    /* the tunnel itself only accounts for its overhead */
+    if (inner != NULL && inner < handle->end)
+      outer.len = inner - handle->frame;
+    else
+      inner = NULL;
+  }
+
+  if (catchall && handle->batch_callback != NULL) {
+    dp_batch_add(handle, &outer, IPPROTO_UDP, packet);
+    if (inner == NULL)
+      return;
+  } else if (catchall && handle->callback[dp_packet_udp] != NULL) {
     int done =
-        (handle->callback[dp_packet_udp])(handle->userdata, header, packet);
-    if (done)
+        (handle->callback[dp_packet_udp])(handle->userdata, &outer, packet);
+    /* with decapsulation enabled, the payload of a tunnel is parsed even
+     * when the callback is done with the tunnel packet itself */
+    if (done && inner == NULL)
       return;
   }
-  // TODO: maybe `pass on' payload to lower-level protocol parsing
+
+  if (inner != NULL)
+    dp_parse_tunnel(handle, header, inner, protocol);
+}
+
+/*
+ * fragments: only the first fragment of a datagram carries the transport
+ * header. Its first bytes are remembered in a small direct-mapped table, so
+ * the later fragments can be accounted to the same flow without reassembly.
+ * Fragments whose first fragment wasn't seen (or was evicted) are dropped.
+ */
+struct dp_frag *dp_frag_slot(struct dp_handle *handle, u_int32_t id) {
+  return &handle->frags[(id ^ (id >> 16)) % DP_FRAG_SLOTS];
+}
+
+void dp_frag_store(struct dp_handle *handle, const void *src,
+                   const void *dst, int addrlen, u_int32_t id,
+                   u_int8_t proto, const u_char *l4) {
+  struct dp_frag *frag = dp_frag_slot(handle, id);
+  size_t len = sizeof(frag->l4);
+
+  if (proto != IPPROTO_TCP && proto != IPPROTO_UDP)
+    return;
+  if (l4 + len > handle->end)
+    len = l4 < handle->end ? handle->end - l4 : 0;
+
+  memset(frag, 0, sizeof(struct dp_frag));
+  frag->id = id;
+  frag->proto = proto;
+  frag->addrlen = addrlen;
+  memcpy(frag->src, src, addrlen);
+  memcpy(frag->dst, dst, addrlen);
+  memcpy(frag->l4, l4, len);
+}
+
+const u_char *dp_frag_lookup(struct dp_handle *handle, const void *src,
+                             const void *dst, int addrlen, u_int32_t id,
+                             u_int8_t proto) {
+  struct dp_frag *frag = dp_frag_slot(handle, id);
+
+  if (frag->addrlen != addrlen || frag->id != id || frag->proto != proto ||
+      memcmp(frag->src, src, addrlen) != 0 ||
+      memcmp(frag->dst, dst, addrlen) != 0)
+    return NULL;
+  /* the rest of the datagram isn't there, don't parse past the header */
+  handle->end = frag->l4 + sizeof(frag->l4);
+  handle->frag_l4 = true;
+  return frag->l4;
+}
+
+/* hands the transport header to the matching parser */
+void dp_parse_transport(struct dp_handle *handle, const dp_header *header,
+                        u_int8_t protocol, const u_char *payload) {
+  switch (protocol) {
+  case IPPROTO_TCP:
+    dp_parse_tcp(handle, header, payload);
+    break;
+  case IPPROTO_UDP:
+    if (catchall || handle->decap)
+      dp_parse_udp(handle, header, payload);
+    break;
+  case IPPROTO_GRE:
+    if (handle->decap)
+      dp_parse_gre(handle, header, payload);
+    break;
+  case IPPROTO_IPIP:
+    if (handle->decap)
+      dp_parse_tunnel(handle, header, payload, ETHERTYPE_IP);
+    break;
+  case IPPROTO_IPV6:
+    if (handle->decap)
+      dp_parse_tunnel(handle, header, payload, ETHERTYPE_IPV6);
+    break;
+  default:
+    // TODO: maybe support for non-tcp IP packets
+    break;
+  }
 }
 
 void dp_parse_ip(struct dp_handle *handle, const dp_header *header,
@@ -157,7 +677,15 @@ void dp_parse_ip(struct dp_handle *handle, const dp_header *header,
   if (DP_DEBUG) {
     fprintf(stdout, "Looking at packet with length %ud\n", header->len);
   }
-  u_char *payload = (u_char *)packet + sizeof(struct ip);
+  if (packet + sizeof(struct ip) > handle->end || ip->ip_hl < 5)
+    return;
+  /* the header length includes any options */
+  const u_char *payload = packet + (ip->ip_hl << 2);
+  u_int16_t offset = ntohs(ip->ip_off);
+
+  handle->l3 = packet;
+  handle->l3_end = packet + ntohs(ip->ip_len);
+  handle->l3_family = AF_INET;
 
   if (handle->callback[dp_packet_ip] != NULL) {
     int done =
@@ -165,24 +693,49 @@ void dp_parse_ip(struct dp_handle *handle, const dp_header *header,
     if (done)
       return;
   }
-  switch (ip->ip_p) {
-  case IPPROTO_TCP:
-    dp_parse_tcp(handle, header, payload);
-    break;
-  case IPPROTO_UDP:
-    if(catchall)
-      dp_parse_udp(handle, header, payload);
-    break;
+
+  if (offset & IP_OFFMASK) {
+    payload = dp_frag_lookup(handle, &ip->ip_src, &ip->ip_dst,
+                             sizeof(struct in_addr), ntohs(ip->ip_id), ip->ip_p);
+    if (payload == NULL)
+      return;
+  } else if (offset & IP_MF) {
+    dp_frag_store(handle, &ip->ip_src, &ip->ip_dst, sizeof(struct in_addr),
+                  ntohs(ip->ip_id), ip->ip_p, payload);
+  }
+  dp_parse_transport(handle, header, ip->ip_p, payload);
+}
+
+/* IPv6 extension headers we know how to skip */
+bool dp_ip6_exthdr(u_int8_t nxt) {
+  switch (nxt) {
+  case IPPROTO_HOPOPTS:
+  case IPPROTO_ROUTING:
+  case IPPROTO_FRAGMENT:
+  case IPPROTO_DSTOPTS:
+  case IPPROTO_AH:
+  case 135: /* mobility */
+  case 139: /* HIP */
+  case 140: /* shim6 */
+    return true;
   default:
-    // TODO: maybe support for non-tcp IP packets
-    break;
+    return false;
   }
 }
 
 void dp_parse_ip6(struct dp_handle *handle, const dp_header *header,
                   const u_char *packet) {
   const struct ip6_hdr *ip6 = (struct ip6_hdr *)packet;
-  u_char *payload = (u_char *)packet + sizeof(struct ip6_hdr);
+  if (packet + sizeof(struct ip6_hdr) > handle->end)
+    return;
+  const u_char *payload = packet + sizeof(struct ip6_hdr);
+  u_int8_t nxt = ip6->ip6_nxt;
+  const struct ip6_frag *frag = NULL;
+  int i;
+
+  handle->l3 = packet;
+  handle->l3_end = payload + ntohs(ip6->ip6_plen);
+  handle->l3_family = AF_INET6;
 
   if (handle->callback[dp_packet_ip6] != NULL) {
     int done =
@@ -190,16 +743,93 @@ void dp_parse_ip6(struct dp_handle *handle, const dp_header *header,
     if (done)
       return;
   }
-  switch ((ip6->ip6_ctlun).ip6_un1.ip6_un1_nxt) {
-  case IPPROTO_TCP:
-    dp_parse_tcp(handle, header, payload);
+
+  /* walk the extension header chain up to the transport header. All of them
+   * start with (next header, length); the length is in 8-byte units not
+   * counting the first 8 bytes, except for AH which counts 4-byte units
+   * minus 2. The fragment header has a fixed size of 8, its 'length' byte is
+   * reserved and always 0, so the generic formula covers it too. */
+  for (i = 0; i < DP_MAX_IP6_EXTHDRS && dp_ip6_exthdr(nxt); i++) {
+    if (payload + 8 > handle->end)
+      return;
+    const u_char *exthdr = payload;
+    if (nxt == IPPROTO_FRAGMENT)
+      frag = (const struct ip6_frag *)exthdr;
+    payload += (nxt == IPPROTO_AH) ? (exthdr[1] + 2) << 2
+                                   : (exthdr[1] + 1) << 3;
+    nxt = exthdr[0];
+  }
+
+  if (frag != NULL) {
+    u_int32_t id = ntohl(frag->ip6f_ident);
+    if (frag->ip6f_offlg & IP6F_OFF_MASK) {
+      payload = dp_frag_lookup(handle, &ip6->ip6_src, &ip6->ip6_dst,
+                               sizeof(struct in6_addr), id, nxt);
+      if (payload == NULL)
+        return;
+    } else if (frag->ip6f_offlg & IP6F_MORE_FRAG) {
+      dp_frag_store(handle, &ip6->ip6_src, &ip6->ip6_dst,
+                    sizeof(struct in6_addr), id, nxt, payload);
+    }
+  }
+  dp_parse_transport(handle, header, nxt, payload);
+}
+
+/*
+ * dispatches the payload of a frame with the given ethertype. Any number of
+ * 802.1Q/802.1ad VLAN tags and MPLS labels in front of the network header are
+ * peeled off here in a loop, so tagged traffic takes no extra callbacks.
+ */
+void dp_parse_ethertype(struct dp_handle *handle, const dp_header *header,
+                        const u_char *payload, u_int16_t protocol) {
+  handle->vlan = DP_VLAN_NONE;
+
+  while (protocol == ETHERTYPE_VLAN || protocol == DP_ETHERTYPE_QINQ ||
+         protocol == DP_ETHERTYPE_QINQ_OLD) {
+    /* 2 bytes of tag control information, then the next ethertype */
+    if (payload + 4 > handle->end)
+      return;
+    if (handle->vlan == DP_VLAN_NONE)
+      handle->vlan = ((payload[0] << 8) | payload[1]) & 0x0fff;
+    protocol = (payload[2] << 8) | payload[3];
+    payload += 4;
+  }
+
+  if (handle->vlan_bytes != NULL && handle->vlan != DP_VLAN_NONE)
+    handle->vlan_bytes[handle->vlan] += header->len;
+
+  if (protocol == DP_ETHERTYPE_MPLS || protocol == DP_ETHERTYPE_MPLS_MC) {
+    /* pop labels up to and including the one with the bottom-of-stack bit */
+    do {
+      if (payload + 4 > handle->end)
+        return;
+      payload += 4;
+    } while ((payload[-2] & 0x01) == 0);
+
+    /* MPLS doesn't say what it carries; go by the IP version nibble */
+    if (payload >= handle->end)
+      return;
+    switch (payload[0] >> 4) {
+    case 4:
+      protocol = ETHERTYPE_IP;
+      break;
+    case 6:
+      protocol = ETHERTYPE_IPV6;
+      break;
+    default:
+      return;
+    }
+  }
+
+  switch (protocol) {
+  case ETHERTYPE_IP:
+    dp_parse_ip(handle, header, payload);
     break;
-  case IPPROTO_UDP:
-    if(catchall)
-      dp_parse_udp(handle, header, payload);
+  case ETHERTYPE_IPV6:
+    dp_parse_ip6(handle, header, payload);
     break;
   default:
-    // TODO: maybe support for non-tcp ipv6 packets
+    // TODO: maybe support for other protocols apart from IPv4 and IPv6
     break;
   }
 }
@@ -222,17 +852,7 @@ void dp_parse_ethernet(struct dp_handle *handle, const dp_header *header,
 
   /* parse payload */
   protocol = ntohs(ethernet->ether_type);
-  switch (protocol) {
-  case ETHERTYPE_IP:
-    dp_parse_ip(handle, header, payload);
-    break;
-  case ETHERTYPE_IPV6:
-    dp_parse_ip6(handle, header, payload);
-    break;
-  default:
-    // TODO: maybe support for other protocols apart from IPv4 and IPv6
-    break;
-  }
+  dp_parse_ethertype(handle, header, payload, protocol);
 }
 
 /* ppp header, i hope ;) */
@@ -281,6 +901,28 @@ void dp_parse_ppp(struct dp_handle *handle, const dp_header *header,
   }
 }
 
+/* the sll_pkttype values of linux/if_packet.h */
+#define DP_PACKET_HOST 0
+#define DP_PACKET_BROADCAST 1
+#define DP_PACKET_MULTICAST 2
+#define DP_PACKET_OUTGOING 4
+
+/* the direction of a packet type. A PACKET_OTHERHOST frame, seen in
+ * promiscuous mode or on a bridge, is neither ours to send nor to receive;
+ * the addresses will have to tell */
+enum dp_direction dp_pkttype_direction(unsigned int pkttype) {
+  switch (pkttype) {
+  case DP_PACKET_HOST:
+  case DP_PACKET_BROADCAST:
+  case DP_PACKET_MULTICAST:
+    return dp_dir_incoming;
+  case DP_PACKET_OUTGOING:
+    return dp_dir_outgoing;
+  default:
+    return dp_dir_unknown;
+  }
+}
+
 /* linux cooked header, i hope ;) */
 /* glanced from libpcap/ssl.h */
 #define SLL_ADDRLEN 8 /* length of address field */
@@ -298,6 +940,11 @@ void dp_parse_linux_cooked(struct dp_handle *handle, const dp_header *header,
   u_char *payload = (u_char *)packet + sizeof(struct sll_header);
   u_int16_t protocol = 0;
 
+  if (payload > handle->end)
+    return;
+
+  handle->direction = dp_pkttype_direction(ntohs(sll->sll_pkttype));
+
   /* call handle if it exists */
   if (handle->callback[dp_packet_sll] != NULL) {
     int done =
@@ -310,62 +957,357 @@ void dp_parse_linux_cooked(struct dp_handle *handle, const dp_header *header,
 
   /* parse payload */
   protocol = ntohs(sll->sll_protocol);
-  switch (protocol) {
-  case ETHERTYPE_IP:
-    dp_parse_ip(handle, header, payload);
+  dp_parse_ethertype(handle, header, payload, protocol);
+}
+
+void dp_parse_linux_cooked2(struct dp_handle *handle, const dp_header *header,
+                            const u_char *packet) {
+  const struct dp_sll2_header *sll2 = (struct dp_sll2_header *)packet;
+  u_char *payload = (u_char *)packet + sizeof(struct dp_sll2_header);
+
+  if (payload > handle->end)
+    return;
+
+  handle->ifindex = ntohl(sll2->sll2_if_index);
+  handle->direction = dp_pkttype_direction(sll2->sll2_pkttype);
+
+  /* call handle if it exists */
+  if (handle->callback[dp_packet_sll2] != NULL) {
+    int done =
+        (handle->callback[dp_packet_sll2])(handle->userdata, header, packet);
+
+    /* return if handle decides we're done */
+    if (done)
+      return;
+  }
+
+  /* parse payload */
+  dp_parse_ethertype(handle, header, payload, ntohs(sll2->sll2_protocol));
+}
+
+/* DLT_NULL and DLT_LOOP: a 4-byte address family in front of the packet.
+ * That's host byte order of the capturing machine for DLT_NULL (swapped if it
+ * looks too big), and network byte order for DLT_LOOP. AF_INET6 differs per
+ * OS, so all known values are accepted. */
+void dp_parse_family(struct dp_handle *handle, const dp_header *header,
+                     const u_char *packet, u_int32_t family) {
+  switch (family) {
+  case 2: /* AF_INET everywhere */
+    dp_parse_ip(handle, header, packet + 4);
     break;
-  case ETHERTYPE_IPV6:
-    dp_parse_ip6(handle, header, payload);
+  case 10: /* AF_INET6 on Linux */
+  case 24: /* NetBSD, OpenBSD */
+  case 28: /* FreeBSD */
+  case 30: /* Darwin */
+    dp_parse_ip6(handle, header, packet + 4);
     break;
   default:
-    // TODO: support for other than IPv4 / IPv6
     break;
   }
 }
 
-/* functions to do the monitoring */
-void dp_pcap_callback(u_char *u_handle, const struct pcap_pkthdr *header,
-                      const u_char *packet) {
-  struct dp_handle *handle = (struct dp_handle *)u_handle;
-  struct dp_header;
+void dp_parse_null(struct dp_handle *handle, const dp_header *header,
+                   const u_char *packet) {
+  u_int32_t family;
+
+  if (packet + 4 > handle->end)
+    return;
+  memcpy(&family, packet, 4);
+  if (family > 0xffff)
+    family = ((family & 0xff) << 24) | ((family & 0xff00) << 8) |
+             ((family >> 8) & 0xff00) | (family >> 24);
+  dp_parse_family(handle, header, packet, family);
+}
+
+void dp_parse_loop(struct dp_handle *handle, const dp_header *header,
+                   const u_char *packet) {
+  u_int32_t family;
+
+  if (packet + 4 > handle->end)
+    return;
+  memcpy(&family, packet, 4);
+  dp_parse_family(handle, header, packet, ntohl(family));
+}
+
+/* DLT_RAW: no link layer header, the IP version tells what follows */
+void dp_parse_raw(struct dp_handle *handle, const dp_header *header,
+                  const u_char *packet) {
+  if (packet >= handle->end)
+    return;
+
+  switch (packet[0] >> 4) {
+  case 4:
+    dp_parse_ip(handle, header, packet);
+    break;
+  case 6:
+    dp_parse_ip6(handle, header, packet);
+    break;
+  default:
+    break;
+  }
+}
 
-  /* make a copy of the userdata for every packet */
-  u_char *userdata_copy = (u_char *)malloc(handle->userdata_size);
-  memcpy(userdata_copy, handle->userdata, handle->userdata_size);
+void dp_parse_unknown(struct dp_handle *handle, const dp_header *header,
+                      const u_char *packet) {
+  (void)header;
+  (void)packet;
+  fprintf(stdout, "Unknown linktype %d", handle->linktype);
+}
 
+/* picks the parser of the link type, so packets don't have to be
+ * dispatched on it one by one */
+void dp_setlinktype(struct dp_handle *handle) {
   switch (handle->linktype) {
   case (DLT_EN10MB):
-    dp_parse_ethernet(handle, header, packet);
+    fprintf(stdout, "Ethernet link detected\n");
+    handle->parse_link = dp_parse_ethernet;
     break;
   case (DLT_PPP):
-    dp_parse_ppp(handle, header, packet);
+    fprintf(stdout, "PPP link detected\n");
+    handle->parse_link = dp_parse_ppp;
     break;
   case (DLT_LINUX_SLL):
-    dp_parse_linux_cooked(handle, header, packet);
+    fprintf(stdout, "Linux Cooked Socket link detected\n");
+    handle->parse_link = dp_parse_linux_cooked;
     break;
-  case (DLT_RAW):
+#ifdef DLT_LINUX_SLL2
+  case (DLT_LINUX_SLL2):
+    fprintf(stdout, "Linux Cooked Socket v2 link detected\n");
+    handle->parse_link = dp_parse_linux_cooked2;
+    break;
+#endif
   case (DLT_NULL):
-    // hope for the best
-    dp_parse_ip(handle, header, packet);
+    fprintf(stdout, "Loopback link detected\n");
+    handle->parse_link = dp_parse_null;
+    break;
+  case (DLT_LOOP):
+    fprintf(stdout, "Loopback link detected\n");
+    handle->parse_link = dp_parse_loop;
+    break;
+  case (DLT_RAW):
+    fprintf(stdout, "Raw IP link detected\n");
+    handle->parse_link = dp_parse_raw;
     break;
   default:
-    fprintf(stdout, "Unknown linktype %d", handle->linktype);
+    fprintf(stdout, "No PPP or Ethernet link: %d\n", handle->linktype);
+    // TODO maybe error? or 'other' callback?
+    handle->parse_link = dp_parse_unknown;
     break;
   }
-  free(userdata_copy);
+}
+
+/* functions to do the monitoring */
+
+u_int64_t dp_timespec(const struct timespec *ts) {
+  return ts->tv_sec * DP_NSEC_PER_SEC + ts->tv_nsec;
+}
+
+u_int64_t dp_clock(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return dp_timespec(&now);
+}
+
+/* moves the wall clock timestamp of a packet to the monotonic clock. The
+ * offset between the two is refreshed on every dispatch of a live capture,
+ * so a step of the wall clock only affects the packets queued around it.
+ * Those are clamped to keep the timestamps of a handle from going back. */
+u_int64_t dp_monotonic(struct dp_handle *handle, const struct timeval *tv) {
+  u_int64_t ts = tv->tv_sec * DP_NSEC_PER_SEC +
+                 (u_int64_t)tv->tv_usec * (handle->nano ? 1 : 1000);
+
+  /* a savefile replays at its original pace, starting now */
+  if (handle->last_ts == 0 && handle->ts_offset == 0)
+    handle->ts_offset = ts - dp_clock();
+
+  ts -= handle->ts_offset;
+  if (ts < handle->last_ts)
+    ts = handle->last_ts;
+  handle->last_ts = ts;
+  return ts;
+}
+
+void dp_parse_frame(struct dp_handle *handle, const dp_header *header,
+                    const u_char *packet) {
+  if (handle->sample_threshold != 0 && dp_sampled_out(handle))
+    return;
+
+  handle->frame = packet;
+  handle->end = packet + header->caplen;
+  handle->l3 = NULL;
+  handle->frag_l4 = false;
+  handle->ifindex = 0;
+  handle->direction = dp_dir_unknown;
+
+  handle->parse_link(handle, header, packet);
+}
+
+void dp_pcap_callback(u_char *u_handle, const struct pcap_pkthdr *pcap_header,
+                      const u_char *packet) {
+  struct dp_handle *handle = (struct dp_handle *)u_handle;
+  dp_header header;
+
+  header.ts = dp_monotonic(handle, &pcap_header->ts);
+  header.caplen = pcap_header->caplen;
+  header.len = pcap_header->len;
+
+  dp_parse_frame(handle, &header, packet);
+}
+
+/* the frames of an AF_XDP handle are parsed in the UMEM, where the kernel
+ * put them. They carry no timestamp, so they get the time of the dispatch
+ * that found them. */
+void dp_xsk_callback(u_char *u_handle, const u_char *packet, u_int32_t len) {
+  struct dp_handle *handle = (struct dp_handle *)u_handle;
+  dp_header header;
+
+  header.ts = handle->last_ts;
+  header.caplen = len;
+  header.len = len;
+
+  dp_parse_frame(handle, &header, packet);
 }
 
 int dp_dispatch(struct dp_handle *handle, int count, u_char *user, int size) {
   handle->userdata = user;
   handle->userdata_size = size;
-  return pcap_dispatch(handle->pcap_handle, count, dp_pcap_callback,
-                       (u_char *)handle);
+  if (handle->xsk != NULL) {
+    handle->last_ts = dp_clock();
+    int retval = xsk_receive(handle->xsk, dp_xsk_callback, (u_char *)handle);
+    if (handle->batch_callback != NULL)
+      dp_flush(handle);
+    return retval;
+  }
+  if (handle->live) {
+    struct timespec wall;
+    clock_gettime(CLOCK_REALTIME, &wall);
+    handle->ts_offset = dp_timespec(&wall) - dp_clock();
+  }
+  int retval = pcap_dispatch(handle->pcap_handle, count, dp_pcap_callback,
+                             (u_char *)handle);
+  if (handle->batch_callback != NULL)
+    dp_flush(handle);
+  return retval;
 }
 
+int dp_stats(struct dp_handle *handle, u_int64_t *received,
+             u_int64_t *dropped) {
+  struct pcap_stat stats;
+
+  if (handle->xsk != NULL) {
+    xsk_stats(handle->xsk, received, dropped);
+    return 0;
+  }
+  if (pcap_stats(handle->pcap_handle, &stats) == -1)
+    return -1;
+  *received = handle->replaced_received + stats.ps_recv;
+  *dropped = handle->replaced_dropped + stats.ps_drop + stats.ps_ifdrop;
+  return 0;
+}
+
+int dp_setsnaplen(struct dp_handle *handle, int snaplen, char *errbuf) {
+  struct bpf_program fp;
+  struct bpf_insn none[1] = {{BPF_RET | BPF_K, 0, 0, 0}};
+  struct bpf_program nothing = {1, none};
+  u_int64_t received, dropped;
+
+  if (!handle->live || handle->pcap_handle == NULL ||
+      snaplen == handle->snaplen)
+    return 0;
+
+  /* the old capture is stopped before the new one starts, so no packet is
+   * seen by both, and its counts are final. What's queued on it is
+   * dispatched first; what arrives in between is lost */
+  if (handle->nonblock && handle->userdata != NULL)
+    dp_dispatch(handle, -1, handle->userdata, handle->userdata_size);
+  if (pcap_setfilter(handle->pcap_handle, &nothing) == -1) {
+    snprintf(errbuf, DP_ERRBUF_SIZE, "%s", pcap_geterr(handle->pcap_handle));
+    return -1;
+  }
+
+  bool ok = false;
+  pcap_t *temp = dp_activate(handle->device, snaplen, handle->promisc,
+                             handle->to_ms, handle->buffer_size,
+                             handle->immediate, errbuf);
+  /* the filter accepts packets by returning the snapshot length, so it's
+   * compiled again for the new one */
+  fp.bf_len = 0;
+  fp.bf_insns = NULL;
+  if (temp != NULL) {
+    if (handle->expression != NULL &&
+        (pcap_compile(temp, &fp, handle->expression, 1, handle->net) == -1 ||
+         pcap_setfilter(temp, &fp) == -1))
+      snprintf(errbuf, DP_ERRBUF_SIZE, "%s", pcap_geterr(temp));
+    else
+      ok = !handle->nonblock || pcap_setnonblock(temp, 1, errbuf) != -1;
+  }
+  if (!ok) {
+    if (fp.bf_len != 0)
+      pcap_freecode(&fp);
+    if (temp != NULL)
+      pcap_close(temp);
+    /* the old capture goes on, with its filter and sampling */
+    u_int32_t rate = handle->sample;
+    handle->sample = 1;
+    handle->sample_threshold = 0;
+    dp_setfilter(handle);
+    dp_setsample(handle, rate);
+    return -1;
+  }
+
+  if (dp_stats(handle, &received, &dropped) == 0) {
+    handle->replaced_received = received;
+    handle->replaced_dropped = dropped;
+  }
+  pcap_close(handle->pcap_handle);
+  if (handle->filter.bf_len != 0)
+    pcap_freecode(&handle->filter);
+  handle->pcap_handle = temp;
+  handle->filter = fp;
+  handle->snaplen = snaplen;
+#ifdef PCAP_TSTAMP_PRECISION_NANO
+  handle->nano =
+      pcap_get_tstamp_precision(temp) == PCAP_TSTAMP_PRECISION_NANO;
+#endif
+
+  /* the new capture doesn't sample yet */
+  u_int32_t rate = handle->sample;
+  handle->sample = 1;
+  handle->sample_threshold = 0;
+  dp_setsample(handle, rate);
+  return 0;
+}
+
+int dp_get_selectable_fd(struct dp_handle *handle) {
+  if (handle->xsk != NULL)
+    return xsk_fd(handle->xsk);
+  return pcap_get_selectable_fd(handle->pcap_handle);
+}
+
+/* AF_XDP sockets never block: dp_dispatch only looks at the rings */
 int dp_setnonblock(struct dp_handle *handle, int i, char *errbuf) {
+  if (handle->xsk != NULL)
+    return 0;
+  handle->nonblock = i != 0;
   return pcap_setnonblock(handle->pcap_handle, i, errbuf);
 }
 
 char *dp_geterr(struct dp_handle *handle) {
+  if (handle->xsk != NULL)
+    return xsk_geterr(handle->xsk);
   return pcap_geterr(handle->pcap_handle);
 }
+
+void dp_close(struct dp_handle *handle) {
+  if (handle->xsk != NULL)
+    xsk_close(handle->xsk);
+  else
+    pcap_close(handle->pcap_handle);
+  if (handle->filter.bf_len != 0)
+    pcap_freecode(&handle->filter);
+  free(handle->expression);
+  free(handle->device);
+  free(handle->vlan_bytes);
+  free(handle->batch);
+  free(handle);
+}
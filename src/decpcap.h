@@ -26,6 +26,7 @@
 #include <stdio.h>
 #include <pcap.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 #define DP_ERRBUF_SIZE PCAP_ERRBUF_SIZE
 extern bool catchall;
@@ -35,6 +36,7 @@ enum dp_packet_type {
   dp_packet_ethernet,
   dp_packet_ppp,
   dp_packet_sll,
+  dp_packet_sll2,
   dp_packet_ip,
   dp_packet_ip6,
   dp_packet_tcp,
@@ -48,32 +50,216 @@ enum dp_packet_type {
         dp_n_link_types
 };*/
 
-/*struct dp_header {
- * pcap
-};*/
-typedef struct pcap_pkthdr dp_header;
+/* like pcap's packet header, but the timestamp is taken from the monotonic
+ * clock (see dp_clock), so wall clock steps can't affect the accounting */
+typedef struct dp_header {
+  u_int64_t ts; /* nanoseconds */
+  bpf_u_int32 caplen;
+  bpf_u_int32 len;
+} dp_header;
+
+#define DP_NSEC_PER_SEC 1000000000ULL
+
+/* linux cooked header v2, as found on the 'any' device with libpcap 1.10
+ * and later. All fields are in network byte order. */
+struct dp_sll2_header {
+  u_int16_t sll2_protocol;  /* ethertype */
+  u_int16_t sll2_reserved;  /* reserved, must be zero */
+  u_int32_t sll2_if_index;  /* interface the packet was seen on */
+  u_int16_t sll2_hatype;    /* link-layer address type */
+  u_int8_t sll2_pkttype;    /* packet type */
+  u_int8_t sll2_halen;      /* link-layer address length */
+  u_int8_t sll2_addr[8];    /* link-layer address */
+};
 
 typedef int (*dp_callback)(u_char *, const dp_header *, const u_char *);
 
+/* which way a packet went, when the link layer tells: the cooked headers of
+ * linux carry the packet type the kernel gave it */
+enum dp_direction { dp_dir_unknown, dp_dir_incoming, dp_dir_outgoing };
+
+/* TCP and UDP packets, parsed into a struct of arrays and handed over
+ * DP_BATCH at a time, see dp_setbatch */
+#define DP_BATCH 64
+
+struct dp_batch {
+  int count;
+  u_int64_t ts[DP_BATCH];
+  u_int32_t len[DP_BATCH];
+  /* AF_INET or AF_INET6, IPPROTO_TCP or IPPROTO_UDP */
+  u_int8_t family[DP_BATCH];
+  u_int8_t protocol[DP_BATCH];
+  /* an enum dp_direction */
+  u_int8_t direction[DP_BATCH];
+  /* in host byte order */
+  u_int16_t sport[DP_BATCH];
+  u_int16_t dport[DP_BATCH];
+  /* an IPv4 address takes the first 4 bytes */
+  u_char src[DP_BATCH][16];
+  u_char dst[DP_BATCH][16];
+  /* the interface from a cooked v2 header, 0 if there was none */
+  u_int32_t ifindex[DP_BATCH];
+  /* TCP only: the header without options, and the number of data bytes in
+   * the segment, 0 when unknown */
+  u_int32_t tcp[DP_BATCH][5];
+  u_int32_t payload[DP_BATCH];
+  /* the sampling rate the packet was captured at, see dp_setsample */
+  u_int32_t sample[DP_BATCH];
+};
+
+typedef void (*dp_batch_callback)(u_char *, const struct dp_batch *);
+
+struct dp_handle;
+/* parses a frame of the link type of the handle */
+typedef void (*dp_link_parser)(struct dp_handle *, const dp_header *,
+                               const u_char *);
+
+/* dp_handle.vlan of a packet that carries no 802.1Q/802.1ad tag */
+#define DP_VLAN_NONE 0xffff
+#define DP_N_VLANS 4096
+
+/* how many IPv6 extension headers are walked before giving up */
+#define DP_MAX_IP6_EXTHDRS 8
+
+/* transport header of a recently seen first fragment */
+#define DP_FRAG_SLOTS 16
+struct dp_frag {
+  u_int32_t id;
+  u_int8_t proto;
+  u_int8_t addrlen;
+  u_char src[16];
+  u_char dst[16];
+  u_char l4[20];
+};
+
+struct dp_xsk;
+
 struct dp_handle {
+  /* NULL for an AF_XDP handle, which has its sockets in xsk instead */
   pcap_t *pcap_handle;
+  struct dp_xsk *xsk;
   dp_callback callback[dp_n_packet_types];
   int linktype;
+  /* chosen by linktype when the handle is opened */
+  dp_link_parser parse_link;
+  /* live capture, and pcap timestamps in nanoseconds (not microseconds) */
+  bool live;
+  bool nano;
+  /* wall clock minus monotonic clock, and the latest timestamp handed out */
+  int64_t ts_offset;
+  u_int64_t last_ts;
   u_char *userdata;
   int userdata_size;
+  /* start of the (innermost) frame being parsed, and the end of its
+   * captured part */
+  const u_char *frame;
+  const u_char *end;
+  /* outermost VLAN ID of the packet being parsed, or DP_VLAN_NONE */
+  u_int16_t vlan;
+  /* bytes per VLAN ID, only counted after dp_count_vlans() */
+  u_int64_t *vlan_bytes;
+  struct dp_frag frags[DP_FRAG_SLOTS];
+  /* the transport header of the packet being parsed came from frags, not
+   * from the frame */
+  bool frag_l4;
+  /* whether tunnels are decapsulated, and the bytes of tunnel headers */
+  bool decap;
+  u_int64_t decap_overhead;
+  /* the (innermost) IP header of the packet being parsed, the end of the
+   * datagram according to that header, and the interface index and
+   * direction from a cooked header */
+  const u_char *l3;
+  const u_char *l3_end;
+  u_int8_t l3_family;
+  u_int32_t ifindex;
+  enum dp_direction direction;
+  /* see dp_setbatch */
+  dp_batch_callback batch_callback;
+  struct dp_batch *batch;
+  /* the filter of dp_open_live, empty if none, and what it was compiled
+   * from */
+  struct bpf_program filter;
+  char *expression;
+  bpf_u_int32 net;
+  /* 1 in 'sample' packets is kept, see dp_setsample. When the kernel
+   * doesn't drop the others, sample_threshold is set and a packet is only
+   * parsed when the next number from sample_seed is below it */
+  u_int32_t sample;
+  u_int32_t sample_threshold;
+  u_int32_t sample_seed;
+  /* how dp_open_live set up the capture, for dp_setsnaplen to do it again,
+   * and the packets received and dropped by the captures it replaced */
+  char *device;
+  int snaplen;
+  int promisc;
+  int to_ms;
+  int buffer_size;
+  bool immediate;
+  bool nonblock;
+  u_int64_t replaced_received;
+  u_int64_t replaced_dropped;
 };
 
 /* functions to set up a handle (which is basically just a pcap handle) */
 
+/* buffer_size is the size of the kernel buffer in bytes, 0 for libpcap's
+ * default. In immediate mode packets are handed over as they arrive rather
+ * than when the buffer fills up or to_ms passes. */
 struct dp_handle *dp_open_live(const char *device, int snaplen, int promisc,
-                               int to_ms, char *filter, char *errbuf);
+                               int to_ms, int buffer_size, bool immediate,
+                               char *filter, char *errbuf);
 struct dp_handle *dp_open_offline(char *fname, char *ebuf);
+/* captures the frames received on an Ethernet device through AF_XDP
+ * sockets rather than libpcap, see xsk.h */
+struct dp_handle *dp_open_xdp(const char *device, char *errbuf);
 
 /* functions to add callbacks */
 
 void dp_addcb(struct dp_handle *handle, enum dp_packet_type type,
               dp_callback callback);
 
+/* hand TCP and UDP packets to 'callback' in batches instead of calling the
+ * callbacks of the IP, TCP and UDP layers for every packet. The batch is
+ * handed over when it's full and at the end of every dp_dispatch. */
+
+void dp_setbatch(struct dp_handle *handle, dp_batch_callback callback);
+
+/* keep only 1 in 'rate' packets, chosen at random, or all of them again for
+ * a rate of 1. On a live capture on linux (3.8 or later) a filter makes the
+ * kernel drop the others, after the filter of dp_open_live; otherwise they
+ * are dropped before being parsed. The batch has the rate of each packet;
+ * when the rate changes, the packets still queued are dispatched first,
+ * with the user data of the last dp_dispatch. Returns true when the kernel
+ * does it. */
+
+bool dp_setsample(struct dp_handle *handle, u_int32_t rate);
+
+/* the kernel filter of dp_setsample: 'filter' followed by a random pick.
+ * Where the filter would accept a packet it jumps to the end, which loads
+ * a random number and accepts when it's below 'threshold'. The caller
+ * frees sampled->bf_insns */
+void dp_sample_program(const struct bpf_program *filter, int linktype,
+                       u_int32_t threshold, struct bpf_program *sampled);
+
+/* captures at most 'snaplen' bytes of each packet from now on. libpcap
+ * only takes that before a capture starts, so the capture of a live handle
+ * is opened again, with the same settings, filter and sampling. The packets
+ * still queued on the old one are dispatched first, with the user data of
+ * the last dp_dispatch, then it's stopped before the new one starts, and
+ * the descriptor changes. Other handles keep capturing whole frames.
+ * Returns -1, with the old capture going on, when that fails. */
+
+int dp_setsnaplen(struct dp_handle *handle, int snaplen, char *errbuf);
+
+/* keep a per-VLAN byte count in handle->vlan_bytes */
+
+void dp_count_vlans(struct dp_handle *handle);
+
+/* parse the packets inside VXLAN, GENEVE, GRE and IP-in-IP tunnels, too.
+ * The tunnel packet is then only accounted for the tunnel overhead. */
+
+void dp_setdecap(struct dp_handle *handle, bool decap);
+
 /* functions to parse payloads */
 
 void dp_parse(enum dp_packet_type type, void *packet);
@@ -82,12 +268,26 @@ void dp_parse(enum dp_packet_type type, void *packet);
 
 int dp_dispatch(struct dp_handle *handler, int count, u_char *user, int size);
 
+/* the current time on the clock of dp_header.ts, in nanoseconds */
+
+u_int64_t dp_clock(void);
+
 /* functions that simply call libpcap */
 
+/* the packets received and dropped (by the kernel or the interface) since
+ * the handle was opened. Returns -1 when they aren't available */
+int dp_stats(struct dp_handle *handle, u_int64_t *received,
+             u_int64_t *dropped);
+
 int dp_datalink(struct dp_handle *handle);
 
+/* a descriptor that becomes readable when packets are waiting, or -1 */
+int dp_get_selectable_fd(struct dp_handle *handle);
+
 int dp_setnonblock(struct dp_handle *handle, int i, char *errbuf);
 
 char *dp_geterr(struct dp_handle *handle);
 
+void dp_close(struct dp_handle *handle);
+
 #endif
@@ -23,6 +23,7 @@
 #include "devices.h"
 
 #include <iostream>
+#include <cstdlib>
 #include <cstring>
 
 #include <sys/socket.h>
@@ -63,6 +64,11 @@ bool up_running(int ifa_flags) {
 device *get_devices(int devc, char **devicenames, bool all) {
   struct ifaddrs *ifaddr, *ifa;
 
+  /* the 'any' pseudo-device covers all others with a single capture */
+  for (int i = 0; i < devc; i++)
+    if (strcmp(devicenames[i], "any") == 0)
+      return new device(strdup("any"));
+
   if (getifaddrs(&ifaddr) == -1) {
     std::cerr << "Failed to get interface addresses" << std::endl;
     // perror("getifaddrs");
@@ -88,3 +94,12 @@ device *get_devices(int devc, char **devicenames, bool all) {
 }
 
 device *get_default_devices() { return get_devices(0, NULL, false); }
+
+void free_devices(device *devices) {
+  while (devices != NULL) {
+    device *next = devices->next;
+    free((char *)devices->name);
+    delete devices;
+    devices = next;
+  }
+}
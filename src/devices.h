@@ -44,7 +44,13 @@ device *get_default_devices();
  *
  * when 'all' is set, also return loopback interfaces and interfaces
  * that are down or not running
+ *
+ * when 'any' is one of the specified devices, only the 'any' pseudo-device
+ * is returned
  */
 device *get_devices(int devc, char **devv, bool all);
 
+/* frees a list of get_devices, and the names in it */
+void free_devices(device *devices);
+
 #endif
@@ -0,0 +1,156 @@
+/*
+ * governor.cpp
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ *USA.
+ *
+ */
+
+#include <algorithm>
+#include <iostream>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "nethogs.h"
+#include "governor.h"
+#include "connection.h"
+#include "process.h"
+
+extern "C" {
+#include "decpcap.h"
+}
+
+/* what each level does to the settings at full fidelity. The snapshot goes
+ * first, as it only drops the payload nethogs doesn't look at; after that
+ * each level doubles the sampling, which is what saves the most on a busy
+ * host, and the refreshes and socket table reads are spread out as well */
+static const struct {
+  /* multiplies the sample rate */
+  unsigned int sample;
+  /* whether the snapshot is cut to GOVERNOR_SNAPLEN */
+  bool snap;
+  /* multiply the refresh delay and the refreshes between table reads */
+  unsigned int refresh;
+  unsigned int conninode;
+} levels[] = {
+    {1, false, 1, 1}, {1, true, 1, 2},  {2, true, 1, 2},  {4, true, 2, 4},
+    {8, true, 2, 4},  {16, true, 4, 8}, {32, true, 4, 8}, {64, true, 4, 8},
+};
+#define GOVERNOR_LEVELS ((int)(sizeof(levels) / sizeof(levels[0])))
+
+/* back up a level after this many refreshes below this share of the limit:
+ * that about doubles the CPU it takes, which should stay clear of the limit
+ * rather than go back and forth */
+#define GOVERNOR_CALM 5
+#define GOVERNOR_RESTORE 0.4
+/* after a change, wait this many refreshes for it to show */
+#define GOVERNOR_HOLD 2
+
+static float budget = 0;
+static governor_settings fidelity;
+static int level = 0;
+static float cpu = 0;
+static int calm = 0;
+static int hold = 0;
+static u_int64_t last_wall = 0;
+static u_int64_t last_cpu = 0;
+
+/* the CPU time of the capture loop: of the thread running it, where the
+ * system tells, as the library shares the process with its caller */
+static u_int64_t cputime() {
+  struct rusage usage;
+#ifdef RUSAGE_THREAD
+  if (getrusage(RUSAGE_THREAD, &usage) == -1)
+#endif
+    getrusage(RUSAGE_SELF, &usage);
+  return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * NSEC_PER_SEC +
+         (u_int64_t)(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000;
+}
+
+void governor_init(float limit, const governor_settings &base) {
+  budget = limit;
+  fidelity = base;
+  level = 0;
+  cpu = 0;
+  calm = 0;
+  hold = 0;
+  last_wall = 0;
+}
+
+bool governor_tick(u_int64_t now, governor_settings *settings) {
+  u_int64_t const used = cputime();
+
+  if (last_wall == 0 || now <= last_wall) {
+    last_wall = now;
+    last_cpu = used;
+    return false;
+  }
+  float const usage = 100.0 * (used - last_cpu) / (now - last_wall);
+  last_wall = now;
+  last_cpu = used;
+  /* a refresh may have been slow for reasons of its own */
+  cpu = cpu == 0 ? usage : (cpu + usage) / 2;
+
+  if (hold > 0) {
+    hold--;
+    return false;
+  }
+  int const previous = level;
+  if (cpu > budget && level < GOVERNOR_LEVELS - 1) {
+    level++;
+    calm = 0;
+  } else if (cpu < budget * GOVERNOR_RESTORE && level > 0) {
+    if (++calm >= GOVERNOR_CALM) {
+      level--;
+      calm = 0;
+    }
+  } else {
+    calm = 0;
+  }
+  if (level == previous)
+    return false;
+
+  hold = GOVERNOR_HOLD;
+  settings->samplerate = std::min(fidelity.samplerate * levels[level].sample,
+                                  (unsigned int)MAX_SAMPLERATE);
+  settings->snaplen = levels[level].snap
+                          ? std::min(fidelity.snaplen, GOVERNOR_SNAPLEN)
+                          : fidelity.snaplen;
+  settings->refreshdelay = fidelity.refreshdelay * levels[level].refresh;
+  settings->conninodeevery =
+      fidelity.conninodeevery * levels[level].conninode;
+  return true;
+}
+
+void governor_apply(const governor_settings &settings, bool capturing) {
+  conninodeevery = settings.conninodeevery;
+  // the counters of the kernel see every packet
+  if (capturing)
+    samplerate = settings.samplerate;
+}
+
+void governor_capture(dp_handle *capture, const char *device,
+                      const governor_settings &settings) {
+  char errbuf[DP_ERRBUF_SIZE];
+
+  if (dp_setsnaplen(capture, settings.snaplen, errbuf) == -1)
+    std::cerr << "Error reopening the capture on " << device << ": " << errbuf
+              << std::endl;
+  dp_setsample(capture, settings.samplerate);
+}
+
+int governor_level() { return level; }
+
+float governor_cpu() { return cpu; }
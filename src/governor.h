@@ -0,0 +1,71 @@
+/*
+ * governor.h
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ *USA.
+ *
+ */
+
+#ifndef __GOVERNOR_H
+#define __GOVERNOR_H
+
+#include <sys/types.h>
+
+/* the CPU governor: at every refresh, measures the CPU time nethogs spent
+ * (user and system, through getrusage) since the one before. When that's
+ * over the limit it gives up some fidelity for CPU, a level at a time:
+ * shorter snapshots, sampling, fewer refreshes and fewer reads of the
+ * socket tables. Once it's been well below the limit for a while, it goes
+ * back up a level. */
+
+/* the snapshot length of the degraded levels, enough for the headers that
+ * are parsed, also those inside a tunnel */
+#define GOVERNOR_SNAPLEN 256
+
+struct governor_settings {
+  /* 1 in samplerate packets is captured, see dp_setsample */
+  unsigned int samplerate;
+  int snaplen;
+  /* nanoseconds between refreshes */
+  u_int64_t refreshdelay;
+  /* the socket tables are reread every conninodeevery refreshes */
+  unsigned int conninodeevery;
+};
+
+/* 'limit' is a percentage of one CPU, 'base' are the settings at full
+ * fidelity */
+void governor_init(float limit, const governor_settings &base);
+
+/* measures the CPU used since the previous call, and fills in the settings
+ * of the level it should run at. Returns true when the level changed */
+bool governor_tick(u_int64_t now, governor_settings *settings);
+
+/* switches the refreshes to the settings of a new level, and the sample
+ * rate unless nothing is 'capturing' */
+void governor_apply(const governor_settings &settings, bool capturing);
+
+struct dp_handle;
+/* switches a capture to the snapshot length and sampling of a new level.
+ * A capture reopened for another snapshot length has a new descriptor */
+void governor_capture(dp_handle *capture, const char *device,
+                      const governor_settings &settings);
+
+/* 0 at full fidelity, higher is more degraded */
+int governor_level();
+
+/* the (smoothed) CPU usage, as a percentage of one CPU */
+float governor_cpu();
+
+#endif
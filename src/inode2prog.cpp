@@ -30,7 +30,6 @@
 #include <cstdio>
 #include <unistd.h>
 #include <string>
-#include <map>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <climits>
@@ -46,8 +45,74 @@ const int MAX_PID_LENGTH = 20;
 // seems like a safe assumption.
 const int MAX_FDLINK = 10;
 
-/* maps from inode to program-struct */
-std::map<unsigned long, prg_node *> inodeproc;
+/* maps from inode to program-struct: open addressing with linear probing,
+ * at most half full. Each reread_mapping stamps the inodes it sees with its
+ * generation and then drops the others, so the table holds the sockets that
+ * are open rather than every socket ever seen */
+struct inode_slot {
+  /* 0 for an empty slot */
+  unsigned long inode;
+  unsigned long generation;
+  prg_node *node;
+};
+
+#define INODE_MIN_SLOTS 256
+
+static inode_slot *inodeproc = NULL;
+static size_t inode_slots = 0;
+static size_t inode_used = 0;
+static unsigned long generation = 0;
+/* inodes stamped by the running reread */
+static size_t inode_seen = 0;
+
+static size_t slot_of(unsigned long inode) {
+  return (size_t)(((u_int64_t)inode * 0x9e3779b97f4a7c15ULL) >> 32) &
+         (inode_slots - 1);
+}
+
+/* the slot holding inode, or the empty one where it would go */
+static inode_slot *find_slot(unsigned long inode) {
+  size_t i = slot_of(inode);
+  while (inodeproc[i].inode != 0 && inodeproc[i].inode != inode)
+    i = (i + 1) & (inode_slots - 1);
+  return &inodeproc[i];
+}
+
+/* moves the entries into a table of 'slots', dropping the ones not seen by
+ * the last reread when 'sweep' is set */
+static void rebuild(size_t slots, bool sweep) {
+  inode_slot *old = inodeproc;
+  size_t oldslots = inode_slots;
+
+  inodeproc = new inode_slot[slots]();
+  inode_slots = slots;
+  inode_used = 0;
+  for (size_t i = 0; i < oldslots; i++) {
+    if (old[i].inode == 0)
+      continue;
+    if (sweep && old[i].generation != generation) {
+      delete old[i].node;
+      continue;
+    }
+    *find_slot(old[i].inode) = old[i];
+    inode_used++;
+  }
+  delete[] old;
+}
+
+/* the smallest table that's at most half full with 'entries' */
+static size_t slots_for(size_t entries) {
+  size_t slots = INODE_MIN_SLOTS;
+  while (slots < 2 * entries)
+    slots *= 2;
+  return slots;
+}
+
+static prg_node *lookup(unsigned long inode) {
+  if (inode_slots == 0 || inode == 0)
+    return NULL;
+  return find_slot(inode)->node;
+}
 
 bool is_number(const char *string) {
   while (*string) {
@@ -145,16 +210,29 @@ std::string getcmdline(pid_t pid) {
 }
 
 void setnode(unsigned long inode, pid_t pid) {
-  prg_node *current_value = inodeproc[inode];
+  if (inode == 0)
+    return;
+  if (2 * (inode_used + 1) > inode_slots)
+    rebuild(slots_for(inode_used + 1), false);
+
+  inode_slot *slot = find_slot(inode);
+  if (slot->generation != generation) {
+    slot->generation = generation;
+    inode_seen++;
+  }
 
-  if (current_value == NULL || current_value->pid != pid) {
+  if (slot->node == NULL || slot->node->pid != pid) {
     prg_node *newnode = new prg_node;
     newnode->inode = inode;
     newnode->pid = pid;
     newnode->cmdline = getcmdline(pid);
 
-    inodeproc[inode] = newnode;
-    delete current_value;
+    if (slot->inode == 0) {
+      slot->inode = inode;
+      inode_used++;
+    }
+    delete slot->node;
+    slot->node = newnode;
   }
 }
 
@@ -222,6 +300,8 @@ void reread_mapping() {
 
   dirent *entry;
 
+  generation++;
+  inode_seen = 0;
   while ((entry = readdir(proc))) {
     if (entry->d_type != DT_DIR)
       continue;
@@ -232,11 +312,15 @@ void reread_mapping() {
     get_info_for_pid(entry->d_name);
   }
   closedir(proc);
+
+  /* sweep the sockets that were closed since */
+  if (inode_seen < inode_used)
+    rebuild(slots_for(inode_seen), true);
 }
 
-struct prg_node *findPID(unsigned long inode) {
+struct prg_node *findPID(unsigned long inode, bool reread) {
   /* we first look in inodeproc */
-  struct prg_node *node = inodeproc[inode];
+  struct prg_node *node = lookup(inode);
 
   if (node != NULL) {
     if (bughuntmode) {
@@ -245,11 +329,14 @@ struct prg_node *findPID(unsigned long inode) {
     return node;
   }
 
+  if (!reread)
+    return NULL;
+
 #ifndef __APPLE__
   reread_mapping();
 #endif
 
-  struct prg_node *retval = inodeproc[inode];
+  struct prg_node *retval = lookup(inode);
   if (bughuntmode) {
     if (retval == NULL) {
       std::cout << ":( No pid after inodeproc refresh" << std::endl;
@@ -260,7 +347,14 @@ struct prg_node *findPID(unsigned long inode) {
   return retval;
 }
 
-void prg_cache_clear(){};
+void prg_cache_clear() {
+  for (size_t i = 0; i < inode_slots; i++)
+    delete inodeproc[i].node;
+  delete[] inodeproc;
+  inodeproc = NULL;
+  inode_slots = 0;
+  inode_used = 0;
+}
 
 /*void main () {
         std::cout << "Fooo\n";
@@ -34,11 +34,13 @@ struct prg_node {
   std::string cmdline;
 };
 
-struct prg_node *findPID(unsigned long inode);
+/* rereads the mapping when the inode isn't known, unless told not to */
+struct prg_node *findPID(unsigned long inode, bool reread = true);
 
 void prg_cache_clear();
 
-// reread the inode-to-prg_node-mapping
+// reread the inode-to-prg_node-mapping, forgetting the inodes that are gone.
+// Nodes returned by findPID are only valid until the next reread
 void reread_mapping();
 
 #endif
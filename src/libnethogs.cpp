@@ -24,9 +24,17 @@ static std::pair<int, int> self_pipe = std::make_pair(-1, -1);
 static bool monitor_run_flag = false;
 typedef std::map<void *, NethogsMonitorRecord> NethogsRecordMap;
 static NethogsRecordMap monitor_record_map;
+typedef std::map<void *, NethogsMonitorRecordExt> NethogsRecordExtMap;
+static NethogsRecordExtMap monitor_record_ext_map;
 
-static int monitor_refresh_delay = 1;
-static time_t monitor_last_refresh_time = 0;
+static_assert(NETHOGS_HIST_BUCKETS == HIST_BUCKETS,
+              "histograms have a different size in the library");
+
+static u_int64_t monitor_refresh_delay = NSEC_PER_SEC;
+static u_int64_t monitor_last_refresh_time = 0;
+// the settings the CPU governor starts from, and those it has chosen
+static governor_settings monitor_fidelity;
+static governor_settings monitor_governed;
 
 // selectable file descriptors for the main loop
 static fd_set pc_loop_fd_set;
@@ -59,7 +67,9 @@ static bool wait_for_next_trigger() {
       nfds = std::max(nfds, *it + 1);
       FD_SET(fd, &pc_loop_fd_set);
     }
-    timeval timeout = {monitor_refresh_delay, 0};
+    timeval timeout = {(time_t)(monitor_refresh_delay / NSEC_PER_SEC),
+                       (suseconds_t)(monitor_refresh_delay % NSEC_PER_SEC /
+                                     1000)};
     if (select(nfds, &pc_loop_fd_set, 0, 0, &timeout) != -1) {
       if (FD_ISSET(self_pipe.first, &pc_loop_fd_set)) {
         return false;
@@ -76,12 +86,29 @@ static int nethogsmonitor_init(int devc, char **devicenames,
                                bool all, char *filter) {
   process_init();
 
-  device *devices = get_devices(devc, devicenames, all);
-  if (devices == NULL) {
+  // polling sock_diag or conntrack needs no capture handles
+  bool const polling = diagmode || ctmode;
+  // the counters of the kernel see every packet
+  if (polling || bpfmode)
+    samplerate = 1;
+  device *devices = polling ? NULL : get_devices(devc, devicenames, all);
+  if (devices == NULL && !polling) {
     std::cerr << "No devices to monitor" << std::endl;
     return NETHOGS_STATUS_NO_DEVICE;
   }
 
+  // conntrack has to tell forwarded connections from our own
+  if (ctmode) {
+    device *local = get_devices(0, NULL, true);
+    for (device *dev = local; dev != NULL; dev = dev->next)
+      getLocal(dev->name, false);
+    free_devices(local);
+    if (!conntrack_open()) {
+      std::cerr << "Error subscribing to conntrack events" << std::endl;
+      return NETHOGS_STATUS_FAILURE;
+    }
+  }
+
   device *current_dev = devices;
 
   bool promiscuous = false;
@@ -99,15 +126,22 @@ static int nethogsmonitor_init(int devc, char **devicenames,
       continue;
     }
 
+    if (bpfmode) {
+      if (!tcbpf_attach(current_dev->name))
+        ++nb_failed_devices;
+      current_dev = current_dev->next;
+      continue;
+    }
+
     char errbuf[PCAP_ERRBUF_SIZE];
     dp_handle *newhandle =
-        dp_open_live(current_dev->name, BUFSIZ, promiscuous,
-                     100, filter, errbuf);
+        xdpmode ? dp_open_xdp(current_dev->name, errbuf)
+                : dp_open_live(current_dev->name, BUFSIZ, promiscuous,
+                               capturetimeout, capturebuffer * 1024,
+                               immediatemode, filter, errbuf);
     if (newhandle != NULL) {
-      dp_addcb(newhandle, dp_packet_ip, process_ip);
-      dp_addcb(newhandle, dp_packet_ip6, process_ip6);
-      dp_addcb(newhandle, dp_packet_tcp, process_tcp);
-      dp_addcb(newhandle, dp_packet_udp, process_udp);
+      dp_setbatch(newhandle, process_batch);
+      dp_setsample(newhandle, samplerate);
 
       /* The following code solves sf.net bug 1019381, but is only available
        * in newer versions (from 0.8 it seems) of libpcap
@@ -122,7 +156,7 @@ static int nethogsmonitor_init(int devc, char **devicenames,
 
       if (pc_loop_use_select) {
         // some devices may not support pcap_get_selectable_fd
-        int const fd = pcap_get_selectable_fd(newhandle->pcap_handle);
+        int const fd = dp_get_selectable_fd(newhandle);
         if (fd != -1) {
           pc_loop_fd_list.push_back(fd);
         } else {
@@ -132,6 +166,10 @@ static int nethogsmonitor_init(int devc, char **devicenames,
                   current_dev->name);
         }
       }
+    } else if (xdpmode) {
+      fprintf(stderr, "ERROR: opening handler for device %s: %s\n",
+              current_dev->name, errbuf);
+      ++nb_failed_devices;
     } else {
       fprintf(stderr, "ERROR: opening handler for device %s: %s\n",
               current_dev->name, strerror(errno));
@@ -141,7 +179,8 @@ static int nethogsmonitor_init(int devc, char **devicenames,
     current_dev = current_dev->next;
   }
 
-  if (nb_devices == nb_failed_devices) {
+  if (nb_devices == nb_failed_devices && !polling) {
+    tcbpf_detach();
     return NETHOGS_STATUS_FAILURE;
   }
 
@@ -156,11 +195,38 @@ static int nethogsmonitor_init(int devc, char **devicenames,
     }
   }
 
+  governor_settings const fidelity = {samplerate, BUFSIZ,
+                                      monitor_refresh_delay, 1};
+  monitor_fidelity = monitor_governed = fidelity;
+  if (cpulimit > 0)
+    governor_init(cpulimit, fidelity);
+
   return NETHOGS_STATUS_OK;
 }
 
+/* the descriptors of the handles, after they were reopened */
+static void reset_fd_list() {
+  pc_loop_fd_list.clear();
+  pc_loop_fd_list.push_back(self_pipe.first);
+  for (handle *current_handle = handles; current_handle != NULL;
+       current_handle = current_handle->next) {
+    int const fd = dp_get_selectable_fd(current_handle->content);
+    if (fd == -1) {
+      pc_loop_use_select = false;
+      pc_loop_fd_list.clear();
+      fprintf(stderr, "failed to get selectable_fd for %s\n",
+              current_handle->devicename);
+      return;
+    }
+    pc_loop_fd_list.push_back(fd);
+  }
+}
+
 static void nethogsmonitor_handle_update(NethogsMonitorCallback cb) {
-  refreshconninode();
+  if (refreshcount % conninodeevery == 0) {
+    refreshconninode();
+    retry_unknown(curtime);
+  }
   refreshcount++;
 
   ProcList *curproc = processes;
@@ -177,8 +243,8 @@ static void nethogsmonitor_handle_update(NethogsMonitorCallback cb) {
 
     /* remove timed-out processes (unless it's one of the unknown process)
      */
-    if ((curproc->getVal()->getLastPacket() + PROCESSTIMEOUT <=
-         curtime.tv_sec) &&
+    if ((curproc->getVal()->getLastPacket() + PROCESSTIMEOUT * NSEC_PER_SEC <=
+         curtime) &&
         (curproc->getVal() != unknowntcp) &&
         (curproc->getVal() != unknownudp) && (curproc->getVal() != unknownip)) {
       if (DEBUG)
@@ -189,6 +255,7 @@ static void nethogsmonitor_handle_update(NethogsMonitorCallback cb) {
         NethogsMonitorRecord &data = it->second;
         (*cb)(NETHOGS_APP_ACTION_REMOVE, &data);
         monitor_record_map.erase(curproc);
+        monitor_record_ext_map.erase(curproc);
       }
 
       ProcList *todelete = curproc;
@@ -201,6 +268,7 @@ static void nethogsmonitor_handle_update(NethogsMonitorCallback cb) {
         curproc = processes;
       }
       delete todelete;
+      forgetProcess(p_todelete);
       delete p_todelete;
       nproc--;
       // continue;
@@ -210,13 +278,26 @@ static void nethogsmonitor_handle_update(NethogsMonitorCallback cb) {
       u_int64_t recv_bytes;
       float sent_kbs;
       float recv_kbs;
+      float sent_peak_1ms, recv_peak_1ms, sent_peak_10ms, recv_peak_10ms;
       curproc->getVal()->getkbps(&recv_kbs, &sent_kbs);
+      curproc->getVal()->getpeakkbps(0, &recv_peak_1ms, &sent_peak_1ms);
+      curproc->getVal()->getpeakkbps(1, &recv_peak_10ms, &sent_peak_10ms);
+      float sent_error, recv_error;
+      curproc->getVal()->geterrorkbps(&recv_error, &sent_error);
+      float sent_pps, recv_pps;
+      LogHistogram sizes, gaps;
+      curproc->getVal()->getpps(&recv_pps, &sent_pps);
+      curproc->getVal()->gethistograms(&sizes, &gaps);
+      TcpStats tcp;
+      curproc->getVal()->gettcpstats(&tcp);
+      float rtt_ms = tcp.rtt_count ? tcp.rtt_sum / 1000.0 / tcp.rtt_count : 0;
       curproc->getVal()->gettotal(&recv_bytes, &sent_bytes);
 
       // notify update
       bool const new_data =
           (monitor_record_map.find(curproc) == monitor_record_map.end());
       NethogsMonitorRecord &data = monitor_record_map[curproc];
+      NethogsMonitorRecordExt &ext = monitor_record_ext_map[curproc];
 
       bool data_change = false;
       if (new_data) {
@@ -227,6 +308,8 @@ static void nethogsmonitor_handle_update(NethogsMonitorCallback cb) {
         data.record_id = record_id;
         data.name = curproc->getVal()->name;
         data.pid = curproc->getVal()->pid;
+        memset(&ext, 0, sizeof(ext));
+        data.ext = &ext;
       }
 
       data.device_name = curproc->getVal()->devicename;
@@ -242,6 +325,29 @@ static void nethogsmonitor_handle_update(NethogsMonitorCallback cb) {
       NHM_UPDATE_ONE_FIELD(data.recv_bytes, recv_bytes)
       NHM_UPDATE_ONE_FIELD(data.sent_kbs, sent_kbs)
       NHM_UPDATE_ONE_FIELD(data.recv_kbs, recv_kbs)
+      NHM_UPDATE_ONE_FIELD(data.sent_peak_1ms_kbs, sent_peak_1ms)
+      NHM_UPDATE_ONE_FIELD(data.recv_peak_1ms_kbs, recv_peak_1ms)
+      NHM_UPDATE_ONE_FIELD(data.sent_peak_10ms_kbs, sent_peak_10ms)
+      NHM_UPDATE_ONE_FIELD(data.recv_peak_10ms_kbs, recv_peak_10ms)
+      NHM_UPDATE_ONE_FIELD(ext.sent_pps, sent_pps)
+      NHM_UPDATE_ONE_FIELD(ext.recv_pps, recv_pps)
+      NHM_UPDATE_ONE_FIELD(ext.sent_kbs_error, sent_error)
+      NHM_UPDATE_ONE_FIELD(ext.recv_kbs_error, recv_error)
+      NHM_UPDATE_ONE_FIELD(ext.sent_retransmits, tcp.retransmits[0])
+      NHM_UPDATE_ONE_FIELD(ext.recv_retransmits, tcp.retransmits[1])
+      NHM_UPDATE_ONE_FIELD(ext.sent_zero_windows, tcp.zerowindows[0])
+      NHM_UPDATE_ONE_FIELD(ext.recv_zero_windows, tcp.zerowindows[1])
+      NHM_UPDATE_ONE_FIELD(ext.syns, tcp.syns)
+      NHM_UPDATE_ONE_FIELD(ext.fins, tcp.fins)
+      NHM_UPDATE_ONE_FIELD(ext.rsts, tcp.rsts)
+      NHM_UPDATE_ONE_FIELD(ext.handshake_rtt_ms, rtt_ms)
+
+      if (memcmp(ext.size_hist, sizes.count, sizeof(ext.size_hist)) ||
+          memcmp(ext.gap_hist, gaps.count, sizeof(ext.gap_hist))) {
+        memcpy(ext.size_hist, sizes.count, sizeof(ext.size_hist));
+        memcpy(ext.gap_hist, gaps.count, sizeof(ext.gap_hist));
+        data_change = true;
+      }
 
 #undef NHM_UPDATE_ONE_FIELD
 
@@ -260,15 +366,27 @@ static void nethogsmonitor_clean_up() {
   // clean up
   handle *current_handle = handles;
   while (current_handle != NULL) {
-    pcap_close(current_handle->content->pcap_handle);
-    current_handle = current_handle->next;
+    handle *next = current_handle->next;
+    dp_close(current_handle->content);
+    delete current_handle;
+    current_handle = next;
   }
+  // nethogsmonitor_capture_stats finds no handles until the next loop
+  handles = NULL;
+  tcbpf_detach();
+  conntrack_close();
 
   // close file descriptors
   for (std::vector<int>::const_iterator it = pc_loop_fd_list.begin();
        it != pc_loop_fd_list.end(); ++it) {
     close(*it);
   }
+  pc_loop_fd_list.clear();
+
+  // the next loop starts at full fidelity again
+  samplerate = monitor_fidelity.samplerate;
+  monitor_refresh_delay = monitor_fidelity.refreshdelay;
+  conninodeevery = monitor_fidelity.conninodeevery;
 
   procclean();
 }
@@ -299,22 +417,44 @@ int nethogsmonitor_loop_devices(NethogsMonitorCallback cb, char *filter,
     handle *current_handle = handles;
     while (current_handle != NULL) {
       userdata->device = current_handle->devicename;
-      userdata->sa_family = AF_UNSPEC;
       int retval = dp_dispatch(current_handle->content, -1, (u_char *)userdata,
                                sizeof(struct dpargs));
       if (retval < 0) {
         std::cerr << "Error dispatching: " << retval << std::endl;
       } else if (retval != 0) {
         packets_read = true;
-      } else {
-        gettimeofday(&curtime, NULL);
       }
       current_handle = current_handle->next;
     }
 
-    time_t const now = ::time(NULL);
+    u_int64_t const now = dp_clock();
+    lookup_pending(now);
     if (monitor_last_refresh_time + monitor_refresh_delay <= now) {
       monitor_last_refresh_time = now;
+      curtime = now;
+      if (diagmode && !sockdiag_poll(now)) {
+        std::cerr << "Failed to dump the TCP sockets through sock_diag"
+                  << std::endl;
+        return_value = NETHOGS_STATUS_FAILURE;
+        break;
+      }
+      if (bpfmode)
+        tcbpf_drain(now);
+      if (ctmode && !conntrack_poll(now)) {
+        std::cerr << "Failed to dump the conntrack table" << std::endl;
+        return_value = NETHOGS_STATUS_FAILURE;
+        break;
+      }
+      if (cpulimit > 0 && governor_tick(now, &monitor_governed)) {
+        governor_apply(monitor_governed, handles != NULL);
+        for (handle *current_handle = handles; current_handle != NULL;
+             current_handle = current_handle->next)
+          governor_capture(current_handle->content, current_handle->devicename,
+                           monitor_governed);
+        monitor_refresh_delay = monitor_governed.refreshdelay;
+        if (pc_loop_use_select)
+          reset_fd_list();
+      }
       nethogsmonitor_handle_update(cb);
     }
 
@@ -326,8 +466,72 @@ int nethogsmonitor_loop_devices(NethogsMonitorCallback cb, char *filter,
   }
 
   nethogsmonitor_clean_up();
+  monitor_run_flag = false;
 
-  return NETHOGS_STATUS_OK;
+  return return_value;
+}
+
+void nethogsmonitor_set_gaps(bool enable) { histgaps = enable; }
+
+void nethogsmonitor_set_tcp_health(bool enable) { tcphealth = enable; }
+
+void nethogsmonitor_set_sockdiag(bool enable) { diagmode = enable; }
+
+void nethogsmonitor_set_ebpf(bool enable) { bpfmode = enable; }
+
+void nethogsmonitor_set_conntrack(bool enable) { ctmode = enable; }
+
+void nethogsmonitor_set_xdp(bool enable) { xdpmode = enable; }
+
+void nethogsmonitor_set_sample(unsigned int rate) {
+  samplerate = std::min(std::max(rate, 1U), (unsigned int)MAX_SAMPLERATE);
+}
+
+void nethogsmonitor_set_cpu_limit(float percent) {
+  cpulimit = percent < 0 ? 0 : percent;
+}
+
+int nethogsmonitor_governor_level(float *cpu_percent) {
+  if (cpu_percent != NULL)
+    *cpu_percent = governor_cpu();
+  return governor_level();
+}
+
+void nethogsmonitor_set_capture(int buffer_kb, bool immediate,
+                                int timeout_ms) {
+  capturebuffer = buffer_kb;
+  immediatemode = immediate;
+  capturetimeout = timeout_ms;
+}
+
+int nethogsmonitor_capture_stats(uint64_t *received, uint64_t *dropped) {
+  int count = 0;
+  *received = 0;
+  *dropped = 0;
+  for (handle *current_handle = handles; current_handle != NULL;
+       current_handle = current_handle->next) {
+    u_int64_t handle_received, handle_dropped;
+    if (dp_stats(current_handle->content, &handle_received,
+                 &handle_dropped) == -1)
+      continue;
+    *received += handle_received;
+    *dropped += handle_dropped;
+    count++;
+  }
+  return count;
+}
+
+int nethogsmonitor_pool_stats(NethogsPoolStats *stats, int max) {
+  int count = 0;
+  for (PoolStats *pool = pools; pool != NULL; pool = pool->next, count++) {
+    if (count >= max)
+      continue;
+    stats[count].name = pool->name;
+    stats[count].size = pool->size;
+    stats[count].capacity = pool->capacity;
+    stats[count].inuse = pool->inuse;
+  }
+  return count;
 }
 
 void nethogsmonitor_breakloop() {
@@ -5,6 +5,7 @@
 extern "C" {
 #endif
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 
@@ -18,6 +19,41 @@ extern "C" {
 #define NETHOGS_STATUS_FAILURE 1
 #define NETHOGS_STATUS_NO_DEVICE 2
 
+#define NETHOGS_HIST_BUCKETS 64
+
+/**
+ * @brief The smallest value counted in bucket i of a histogram: each power
+ * of two is split in four buckets, and the last one has no upper bound.
+ */
+static inline uint64_t nethogs_hist_lower(int i) {
+  return i < 4 ? (uint64_t)i : (uint64_t)(4 + (i & 3)) << ((i >> 2) - 1);
+}
+
+typedef struct NethogsMonitorRecordExt {
+  float sent_pps;
+  float recv_pps;
+  /* number of packets by size in bytes */
+  uint32_t size_hist[NETHOGS_HIST_BUCKETS];
+  /* number of packets by the microseconds since the previous packet of the
+   * same connection, all zero unless enabled by nethogsmonitor_set_gaps() */
+  uint32_t gap_hist[NETHOGS_HIST_BUCKETS];
+  /* TCP health, all zero unless enabled by nethogsmonitor_set_tcp_health():
+   * segments that repeat sequence space, segments advertising a zero window,
+   * flag counts and the mean round trip of the handshakes */
+  uint64_t sent_retransmits;
+  uint64_t recv_retransmits;
+  uint64_t sent_zero_windows;
+  uint64_t recv_zero_windows;
+  uint64_t syns;
+  uint64_t fins;
+  uint64_t rsts;
+  float handshake_rtt_ms;
+  /* when sampling, the kb/s by which sent_kbs and recv_kbs may be off
+   * either way, at 95% confidence; zero otherwise */
+  float sent_kbs_error;
+  float recv_kbs_error;
+} NethogsMonitorRecordExt;
+
 typedef struct NethogsMonitorRecord {
   int record_id;
   const char *name;
@@ -28,8 +64,26 @@ typedef struct NethogsMonitorRecord {
   uint64_t recv_bytes;
   float sent_kbs;
   float recv_kbs;
+  /* the biggest burst of any one connection since the previous update,
+   * as kb/s over aligned 1 ms and 10 ms windows */
+  float sent_peak_1ms_kbs;
+  float recv_peak_1ms_kbs;
+  float sent_peak_10ms_kbs;
+  float recv_peak_10ms_kbs;
+  /* packet rates and histograms, valid as long as the record */
+  const NethogsMonitorRecordExt *ext;
 } NethogsMonitorRecord;
 
+/* the occupancy of the allocator of one kind of object */
+typedef struct NethogsPoolStats {
+  const char *name;
+  /* bytes per object */
+  size_t size;
+  /* objects allocated from the system, and the ones in use */
+  unsigned long capacity;
+  unsigned long inuse;
+} NethogsPoolStats;
+
 /**
  * @brief Defines a callback to handle updates about applications
  * @param action NETHOGS_APP_ACTION_SET if data is being added or updated,
@@ -87,6 +141,119 @@ NETHOGS_DSO_VISIBLE int nethogsmonitor_loop_devices(NethogsMonitorCallback cb,
                                                     char **devicenames,
                                                     bool all);
 
+/**
+ * @brief Also keep histograms of the gaps between packets, reported in
+ * NethogsMonitorRecordExt::gap_hist. Must be called before the loop starts.
+ * @param enable true to keep the histograms
+ */
+NETHOGS_DSO_VISIBLE void nethogsmonitor_set_gaps(bool enable);
+
+/**
+ * @brief Follow the TCP headers of each connection, reported in the TCP
+ * fields of NethogsMonitorRecordExt. Must be called before the loop starts.
+ * @param enable true to track TCP health
+ */
+NETHOGS_DSO_VISIBLE void nethogsmonitor_set_tcp_health(bool enable);
+
+/**
+ * @brief Don't capture, poll the byte counters of the TCP sockets through
+ * sock_diag at each refresh instead (Linux 4.1+). Needs no capture
+ * privileges, but only sees TCP, and the peak, packet, histogram and TCP
+ * health fields stay zero. Must be called before the loop starts.
+ * @param enable true to poll sock_diag
+ */
+NETHOGS_DSO_VISIBLE void nethogsmonitor_set_sockdiag(bool enable);
+
+/**
+ * @brief Don't capture, count bytes and packets per flow in the kernel with
+ * an eBPF program attached at tc ingress and egress of each device, and
+ * read the counts at each refresh. Needs CAP_BPF and CAP_NET_ADMIN; the
+ * filter passed to the loop is not used, and the peak, histogram and TCP
+ * health fields stay zero. Must be called before the loop starts.
+ * @param enable true to count with eBPF
+ */
+NETHOGS_DSO_VISIBLE void nethogsmonitor_set_ebpf(bool enable);
+
+/**
+ * @brief Don't capture, account forwarded traffic from the byte counters of
+ * the conntrack table (net.netfilter.nf_conntrack_acct must be on), to one
+ * record per internal host and port, with device name "conntrack".
+ * Connections of the host itself are not seen. Must be called before the
+ * loop starts.
+ * @param enable true to read conntrack
+ */
+NETHOGS_DSO_VISIBLE void nethogsmonitor_set_conntrack(bool enable);
+
+/**
+ * @brief Capture the frames received on each device through AF_XDP sockets
+ * instead of libpcap. WARNING: those frames don't reach the network stack
+ * any more, which cuts off a device the host talks through, so only use
+ * this on mirror ports. Ethernet devices only; the filter passed
+ * to the loop is not used. Must be called before the loop starts.
+ * @param enable true to capture through AF_XDP
+ */
+NETHOGS_DSO_VISIBLE void nethogsmonitor_set_xdp(bool enable);
+
+/**
+ * @brief Capture only 1 in 'rate' packets, chosen at random (in the kernel
+ * where possible), and scale the bytes and packets up by 'rate'. The rates
+ * then come with an error in NethogsMonitorRecordExt; the histograms count
+ * the sampled packets and TCP health is not meaningful. Ignored unless
+ * capturing. Must be called before the loop starts.
+ * @param rate 1 to capture every packet
+ */
+NETHOGS_DSO_VISIBLE void nethogsmonitor_set_sample(unsigned int rate);
+
+/**
+ * @brief Keeps the CPU used by the loop under 'percent' of one CPU, measured
+ * at every refresh. Above it, fidelity is given up a step at a time:
+ * shorter snapshots, sampling (on top of nethogsmonitor_set_sample, with
+ * the error in NethogsMonitorRecordExt), fewer refreshes and fewer reads of
+ * the socket tables; when well below it for a while, a step is taken back.
+ * Must be called before the loop starts.
+ * @param percent the limit, 0 for none (the default)
+ */
+NETHOGS_DSO_VISIBLE void nethogsmonitor_set_cpu_limit(float percent);
+
+/**
+ * @brief Tells how much fidelity the CPU limit has cost. Call from the thread
+ * running the loop, e.g. in the callback.
+ * @param cpu_percent if not NULL, set to the CPU used by the loop recently,
+ * in percent of one CPU
+ * @return 0 at full fidelity, higher when more was given up
+ */
+NETHOGS_DSO_VISIBLE int nethogsmonitor_governor_level(float *cpu_percent);
+
+/**
+ * @brief Sets up the capture: the size of the kernel buffer, whether
+ * packets are handed over as they arrive, and the timeout after which they
+ * are handed over otherwise. Must be called before the loop starts.
+ * @param buffer_kb size of the capture buffer in KB, 0 for libpcap's default
+ * @param immediate true for immediate mode
+ * @param timeout_ms the capture timeout in milliseconds, 100 by default
+ */
+NETHOGS_DSO_VISIBLE void nethogsmonitor_set_capture(int buffer_kb,
+                                                    bool immediate,
+                                                    int timeout_ms);
+
+/**
+ * @brief Sums up the packets received and dropped on all capture handles
+ * since the loop started, to tune the capture buffer. Call from the thread
+ * running the loop, e.g. in the callback.
+ * @return the number of handles that reported their statistics
+ */
+NETHOGS_DSO_VISIBLE int nethogsmonitor_capture_stats(uint64_t *received,
+                                                     uint64_t *dropped);
+
+/**
+ * @brief Copies the occupancy of the object pools, for up to max pools.
+ * Pools appear once they've allocated; their memory is reused and not given
+ * back. Call from the thread running the loop, e.g. in the callback.
+ * @return the number of pools, which may be more than max
+ */
+NETHOGS_DSO_VISIBLE int nethogsmonitor_pool_stats(NethogsPoolStats *stats,
+                                                  int max);
+
 /**
  * @brief Makes the call to nethogsmonitor_loop return.
  */
@@ -0,0 +1,100 @@
+/*
+ * linger_test.cpp
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ *USA.
+ *
+ */
+
+#include "nethogs.cpp"
+
+#include <sstream>
+
+extern ProcList *processes;
+
+/* accounts a segment with 'flags' of the connection from 10.0.0.1:1111 to
+ * 10.0.0.2:80, and returns what getProcess had to say about it */
+static std::string segment(u_int8_t flags, bool outgoing) {
+  in_addr local, remote;
+  local.s_addr = htonl(0x0a000001);
+  remote.s_addr = htonl(0x0a000002);
+  Packet *packet =
+      outgoing ? new Packet(local, 1111, remote, 80, 60, curtime, dir_outgoing)
+               : new Packet(remote, 80, local, 1111, 60, curtime, dir_incoming);
+  tcp_hdr th;
+  memset(&th, 0, sizeof(th));
+  th.th_flags = flags;
+
+  std::ostringstream said;
+  std::streambuf *out = std::cout.rdbuf(said.rdbuf());
+  account_tcp(packet, &th, 0, "eth0");
+  std::cout.rdbuf(out);
+  delete packet;
+  return said.str();
+}
+
+/* sums up every process, which removes the closed connections */
+static void refresh() {
+  for (ProcList *p = processes; p != NULL; p = p->getNext()) {
+    float recv, sent;
+    p->getVal()->getkbps(&recv, &sent);
+  }
+}
+
+/* a connection closed by FINs both ways and the last ACK, and an ACK that
+ * comes in after the connection was removed: it makes a new connection,
+ * which must not reread the socket tables on the packet path */
+static int late_ack() {
+  char const refreshed[] = "not in connection-to-inode table";
+
+  curtime = NSEC_PER_SEC;
+  if (segment(TH_FIN | TH_ACK, true).find(refreshed) == std::string::npos) {
+    std::cerr << "The first segment of an unknown connection wasn't looked "
+                 "up" << std::endl;
+    return 1;
+  }
+  segment(TH_FIN | TH_ACK, false);
+  segment(TH_ACK, true);
+
+  curtime += (CLOSELINGER + 1) * NSEC_PER_SEC;
+  refresh();
+
+  std::string const said = segment(TH_ACK, false);
+  if (said.find(refreshed) != std::string::npos) {
+    std::cerr << "The late ACK of a closed connection was looked up: " << said
+              << std::endl;
+    return 2;
+  }
+  in_addr local, remote;
+  local.s_addr = htonl(0x0a000001);
+  remote.s_addr = htonl(0x0a000002);
+  Packet packet(local, 1111, remote, 80, 60, curtime, dir_outgoing);
+  if (findConnection(&packet, IPPROTO_TCP) == NULL) {
+    std::cerr << "The late ACK wasn't accounted" << std::endl;
+    return 3;
+  }
+  return 0;
+}
+
+int main() {
+  bughuntmode = true;
+  process_init();
+
+  int failed = late_ack();
+  if (failed)
+    return failed;
+
+  return 0;
+}
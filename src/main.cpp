@@ -1,6 +1,8 @@
 #include "nethogs.cpp"
 #include <fcntl.h>
 #include <vector>
+#include <sstream>
+#include <climits>
 
 #ifdef __linux__
 #include <linux/limits.h>
@@ -12,13 +14,18 @@
 
 // The self_pipe is used to interrupt the select() in the main loop
 static std::pair<int, int> self_pipe = std::make_pair(-1, -1);
-static time_t last_refresh_time = 0;
+static u_int64_t last_refresh_time = 0;
 
 // selectable file descriptors for the main loop
 static fd_set pc_loop_fd_set;
 static std::vector<int> pc_loop_fd_list;
 static bool pc_loop_use_select = true;
 
+// report bytes per VLAN (tracemode only)
+static bool vlanstats = false;
+// look inside VXLAN, GENEVE, GRE and IP-in-IP tunnels
+static bool decap = false;
+
 static void versiondisplay(void) { std::cout << version << "\n"; }
 
 static void help(bool iserror) {
@@ -27,17 +34,20 @@ static void help(bool iserror) {
   // output << "usage: nethogs [-V] [-b] [-d seconds] [-t] [-p] [-f (eth|ppp))]
   // [device [device [device ...]]]\n";
   output << "usage: nethogs [-V] [-h] [-b] [-d seconds] [-v mode] [-c count] "
-            "[-t] [-p] [-s] [-a] [-l] [-f filter] [-C]"
+            "[-t] [-p] [-s] [-a] [-l] [-f filter] [-C] [-Q] [-D] [-G] [-T] [-P] [-e] [-N] "
+            "[-B kbytes] [-I] [-w ms] [-X mirror] [-S rate] [-L percent] "
             "[device [device [device ...]]]\n";
   output << "		-V : prints version.\n";
   output << "		-h : prints this help.\n";
   output << "		-b : bughunt mode - implies tracemode.\n";
-  output << "		-d : delay for update refresh rate in seconds. default "
-            "is 1.\n";
+  output << "		-d : delay for update refresh rate in seconds, down to "
+            "0.1. default is 1.\n";
   output << "		-v : view mode (0 = KB/s, 1 = total KB, 2 = total B, 3 "
-            "= total MB). default is 0.\n";
+            "= total MB, 4 = peak KB/s over 1 ms, 5 = peak KB/s over 10 ms, "
+            "6 = packets/s, 7 = TCP retransmits). default is 0.\n";
   output << "		-c : number of updates. default is 0 (unlimited).\n";
-  output << "		-t : tracemode.\n";
+  output << "		-t : tracemode. in KB/s mode each line ends with the peak "
+            "KB/s sent and received over 1 ms and 10 ms.\n";
   // output << "		-f : format of packets on interface, default is
   // eth.\n";
   output << "		-p : sniff in promiscious mode (not recommended).\n";
@@ -45,17 +55,45 @@ static void help(bool iserror) {
   output << "		-l : display command line.\n";
   output << "		-a : monitor all devices, even loopback/stopped ones.\n";
   output << "		-C : capture TCP and UDP.\n";  
+  output << "		-Q : in tracemode, also report bytes per VLAN.\n";
+  output << "		-D : decapsulate VXLAN, GENEVE, GRE and IP-in-IP "
+            "tunnels.\n";
+  output << "		-G : also keep histograms of the gaps between packets.\n";
+  output << "		-T : track TCP retransmits, zero windows, SYN/FIN/RST and "
+            "handshake round trips.\n";
+  output << "		-P : don't capture, poll the TCP byte counters of the "
+            "sockets through sock_diag (Linux 4.1+, TCP only).\n";
+  output << "		-e : don't capture, count the flows in the kernel with "
+            "an eBPF program at tc ingress and egress.\n";
+  output << "		-N : don't capture, account forwarded traffic per "
+            "internal host and port from the conntrack table.\n";
+  output << "		-B : size of the kernel capture buffer in KB. default is "
+            "libpcap's (usually 2 MB). tracemode reports drops.\n";
+  output << "		-I : immediate mode: handle packets as they arrive, "
+            "rather than when the buffer fills up or the timeout passes.\n";
+  output << "		-w : capture timeout in milliseconds. default is 100.\n";
+  output << "		-X mirror : capture received frames through AF_XDP sockets "
+            "instead of libpcap. WARNING: those frames no longer reach this "
+            "host, so only use it on a mirror port. 'mirror' confirms that.\n";
+  output << "		-S : capture 1 in rate packets, chosen at random, and "
+            "scale up. tracemode adds the 95% error of the KB/s.\n";
+  output << "		-L : keep the CPU usage of nethogs under percent of one "
+            "CPU, at the cost of fidelity (see the man page).\n";
   output << "		-f : EXPERIMENTAL: specify string pcap filter (like tcpdump)."
             " This may be removed or changed in a future version.\n";
   output << "		device : device(s) to monitor. default is all "
-            "interfaces up and running excluding loopback\n";
+            "interfaces up and running excluding loopback. 'any' "
+            "captures on all interfaces through a single handle\n";
   output << std::endl;
   output << "When nethogs is running, press:\n";
   output << " q: quit\n";
   output << " s: sort by SENT traffic\n";
   output << " r: sort by RECEIVE traffic\n";
   output << " l: display command line\n";
-  output << " m: switch between total (KB, B, MB) and KB/s mode\n";
+  output << " m: switch between total (KB, B, MB), KB/s, peak KB/s and packets/s "
+            "mode\n";
+  output << " h: show the packet size and gap histograms of the top "
+            "process\n";
 }
 
 void quit_cb(int /* i */) {
@@ -83,6 +121,15 @@ void forceExit(bool success, const char *msg, ...) {
     exit(EXIT_FAILURE);
 }
 
+/* the whole number in 'arg', from 0 to 'max', or -1 when it isn't one */
+static long option_number(const char *arg, long max) {
+  char *end;
+  long value = strtol(arg, &end, 10);
+  if (*arg == '\0' || *end != '\0' || value < 0 || value > max)
+    return -1;
+  return value;
+}
+
 std::pair<int, int> create_self_pipe() {
   int pfd[2];
   if (pipe(pfd) == -1)
@@ -107,7 +154,8 @@ bool wait_for_next_trigger() {
       nfds = std::max(nfds, *it + 1);
       FD_SET(fd, &pc_loop_fd_set);
     }
-    timeval timeout = {refreshdelay, 0};
+    timeval timeout = {(time_t)(refreshdelay / NSEC_PER_SEC),
+                       (suseconds_t)(refreshdelay % NSEC_PER_SEC / 1000)};
     if (select(nfds, &pc_loop_fd_set, 0, 0, &timeout) != -1) {
       if (FD_ISSET(self_pipe.first, &pc_loop_fd_set)) {
         return false;
@@ -120,6 +168,69 @@ bool wait_for_next_trigger() {
   return true;
 }
 
+/* packets dropped by the kernel, when there are any */
+static void show_drops(handle *handles, std::ostream &out) {
+  for (handle *current_handle = handles; current_handle != NULL;
+       current_handle = current_handle->next) {
+    u_int64_t received, dropped;
+    if (dp_stats(current_handle->content, &received, &dropped) == 0 &&
+        dropped != 0)
+      out << "Dropped on " << current_handle->devicename << "\t" << dropped
+          << " of " << received << " packets" << std::endl;
+  }
+}
+
+void show_capture_trace(handle *handles) {
+  show_drops(handles, std::cout);
+  for (handle *current_handle = handles; current_handle != NULL;
+       current_handle = current_handle->next) {
+    const dp_handle *content = current_handle->content;
+    if (content->decap)
+      std::cout << "Tunnel overhead on " << current_handle->devicename << "\t"
+                << content->decap_overhead << std::endl;
+    if (content->vlan_bytes == NULL)
+      continue;
+    for (int vlan = 0; vlan < DP_N_VLANS; vlan++) {
+      if (content->vlan_bytes[vlan] != 0)
+        std::cout << "VLAN " << vlan << " on " << current_handle->devicename
+                  << "\t" << content->vlan_bytes[vlan] << std::endl;
+    }
+  }
+}
+
+/* the descriptors of the handles, after they were reopened */
+static void reset_fd_list(handle *handles) {
+  pc_loop_fd_list.clear();
+  pc_loop_fd_list.push_back(self_pipe.first);
+  for (handle *current_handle = handles; current_handle != NULL;
+       current_handle = current_handle->next) {
+    int const fd = dp_get_selectable_fd(current_handle->content);
+    if (fd == -1) {
+      pc_loop_use_select = false;
+      pc_loop_fd_list.clear();
+      fprintf(stderr, "failed to get selectable_fd for %s\n",
+              current_handle->devicename);
+      return;
+    }
+    pc_loop_fd_list.push_back(fd);
+  }
+}
+
+/* what the CPU governor gave up, in tracemode */
+static void show_governor(const governor_settings &settings) {
+  std::cout << "CPU " << governor_cpu() << "% for a limit of " << cpulimit
+            << "%: level " << governor_level();
+  if (governor_level() == 0) {
+    std::cout << ", full fidelity" << std::endl;
+    return;
+  }
+  std::cout << ", sampling 1 in " << settings.samplerate << " packets, "
+            << settings.snaplen << " bytes of each, refreshing every "
+            << (double)settings.refreshdelay / NSEC_PER_SEC
+            << " s and reading the socket tables every "
+            << settings.conninodeevery << " refreshes" << std::endl;
+}
+
 void clean_up() {
   // close file descriptors
   for (std::vector<int>::const_iterator it = pc_loop_fd_list.begin();
@@ -127,6 +238,8 @@ void clean_up() {
     close(*it);
   }
 
+  tcbpf_detach();
+  conntrack_close();
   procclean();
   if ((!tracemode) && (!DEBUG))
     exit_ui();
@@ -139,7 +252,7 @@ int main(int argc, char **argv) {
   char *filter = NULL;
 
   int opt;
-  while ((opt = getopt(argc, argv, "Vhbtpsd:v:c:laf:C")) != -1) {
+  while ((opt = getopt(argc, argv, "Vhbtpsd:v:c:laf:CQDGTPeNB:Iw:X:S:L:")) != -1) {
     switch (opt) {
     case 'V':
       versiondisplay();
@@ -161,7 +274,10 @@ int main(int argc, char **argv) {
       sortRecv = false;
       break;
     case 'd':
-      refreshdelay = (time_t) atoi(optarg);
+      refreshdelay = (u_int64_t)(atof(optarg) * NSEC_PER_SEC);
+      if (refreshdelay < MIN_REFRESH_MSEC * NSEC_PER_MSEC)
+        forceExit(false, "The refresh delay must be at least %.1f seconds.",
+                  MIN_REFRESH_MSEC / 1000.0);
       break;
     case 'v':
       viewMode = atoi(optarg) % VIEWMODE_COUNT;
@@ -181,6 +297,64 @@ int main(int argc, char **argv) {
     case 'C':
       catchall = true;
       break;
+    case 'Q':
+      vlanstats = true;
+      break;
+    case 'D':
+      decap = true;
+      break;
+    case 'G':
+      histgaps = true;
+      break;
+    case 'T':
+      tcphealth = true;
+      break;
+    case 'P':
+      diagmode = true;
+      break;
+    case 'e':
+      bpfmode = true;
+      break;
+    case 'N':
+      ctmode = true;
+      break;
+    case 'B':
+      capturebuffer = option_number(optarg, INT_MAX / 1024);
+      if (capturebuffer < 0)
+        forceExit(false, "The capture buffer must be a number of KB, 0 or "
+                         "more.");
+      break;
+    case 'I':
+      immediatemode = true;
+      break;
+    case 'w':
+      capturetimeout = option_number(optarg, INT_MAX);
+      if (capturetimeout < 0)
+        forceExit(false, "The capture timeout must be a number of "
+                         "milliseconds, 0 or more.");
+      break;
+    case 'X':
+      // the frames are taken away from the host, which cuts off a device
+      // that's in use, so it has to be asked for in so many words
+      if (strcmp(optarg, "mirror") != 0)
+        forceExit(false, "-X takes the frames away from the network stack "
+                         "of this host. Only use it on a mirror port, and "
+                         "confirm that with '-X mirror'.");
+      xdpmode = true;
+      break;
+    case 'S': {
+      long const rate = option_number(optarg, MAX_SAMPLERATE);
+      if (rate < 1)
+        forceExit(false, "The sample rate must be from 1 to %d.",
+                  MAX_SAMPLERATE);
+      samplerate = rate;
+      break;
+    }
+    case 'L':
+      cpulimit = atof(optarg);
+      if (cpulimit <= 0)
+        forceExit(false, "The CPU limit must be above 0 percent.");
+      break;
     default:
       help(true);
       exit(EXIT_FAILURE);
@@ -188,8 +362,15 @@ int main(int argc, char **argv) {
   }
 
   process_init();
-  device *devices = get_devices(argc - optind, argv + optind, all);
-  if (devices == NULL)
+  // polling sock_diag or conntrack needs neither devices nor capture
+  // privileges
+  bool const polling = diagmode || ctmode;
+  // the counters of the kernel see every packet
+  if (samplerate > 1 && (polling || bpfmode))
+    forceExit(false, "Sampling (-S) only applies to packet capture.");
+  device *devices =
+      polling ? NULL : get_devices(argc - optind, argv + optind, all);
+  if (devices == NULL && !polling)
     forceExit(false, "No devices to monitor. Use '-a' to allow monitoring "
                      "loopback interfaces or devices that are not up/running");
 
@@ -197,7 +378,7 @@ int main(int argc, char **argv) {
     init_ui();
   }
 
-  if (geteuid() != 0) {
+  if (geteuid() != 0 && !polling) {
 #ifdef __linux__
     char exe_path[PATH_MAX];
     ssize_t len;
@@ -225,6 +406,24 @@ int main(int argc, char **argv) {
     pc_loop_fd_list.push_back(self_pipe.first);
   }
 
+  // the inner addresses of tunneled traffic usually belong to another local
+  // interface (the VTEP or the tunnel device), so recognise all of them
+  // and conntrack has to tell forwarded connections from our own
+  if (decap || ctmode) {
+    device *local = get_devices(0, NULL, true);
+    for (device *dev = local; dev != NULL; dev = dev->next) {
+      bool monitored = false;
+      for (device *mon = devices; mon != NULL; mon = mon->next)
+        monitored = monitored || strcmp(mon->name, dev->name) == 0;
+      if (!monitored && !getLocal(dev->name, tracemode))
+        forceExit(false, "getifaddrs failed while establishing local IP.");
+    }
+    free_devices(local);
+  }
+
+  if (ctmode && !conntrack_open())
+    forceExit(false, "Error subscribing to conntrack events.");
+
   char errbuf[PCAP_ERRBUF_SIZE];
 
   int nb_devices = 0;
@@ -239,13 +438,26 @@ int main(int argc, char **argv) {
       forceExit(false, "getifaddrs failed while establishing local IP.");
     }
 
+    if (bpfmode) {
+      if (!tcbpf_attach(current_dev->name))
+        ++nb_failed_devices;
+      current_dev = current_dev->next;
+      continue;
+    }
+
     dp_handle *newhandle =
-        dp_open_live(current_dev->name, BUFSIZ, promisc, 100, filter, errbuf);
+        xdpmode ? dp_open_xdp(current_dev->name, errbuf)
+                : dp_open_live(current_dev->name, BUFSIZ, promisc,
+                               capturetimeout, capturebuffer * 1024,
+                               immediatemode, filter, errbuf);
     if (newhandle != NULL) {
-      dp_addcb(newhandle, dp_packet_ip, process_ip);
-      dp_addcb(newhandle, dp_packet_ip6, process_ip6);
-      dp_addcb(newhandle, dp_packet_tcp, process_tcp);
-      dp_addcb(newhandle, dp_packet_udp, process_udp);
+      dp_setbatch(newhandle, process_batch);
+      if (samplerate > 1 && !dp_setsample(newhandle, samplerate) && tracemode)
+        std::cout << "Sampling " << current_dev->name
+                  << " in userspace, not in the kernel" << std::endl;
+      if (vlanstats)
+        dp_count_vlans(newhandle);
+      dp_setdecap(newhandle, decap);
 
       /* The following code solves sf.net bug 1019381, but is only available
        * in newer versions (from 0.8 it seems) of libpcap
@@ -260,7 +472,7 @@ int main(int argc, char **argv) {
 
       if (pc_loop_use_select) {
         // some devices may not support pcap_get_selectable_fd
-        int const fd = pcap_get_selectable_fd(newhandle->pcap_handle);
+        int const fd = dp_get_selectable_fd(newhandle);
         if (fd != -1) {
           pc_loop_fd_list.push_back(fd);
         } else {
@@ -271,6 +483,8 @@ int main(int argc, char **argv) {
         }
       }
     } else {
+      if (xdpmode)
+        fprintf(stderr, "%s\n", errbuf);
       fprintf(stderr, "Error opening handler for device %s\n",
               current_dev->name);
       ++nb_failed_devices;
@@ -279,7 +493,8 @@ int main(int argc, char **argv) {
     current_dev = current_dev->next;
   }
 
-  if (nb_devices == nb_failed_devices) {
+  if (nb_devices == nb_failed_devices && !polling) {
+    tcbpf_detach();
     forceExit(false, "Error opening pcap handlers for all devices.\n");
   }
 
@@ -287,6 +502,10 @@ int main(int argc, char **argv) {
 
   struct dpargs *userdata = (dpargs *)malloc(sizeof(struct dpargs));
 
+  governor_settings governed = {samplerate, BUFSIZ, refreshdelay, 1};
+  if (cpulimit > 0)
+    governor_init(cpulimit, governed);
+
   // Main loop:
   while (1) {
     bool packets_read = false;
@@ -294,7 +513,6 @@ int main(int argc, char **argv) {
     for (handle *current_handle = handles; current_handle != NULL;
          current_handle = current_handle->next) {
       userdata->device = current_handle->devicename;
-      userdata->sa_family = AF_UNSPEC;
       int retval = dp_dispatch(current_handle->content, -1, (u_char *)userdata,
                                sizeof(struct dpargs));
       if (retval == -1)
@@ -307,14 +525,38 @@ int main(int argc, char **argv) {
         packets_read = true;
     }
 
-    time_t const now = ::time(NULL);
+    u_int64_t const now = dp_clock();
+    lookup_pending(now);
     if (last_refresh_time + refreshdelay <= now) {
       last_refresh_time = now;
+      curtime = now;
+      if (diagmode && !sockdiag_poll(now))
+        forceExit(false, "Failed to dump the TCP sockets through sock_diag.");
+      if (bpfmode)
+        tcbpf_drain(now);
+      if (ctmode && !conntrack_poll(now))
+        forceExit(false, "Failed to dump the conntrack table.");
+      if (cpulimit > 0 && governor_tick(now, &governed)) {
+        governor_apply(governed, handles != NULL);
+        for (handle *current_handle = handles; current_handle != NULL;
+             current_handle = current_handle->next)
+          governor_capture(current_handle->content, current_handle->devicename,
+                           governed);
+        refreshdelay = governed.refreshdelay;
+        if (pc_loop_use_select)
+          reset_fd_list(handles);
+        if (tracemode)
+          show_governor(governed);
+      }
       if ((!DEBUG) && (!tracemode)) {
         // handle user input
         ui_tick();
       }
       do_refresh();
+      if (bughuntmode)
+        pool_report(std::cout);
+      if (tracemode)
+        show_capture_trace(handles);
     }
 
     // if not packets, do a select() until next packet
@@ -324,5 +566,10 @@ int main(int argc, char **argv) {
         break;
   }
 
+  // clean_up closes the descriptors of the captures, so the drops are read
+  // before, and shown after the UI is gone so they're seen
+  std::ostringstream drops;
+  show_drops(handles, drops);
   clean_up();
+  std::cerr << drops.str();
 }
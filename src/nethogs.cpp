@@ -32,6 +32,9 @@
 #include <cstring>
 #include <getopt.h>
 #include <cstdarg>
+#include <map>
+
+#include <net/if.h>
 
 #include <netinet/ip.h>
 #include <netinet/ip6.h>
@@ -48,10 +51,15 @@ extern "C" {
 #include "connection.h"
 #include "process.h"
 #include "devices.h"
+#include "sockdiag.h"
+#include "tcbpf.h"
+#include "conntrack.h"
+#include "governor.h"
 
 extern Process *unknownudp;
 
-time_t refreshdelay = 1;
+// nanoseconds between refreshes
+u_int64_t refreshdelay = NSEC_PER_SEC;
 unsigned refreshlimit = 0;
 unsigned refreshcount = 0;
 unsigned processlimit = 0;
@@ -60,10 +68,32 @@ bool bughuntmode = false;
 // sort on sent or received?
 bool sortRecv = true;
 bool showcommandline = false;
+bool histgaps = false;
+bool tcphealth = false;
+// keep 1 in samplerate packets, see dp_setsample
+unsigned int samplerate = 1;
+// poll sock_diag instead of capturing
+bool diagmode = false;
+// count in the kernel with eBPF instead of capturing
+bool bpfmode = false;
+// account forwarded traffic from the conntrack table
+bool ctmode = false;
+// the kernel capture buffer in KiB (0 for libpcap's default), whether
+// packets are delivered immediately, and the capture timeout in milliseconds
+int capturebuffer = 0;
+bool immediatemode = false;
+int capturetimeout = 100;
+// capture through AF_XDP sockets instead of libpcap
+bool xdpmode = false;
+// the CPU governor's limit in percent of one CPU, 0 for none, and how
+// often the refreshes reread the socket tables
+float cpulimit = 0;
+unsigned int conninodeevery = 1;
 // viewMode: kb/s or total
 int viewMode = VIEWMODE_KBPS;
 const char version[] = " version " VERSION;
-timeval curtime;
+// the time of the latest packet or refresh, see dp_clock()
+u_int64_t curtime = 0;
 
 bool local_addr::contains(const in_addr_t &n_addr) {
   if ((sa_family == AF_INET) && (n_addr == addr))
@@ -99,49 +129,14 @@ bool local_addr::contains(const struct in6_addr &n_addr) {
 
 struct dpargs {
   const char *device;
-  int sa_family;
-  in_addr ip_src;
-  in_addr ip_dst;
-  in6_addr ip6_src;
-  in6_addr ip6_dst;
 };
 
 const char *getVersion() { return version; }
 
-int process_tcp(u_char *userdata, const dp_header *header,
-                const u_char *m_packet) {
-  struct dpargs *args = (struct dpargs *)userdata;
-  struct tcphdr *tcp = (struct tcphdr *)m_packet;
-
-  curtime = header->ts;
-
-  /* get info from userdata, then call getPacket */
-  Packet *packet;
-  switch (args->sa_family) {
-  case AF_INET:
-#if defined(__APPLE__) || defined(__FreeBSD__)
-    packet = new Packet(args->ip_src, ntohs(tcp->th_sport), args->ip_dst,
-                        ntohs(tcp->th_dport), header->len, header->ts);
-#else
-    packet = new Packet(args->ip_src, ntohs(tcp->source), args->ip_dst,
-                        ntohs(tcp->dest), header->len, header->ts);
-#endif
-    break;
-  case AF_INET6:
-#if defined(__APPLE__) || defined(__FreeBSD__)
-    packet = new Packet(args->ip6_src, ntohs(tcp->th_sport), args->ip6_dst,
-                        ntohs(tcp->th_dport), header->len, header->ts);
-#else
-    packet = new Packet(args->ip6_src, ntohs(tcp->source), args->ip6_dst,
-                        ntohs(tcp->dest), header->len, header->ts);
-#endif
-    break;
-  default:
-    std::cerr << "Invalid address family for TCP packet: " << args->sa_family
-              << std::endl;
-    return true;
-  }
-
+/* accounts a TCP segment, 'payload' is its number of data bytes or 0 when
+ * unknown. The caller deletes the packet */
+static void account_tcp(Packet *packet, const tcp_hdr *th, u_int32_t payload,
+                        const char *device) {
   Connection *connection = findConnection(packet, IPPROTO_TCP);
 
   if (connection != NULL) {
@@ -150,47 +145,20 @@ int process_tcp(u_char *userdata, const dp_header *header,
   } else {
     /* else: unknown connection, create new */
     connection = new Connection(packet);
-    getProcess(connection, args->device);
+    /* the socket of a brand new connection is looked up off the packet
+     * path, together with the other new ones */
+    if ((th->th_flags & TH_SYN) && !(th->th_flags & TH_ACK))
+      getProcessLater(connection, device);
+    else
+      getProcess(connection, device);
   }
-  delete packet;
-
-  /* we're done now. */
-  return true;
+  if (th->th_flags & (TH_SYN | TH_FIN | TH_RST))
+    connection->addflags(th->th_flags, packet->Outgoing(), packet->time);
+  if (connection->tcp != NULL)
+    connection->tcp->add(th, payload, packet->Outgoing(), packet->time);
 }
 
-int process_udp(u_char *userdata, const dp_header *header,
-                const u_char *m_packet) {
-  struct dpargs *args = (struct dpargs *)userdata;
-  struct udphdr *udp = (struct udphdr *)m_packet;
-
-  curtime = header->ts;
-
-  Packet *packet;
-  switch (args->sa_family) {
-  case AF_INET:
-#if defined(__APPLE__) || defined(__FreeBSD__)
-    packet = new Packet(args->ip_src, ntohs(udp->uh_sport), args->ip_dst,
-                        ntohs(udp->uh_dport), header->len, header->ts);
-#else
-    packet = new Packet(args->ip_src, ntohs(udp->source), args->ip_dst,
-                        ntohs(udp->dest), header->len, header->ts);
-#endif
-    break;
-  case AF_INET6:
-#if defined(__APPLE__) || defined(__FreeBSD__)
-    packet = new Packet(args->ip6_src, ntohs(udp->uh_sport), args->ip6_dst,
-                        ntohs(udp->uh_dport), header->len, header->ts);
-#else
-    packet = new Packet(args->ip6_src, ntohs(udp->source), args->ip6_dst,
-                        ntohs(udp->dest), header->len, header->ts);
-#endif
-    break;
-  default:
-    std::cerr << "Invalid address family for UDP packet: " << args->sa_family
-              << std::endl;
-    return true;
-  }
-
+static void account_udp(Packet *packet) {
   // if (DEBUG)
   //	std::cout << "Got packet from " << packet->gethashstring() << std::endl;
 
@@ -205,34 +173,66 @@ int process_udp(u_char *userdata, const dp_header *header,
     unknownudp->connections = new ConnList(connection, unknownudp->connections);
     //getProcess(connection, args->device);
   }
-  delete packet;
-
-  /* we're done now. */
-  return true;
 }
 
-int process_ip(u_char *userdata, const dp_header * /* header */,
-               const u_char *m_packet) {
-  struct dpargs *args = (struct dpargs *)userdata;
-  struct ip *ip = (struct ip *)m_packet;
-  args->sa_family = AF_INET;
-  args->ip_src = ip->ip_src;
-  args->ip_dst = ip->ip_dst;
-
-  /* we're not done yet - also parse tcp :) */
-  return false;
+/* interface names by index, for packets captured on the 'any' device.
+ * Processes keep pointers to these, so they are never freed. */
+static const char *ifindex2name(unsigned int ifindex) {
+  static std::map<unsigned int, const char *> names;
+  std::map<unsigned int, const char *>::iterator it = names.find(ifindex);
+  if (it != names.end())
+    return it->second;
+
+  char name[IF_NAMESIZE];
+  if (if_indextoname(ifindex, name) == NULL)
+    return NULL;
+  return names[ifindex] = strdup(name);
 }
 
-int process_ip6(u_char *userdata, const dp_header * /* header */,
-                const u_char *m_packet) {
+void process_batch(u_char *userdata, const dp_batch *batch) {
   struct dpargs *args = (struct dpargs *)userdata;
-  const struct ip6_hdr *ip6 = (struct ip6_hdr *)m_packet;
-  args->sa_family = AF_INET6;
-  args->ip6_src = ip6->ip6_src;
-  args->ip6_dst = ip6->ip6_dst;
 
-  /* we're not done yet - also parse tcp :) */
-  return false;
+  for (int i = 0; i < batch->count; i++) {
+    const char *device = args->device;
+    if (batch->ifindex[i] != 0) {
+      const char *name = ifindex2name(batch->ifindex[i]);
+      if (name != NULL)
+        device = name;
+    }
+
+    curtime = batch->ts[i];
+
+    /* the kernel knows which way it went, the local addresses are only
+     * needed when it doesn't say */
+    direction dir = dir_unknown;
+    if (batch->direction[i] == dp_dir_incoming)
+      dir = dir_incoming;
+    else if (batch->direction[i] == dp_dir_outgoing)
+      dir = dir_outgoing;
+
+    Packet *packet;
+    if (batch->family[i] == AF_INET) {
+      in_addr src, dst;
+      memcpy(&src, batch->src[i], sizeof(src));
+      memcpy(&dst, batch->dst[i], sizeof(dst));
+      packet = new Packet(src, batch->sport[i], dst, batch->dport[i],
+                          batch->len[i], batch->ts[i], dir);
+    } else {
+      in6_addr src, dst;
+      memcpy(&src, batch->src[i], sizeof(src));
+      memcpy(&dst, batch->dst[i], sizeof(dst));
+      packet = new Packet(src, batch->sport[i], dst, batch->dport[i],
+                          batch->len[i], batch->ts[i], dir);
+    }
+    packet->sample = batch->sample[i];
+
+    if (batch->protocol[i] == IPPROTO_TCP)
+      account_tcp(packet, (const tcp_hdr *)batch->tcp[i], batch->payload[i],
+                  device);
+    else
+      account_udp(packet);
+    delete packet;
+  }
 }
 
 class handle {
@@ -43,6 +43,28 @@
 /* take the average speed over the last 5 seconds */
 #define PERIOD 5
 
+/* timestamps are nanoseconds on the monotonic clock */
+#define NSEC_PER_SEC 1000000000ULL
+#define NSEC_PER_MSEC 1000000ULL
+
+/* the traffic of the last PERIOD is kept in buckets of this many
+ * milliseconds, so rates are exact to within one bucket */
+#define BUCKET_MSEC 20
+#define BUCKET_NSEC (BUCKET_MSEC * NSEC_PER_MSEC)
+#define PERIOD_BUCKETS (PERIOD * 1000 / BUCKET_MSEC)
+
+/* bursts are measured over aligned windows of 1 and 10 ms */
+#define PEAK_WINDOWS 2
+
+/* packet sizes and gaps are counted in this many log-spaced buckets */
+#define HIST_BUCKETS 64
+
+/* the most packets one captured packet may stand for, see dp_setsample */
+#define MAX_SAMPLERATE 65536
+
+/* the fastest refresh rate, in milliseconds */
+#define MIN_REFRESH_MSEC 100
+
 /* the amount of time after the last packet was received
  * after which a process is removed */
 #define PROCESSTIMEOUT 150
@@ -51,6 +73,29 @@
  * after which a connection is removed */
 #define CONNTIMEOUT 50
 
+/* the amount of time a connection is kept after its FINs or a RST, for the
+ * last ACKs */
+#define CLOSELINGER 1
+
+/* the tuple of a closed connection is remembered this long (the TIME_WAIT
+ * of Linux), so the ACKs and FINs that come after the linger aren't looked
+ * up on the packet path again; at most CLOSEDTUPLES of them */
+#define CLOSEDKEEP 60
+#define CLOSEDTUPLES 4096
+
+/* connections that start with a SYN are looked up in batches at most this
+ * often, in milliseconds, until they are found or SYNWAIT seconds passed */
+#define LOOKUP_MSEC 50
+#define SYNWAIT 2
+
+/* TCP connections without a process are shown per device and local port,
+ * in at most UNKNOWN_BUCKETS processes besides "unknown TCP". At each
+ * refresh UNKNOWN_BUDGET of them are looked up again, rereading the
+ * processes at most every UNKNOWN_RETRY seconds */
+#define UNKNOWN_BUCKETS 64
+#define UNKNOWN_BUDGET 256
+#define UNKNOWN_RETRY 10
+
 #define DEBUG 0
 
 #define REVERSEHACK 0
@@ -67,7 +112,11 @@
 #define VIEWMODE_TOTAL_KB 1
 #define VIEWMODE_TOTAL_B 2
 #define VIEWMODE_TOTAL_MB 3
-#define VIEWMODE_COUNT 4
+#define VIEWMODE_PEAK_1MS 4
+#define VIEWMODE_PEAK_10MS 5
+#define VIEWMODE_PACKETS 6
+#define VIEWMODE_RETRANSMITS 7
+#define VIEWMODE_COUNT 8
 
 #define NORETURN __attribute__((__noreturn__))
 
@@ -46,10 +46,10 @@ local_addr *local_addrs = NULL;
 
 /*
  * getLocal
- *	device: This should be device explicit (e.g. eth0:1)
+ *	device: This should be device explicit (e.g. eth0:1), or 'any'
  *
- * uses getifaddrs to get addresses of this device, and adds them to the
- * local_addrs-list.
+ * uses getifaddrs to get addresses of this device (of all devices for
+ * 'any'), and adds them to the local_addrs-list.
  */
 bool getLocal(const char *device, bool tracemode) {
   struct ifaddrs *ifaddr, *ifa;
@@ -61,7 +61,7 @@ bool getLocal(const char *device, bool tracemode) {
     if (ifa->ifa_addr == NULL)
       continue;
 
-    if (strcmp(ifa->ifa_name, device) != 0)
+    if (strcmp(device, "any") != 0 && strcmp(ifa->ifa_name, device) != 0)
       continue;
 
     int family = ifa->ifa_addr->sa_family;
@@ -103,36 +103,8 @@ struct ppp_header {
   u_int16_t packettype;
 };
 
-/* TCP header */
-// TODO take from elsewhere.
-struct tcp_hdr {
-  u_short th_sport; /* source port */
-  u_short th_dport; /* destination port */
-  tcp_seq th_seq;   /* sequence number */
-  tcp_seq th_ack;   /* acknowledgement number */
-#if BYTE_ORDER == LITTLE_ENDIAN
-  u_int th_x2 : 4, /* (unused) */
-      th_off : 4;  /* data offset */
-#endif
-#if BYTE_ORDER == BIG_ENDIAN
-  u_int th_off : 4, /* data offset */
-      th_x2 : 4;    /* (unused) */
-#endif
-  u_char th_flags;
-#define TH_FIN 0x01
-#define TH_SYN 0x02
-#define TH_RST 0x04
-#define TH_PUSH 0x08
-#define TH_ACK 0x10
-#define TH_URG 0x20
-#define TH_ECE 0x40
-#define TH_CWR 0x80
-  u_short th_win; /* window */
-  u_short th_sum; /* checksum */
-  u_short th_urp; /* urgent pointer */
-};
 Packet::Packet(in_addr m_sip, unsigned short m_sport, in_addr m_dip,
-               unsigned short m_dport, u_int32_t m_len, timeval m_time,
+               unsigned short m_dport, u_int32_t m_len, u_int64_t m_time,
                direction m_dir) {
   sip = m_sip;
   sport = m_sport;
@@ -140,13 +112,14 @@ Packet::Packet(in_addr m_sip, unsigned short m_sport, in_addr m_dip,
   dport = m_dport;
   len = m_len;
   time = m_time;
+  sample = 1;
   dir = m_dir;
   sa_family = AF_INET;
   hashstring = NULL;
 }
 
 Packet::Packet(in6_addr m_sip, unsigned short m_sport, in6_addr m_dip,
-               unsigned short m_dport, u_int32_t m_len, timeval m_time,
+               unsigned short m_dport, u_int32_t m_len, u_int64_t m_time,
                direction m_dir) {
   sip6 = m_sip;
   sport = m_sport;
@@ -154,6 +127,7 @@ Packet::Packet(in6_addr m_sip, unsigned short m_sport, in6_addr m_dip,
   dport = m_dport;
   len = m_len;
   time = m_time;
+  sample = 1;
   dir = m_dir;
   sa_family = AF_INET6;
   hashstring = NULL;
@@ -170,11 +144,14 @@ direction invert(direction dir) {
 
 Packet *Packet::newInverted() {
   direction new_direction = invert(dir);
+  Packet *inverted;
 
   if (sa_family == AF_INET)
-    return new Packet(dip, dport, sip, sport, len, time, new_direction);
+    inverted = new Packet(dip, dport, sip, sport, len, time, new_direction);
   else
-    return new Packet(dip6, dport, sip6, sport, len, time, new_direction);
+    inverted = new Packet(dip6, dport, sip6, sport, len, time, new_direction);
+  inverted->sample = sample;
+  return inverted;
 }
 
 /* constructs returns a new Packet() structure with the same contents as this
@@ -188,11 +165,14 @@ Packet::Packet(const Packet &old_packet) {
   dport = old_packet.dport;
   len = old_packet.len;
   time = old_packet.time;
+  sample = old_packet.sample;
   sa_family = old_packet.sa_family;
   if (old_packet.hashstring == NULL)
     hashstring = NULL;
-  else
-    hashstring = strdup(old_packet.hashstring);
+  else {
+    hashstring = (char *)Pool<HashKey>::alloc("HashKey");
+    memcpy(hashstring, old_packet.hashstring, HASHKEYSIZE);
+  }
   dir = old_packet.dir;
 }
 
@@ -204,21 +184,20 @@ bool samein6addr(in6_addr one, in6_addr other) {
   return std::equal(one.s6_addr, one.s6_addr + 16, other.s6_addr);
 }
 
-bool Packet::isOlderThan(timeval t) {
-  std::cout << "Comparing " << time.tv_sec << " <= " << t.tv_sec << std::endl;
-  return (time.tv_sec <= t.tv_sec);
+bool Packet::isOlderThan(u_int64_t t) {
+  std::cout << "Comparing " << time << " <= " << t << std::endl;
+  return (time <= t);
 }
 
 bool Packet::Outgoing() {
-  /* must be initialised with getLocal("eth0:1");) */
-  assert(local_addrs != NULL);
-
   switch (dir) {
   case dir_outgoing:
     return true;
   case dir_incoming:
     return false;
   case dir_unknown:
+    /* must be initialised with getLocal("eth0:1");) */
+    assert(local_addrs != NULL);
     bool islocal;
     if (sa_family == AF_INET)
       islocal = local_addrs->contains(sip.s_addr);
@@ -260,11 +239,10 @@ char *Packet::gethashstring() {
     return hashstring;
   }
 
-  // TODO free this value in the Packet destructor
-  hashstring = (char *)malloc(HASHKEYSIZE * sizeof(char));
+  hashstring = (char *)Pool<HashKey>::alloc("HashKey");
 
-  char *local_string = (char *)malloc(50);
-  char *remote_string = (char *)malloc(50);
+  char local_string[50];
+  char remote_string[50];
   if (sa_family == AF_INET) {
     inet_ntop(sa_family, &sip, local_string, 49);
     inet_ntop(sa_family, &dip, remote_string, 49);
@@ -272,15 +250,15 @@ char *Packet::gethashstring() {
     inet_ntop(sa_family, &sip6, local_string, 49);
     inet_ntop(sa_family, &dip6, remote_string, 49);
   }
+  /* inet_ntop writes at most 39 characters of an IPv6 address, see
+   * HASHKEYSIZE; the precision tells the compiler */
   if (Outgoing()) {
-    snprintf(hashstring, HASHKEYSIZE * sizeof(char), "%s:%d-%s:%d",
+    snprintf(hashstring, HASHKEYSIZE * sizeof(char), "%.39s:%d-%.39s:%d",
              local_string, sport, remote_string, dport);
   } else {
-    snprintf(hashstring, HASHKEYSIZE * sizeof(char), "%s:%d-%s:%d",
+    snprintf(hashstring, HASHKEYSIZE * sizeof(char), "%.39s:%d-%.39s:%d",
              remote_string, dport, local_string, sport);
   }
-  free(local_string);
-  free(remote_string);
   // if (DEBUG)
   //	std::cout << "Returning newly created hash string: " << hashstring <<
   // std::endl;
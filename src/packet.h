@@ -28,17 +28,54 @@
 
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include "nethogs.h"
+#include "pool.h"
 
 enum direction { dir_unknown, dir_incoming, dir_outgoing };
 
+/* TCP header, as far as the TCP health tracking needs it */
+struct tcp_hdr {
+  u_short th_sport; /* source port */
+  u_short th_dport; /* destination port */
+  tcp_seq th_seq;   /* sequence number */
+  tcp_seq th_ack;   /* acknowledgement number */
+#if BYTE_ORDER == LITTLE_ENDIAN
+  u_int th_x2 : 4, /* (unused) */
+      th_off : 4;  /* data offset */
+#endif
+#if BYTE_ORDER == BIG_ENDIAN
+  u_int th_off : 4, /* data offset */
+      th_x2 : 4;    /* (unused) */
+#endif
+  u_char th_flags;
+#define TH_FIN 0x01
+#define TH_SYN 0x02
+#define TH_RST 0x04
+#define TH_PUSH 0x08
+#define TH_ACK 0x10
+#define TH_URG 0x20
+#define TH_ECE 0x40
+#define TH_CWR 0x80
+  u_short th_win; /* window */
+  u_short th_sum; /* checksum */
+  u_short th_urp; /* urgent pointer */
+};
+
 /* To initialise this module, call getLocal with the currently
  * monitored device (e.g. "eth0:1") */
 bool getLocal(const char *device, bool tracemode);
 
+/* the storage of a Packet's hash string */
+struct HashKey {
+  char str[HASHKEYSIZE];
+};
+
 class Packet {
 public:
+  POOLED(Packet)
+
   in6_addr sip6;
   in6_addr dip6;
   in_addr sip;
@@ -46,19 +83,22 @@ public:
   unsigned short sport;
   unsigned short dport;
   u_int32_t len;
-  timeval time;
+  /* nanoseconds, monotonic */
+  u_int64_t time;
+  /* captured while 1 in 'sample' packets were, so it stands for that many */
+  u_int32_t sample;
 
   Packet(in_addr m_sip, unsigned short m_sport, in_addr m_dip,
-         unsigned short m_dport, u_int32_t m_len, timeval m_time,
+         unsigned short m_dport, u_int32_t m_len, u_int64_t m_time,
          direction dir = dir_unknown);
   Packet(in6_addr m_sip, unsigned short m_sport, in6_addr m_dip,
-         unsigned short m_dport, u_int32_t m_len, timeval m_time,
+         unsigned short m_dport, u_int32_t m_len, u_int64_t m_time,
          direction dir = dir_unknown);
   /* copy constructor */
   Packet(const Packet &old);
   ~Packet() {
     if (hashstring != NULL) {
-      free(hashstring);
+      Pool<HashKey>::release(hashstring);
       hashstring = NULL;
     }
   }
@@ -66,10 +106,12 @@ public:
   /* copy constructor that turns the packet around */
   Packet *newInverted();
 
-  bool isOlderThan(timeval t);
+  bool isOlderThan(u_int64_t t);
   /* is this packet coming from the local host? */
   bool Outgoing();
 
+  short int getFamily() const { return sa_family; }
+
   bool match(Packet *other);
   bool matchSource(Packet *other);
   /* returns '1.2.3.4:5-1.2.3.4:6'-style string */
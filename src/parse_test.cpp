@@ -0,0 +1,677 @@
+/*
+ * parse_test.cpp
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ *USA.
+ *
+ */
+
+#include <iostream>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <netinet/in.h>
+
+extern "C" {
+#include "decpcap.h"
+}
+
+/* the packets handed over by decpcap */
+struct parsed {
+  u_int8_t protocol;
+  u_int16_t sport;
+  u_int16_t dport;
+  u_int32_t len;
+};
+
+static void collect(u_char *userdata, const dp_batch *batch) {
+  std::vector<parsed> *packets = (std::vector<parsed> *)userdata;
+  for (int i = 0; i < batch->count; i++) {
+    parsed p = {batch->protocol[i], batch->sport[i], batch->dport[i],
+                batch->len[i]};
+    packets->push_back(p);
+  }
+}
+
+/* only the direction of the packets handed over */
+static void collect_direction(u_char *userdata, const dp_batch *batch) {
+  std::vector<int> *directions = (std::vector<int> *)userdata;
+  for (int i = 0; i < batch->count; i++)
+    directions->push_back(batch->direction[i]);
+}
+
+/* the sizes of the batches handed over, and their packets */
+struct batches {
+  std::vector<int> sizes;
+  std::vector<parsed> packets;
+};
+
+static void collect_batch(u_char *userdata, const dp_batch *batch) {
+  struct batches *seen = (struct batches *)userdata;
+  seen->sizes.push_back(batch->count);
+  collect((u_char *)&seen->packets, batch);
+}
+
+static void put16(u_char *at, u_int16_t value) {
+  at[0] = value >> 8;
+  at[1] = value & 0xff;
+}
+
+/* Ethernet and IPv4 headers in front of 'datalen' bytes of protocol
+ * 'proto'. Returns the start of the IP payload */
+static u_char *ipv4(u_char *frame, u_int8_t proto, u_int16_t id,
+                    u_int16_t fragment, int datalen, u_int8_t host) {
+  memset(frame, 0, 14 + 20);
+  frame[12] = 0x08; /* IPv4 */
+  u_char *ip = frame + 14;
+  ip[0] = 0x45;
+  put16(ip + 2, 20 + datalen);
+  put16(ip + 4, id);
+  put16(ip + 6, fragment);
+  ip[8] = 64;
+  ip[9] = proto;
+  ip[12] = ip[16] = host;
+  ip[15] = 1;
+  ip[19] = 2;
+  return ip + 20;
+}
+
+/* the builders below append a header to a frame */
+static size_t grow(std::vector<u_char> *frame, size_t len) {
+  size_t at = frame->size();
+  frame->resize(at + len);
+  return at;
+}
+
+static void ethernet(std::vector<u_char> *frame, u_int16_t ethertype) {
+  size_t at = grow(frame, 14);
+  put16(&(*frame)[at + 12], ethertype);
+}
+
+/* an 802.1Q/802.1ad tag, followed by 'ethertype' */
+static void vlan(std::vector<u_char> *frame, u_int16_t vid,
+                 u_int16_t ethertype) {
+  size_t at = grow(frame, 4);
+  put16(&(*frame)[at], vid);
+  put16(&(*frame)[at + 2], ethertype);
+}
+
+static void mpls(std::vector<u_char> *frame, u_int32_t label, bool bottom) {
+  size_t at = grow(frame, 4);
+  put16(&(*frame)[at], label >> 4);
+  (*frame)[at + 2] = ((label & 0x0f) << 4) | (bottom ? 0x01 : 0);
+  (*frame)[at + 3] = 64;
+}
+
+/* the 16 bytes in front of a PPP packet, the protocol is in the last 2 */
+static void ppp(std::vector<u_char> *frame, u_int16_t protocol) {
+  size_t at = grow(frame, 16);
+  put16(&(*frame)[at + 14], protocol);
+}
+
+/* the Linux cooked header of a packet of type 'pkttype' */
+static void sll(std::vector<u_char> *frame, u_int16_t pkttype,
+                u_int16_t ethertype) {
+  size_t at = grow(frame, 16);
+  put16(&(*frame)[at], pkttype);
+  put16(&(*frame)[at + 2], 1); /* ARPHRD_ETHER */
+  put16(&(*frame)[at + 4], 6);
+  put16(&(*frame)[at + 14], ethertype);
+}
+
+#ifdef DLT_LINUX_SLL2
+static void sll2(std::vector<u_char> *frame, u_int8_t pkttype,
+                 u_int32_t ifindex, u_int16_t ethertype) {
+  size_t at = grow(frame, 20);
+  put16(&(*frame)[at], ethertype);
+  put16(&(*frame)[at + 4], ifindex >> 16);
+  put16(&(*frame)[at + 6], ifindex & 0xffff);
+  put16(&(*frame)[at + 8], 1); /* ARPHRD_ETHER */
+  (*frame)[at + 10] = pkttype;
+  (*frame)[at + 11] = 6;
+}
+#endif
+
+/* the address family of DLT_NULL, in host byte order or in the other one,
+ * and of DLT_LOOP, in network byte order */
+static void family(std::vector<u_char> *frame, u_int32_t family,
+                   bool swapped) {
+  size_t at = grow(frame, 4);
+  if (swapped)
+    family = ((family & 0xff) << 24) | ((family & 0xff00) << 8) |
+             ((family >> 8) & 0xff00) | (family >> 24);
+  memcpy(&(*frame)[at], &family, 4);
+}
+
+/* an IPv4 header from 10.0.0.1 to 10.0.0.2 with 'optlen' bytes of options,
+ * in front of 'datalen' bytes of protocol 'proto' */
+static void ip4(std::vector<u_char> *frame, u_int8_t proto, int optlen,
+                int datalen) {
+  size_t at = grow(frame, 20 + optlen);
+  u_char *ip = &(*frame)[at];
+  ip[0] = 0x40 | ((20 + optlen) >> 2);
+  put16(ip + 2, 20 + optlen + datalen);
+  ip[8] = 64;
+  ip[9] = proto;
+  ip[12] = ip[16] = 10;
+  ip[15] = 1;
+  ip[19] = 2;
+  /* no-operation options */
+  memset(ip + 20, 1, optlen);
+}
+
+/* an IPv6 header from ::1 to ::2 in front of 'datalen' bytes, the first of
+ * which is header 'nxt' */
+static void ip6(std::vector<u_char> *frame, u_int8_t nxt, int datalen) {
+  size_t at = grow(frame, 40);
+  u_char *ip = &(*frame)[at];
+  ip[0] = 0x60;
+  put16(ip + 4, datalen);
+  ip[6] = nxt;
+  ip[7] = 64;
+  ip[23] = 1;
+  ip[39] = 2;
+}
+
+/* an 8-byte IPv6 extension header. For a fragment header, 'fragment' is the
+ * offset in 8-byte units shifted left by 3, or'ed with the more flag */
+static void ip6_exthdr(std::vector<u_char> *frame, u_int8_t nxt,
+                       u_int16_t fragment, u_int32_t id) {
+  size_t at = grow(frame, 8);
+  u_char *hdr = &(*frame)[at];
+  hdr[0] = nxt;
+  put16(hdr + 2, fragment);
+  put16(hdr + 4, id >> 16);
+  put16(hdr + 6, id & 0xffff);
+}
+
+/* a TCP header from port 'sport' to 80, data is left to the caller */
+static void tcp(std::vector<u_char> *frame, u_int16_t sport) {
+  size_t at = grow(frame, 20);
+  put16(&(*frame)[at], sport);
+  put16(&(*frame)[at + 2], 80);
+  (*frame)[at + 12] = 0x50;
+}
+
+/* writes the frames as a savefile, as libpcap opens nothing else */
+static bool savefile(const char *name,
+                     const std::vector<std::vector<u_char> > &frames,
+                     int linktype) {
+  FILE *f = fopen(name, "wb");
+  if (f == NULL)
+    return false;
+  u_int32_t global[6] = {0xa1b2c3d4, 0x00040002, 0,
+                         0,          65535,      (u_int32_t)linktype};
+  fwrite(global, sizeof(global), 1, f);
+  for (size_t i = 0; i < frames.size(); i++) {
+    u_int32_t record[4] = {1, (u_int32_t)i, (u_int32_t)frames[i].size(),
+                           (u_int32_t)frames[i].size()};
+    fwrite(record, sizeof(record), 1, f);
+    fwrite(&frames[i][0], frames[i].size(), 1, f);
+  }
+  return fclose(f) == 0;
+}
+
+static dp_handle *open_frames(const std::vector<std::vector<u_char> > &frames,
+                              int linktype) {
+  char name[] = "/tmp/parse_testXXXXXX";
+  char errbuf[DP_ERRBUF_SIZE];
+  int fd = mkstemp(name);
+  if (fd == -1)
+    return NULL;
+  close(fd);
+  bool ok = savefile(name, frames, linktype);
+  dp_handle *handle = ok ? dp_open_offline(name, errbuf) : NULL;
+  unlink(name);
+  if (handle == NULL)
+    return NULL;
+  dp_setbatch(handle, collect);
+  dp_setdecap(handle, true);
+  return handle;
+}
+
+static bool parse(const std::vector<std::vector<u_char> > &frames,
+                  std::vector<parsed> *packets, int linktype = DLT_EN10MB) {
+  dp_handle *handle = open_frames(frames, linktype);
+  if (handle == NULL)
+    return false;
+  bool ok = dp_dispatch(handle, -1, (u_char *)packets, sizeof(*packets)) >= 0;
+  dp_close(handle);
+  return ok;
+}
+
+/* a VXLAN datagram in two fragments: the first carries the UDP and VXLAN
+ * headers and a whole TCP packet, the second only the rest of the datagram.
+ * The second is accounted to the tunnel, for all of its length, and nothing
+ * is decapsulated from it */
+static int fragmented_vxlan() {
+  std::vector<std::vector<u_char> > frames(2);
+  int const first = 8 + 8 + 14 + 20 + 20 + 26, rest = 104;
+
+  frames[0].resize(14 + 20 + first);
+  u_char *udp = ipv4(&frames[0][0], IPPROTO_UDP, 0x1234, 0x2000, first, 10);
+  put16(udp, 5000);
+  put16(udp + 2, 4789);
+  put16(udp + 4, first + rest);
+  udp[8] = 0x08; /* VNI present */
+  u_char *tcp = ipv4(udp + 16, IPPROTO_TCP, 1, 0, 20 + 26, 192);
+  put16(tcp, 1111);
+  put16(tcp + 2, 80);
+  tcp[12] = 0x50;
+
+  frames[1].resize(14 + 20 + rest);
+  ipv4(&frames[1][0], IPPROTO_UDP, 0x1234, first / 8, rest, 10);
+
+  std::vector<parsed> packets;
+  if (!parse(frames, &packets)) {
+    std::cerr << "Failed to parse the VXLAN fragments" << std::endl;
+    return 1;
+  }
+  if (packets.size() != 3) {
+    std::cerr << "VXLAN fragments gave " << packets.size()
+              << " packets instead of 3" << std::endl;
+    return 2;
+  }
+  /* the tunnel overhead, the inner packet, and the second fragment */
+  parsed const expected[3] = {{IPPROTO_UDP, 5000, 4789, 14 + 20 + 8 + 8},
+                              {IPPROTO_TCP, 1111, 80, 14 + 20 + 20 + 26},
+                              {IPPROTO_UDP, 5000, 4789, 14 + 20 + rest}};
+  for (int i = 0; i < 3; i++) {
+    if (packets[i].protocol != expected[i].protocol ||
+        packets[i].sport != expected[i].sport ||
+        packets[i].dport != expected[i].dport ||
+        packets[i].len != expected[i].len) {
+      std::cerr << "VXLAN fragments: packet " << i << " is "
+                << (int)packets[i].protocol << " " << packets[i].sport << "-"
+                << packets[i].dport << " of " << packets[i].len << " bytes"
+                << std::endl;
+      return 3;
+    }
+  }
+  return 0;
+}
+
+/* compares the packets handed over by decpcap to the expected ones */
+static bool expect(const char *what, const std::vector<parsed> &packets,
+                   const parsed *expected, size_t count) {
+  if (packets.size() != count) {
+    std::cerr << what << " gave " << packets.size() << " packets instead of "
+              << count << std::endl;
+    return false;
+  }
+  for (size_t i = 0; i < count; i++) {
+    if (packets[i].protocol != expected[i].protocol ||
+        packets[i].sport != expected[i].sport ||
+        packets[i].dport != expected[i].dport ||
+        packets[i].len != expected[i].len) {
+      std::cerr << what << ": packet " << i << " is "
+                << (int)packets[i].protocol << " " << packets[i].sport << "-"
+                << packets[i].dport << " of " << packets[i].len << " bytes"
+                << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+/* TCP behind a single 802.1Q tag, two 802.1ad/802.1Q tags and a stack of two
+ * MPLS labels, and a frame cut off in the middle of its tag. The tags are
+ * peeled off without losing the frame length, the cut off frame is dropped */
+static int tagged() {
+  std::vector<std::vector<u_char> > frames(4);
+
+  ethernet(&frames[0], 0x8100);
+  vlan(&frames[0], 10, 0x0800);
+  ip4(&frames[0], IPPROTO_TCP, 0, 20);
+  tcp(&frames[0], 1001);
+
+  ethernet(&frames[1], 0x88a8);
+  vlan(&frames[1], 100, 0x8100);
+  vlan(&frames[1], 10, 0x0800);
+  ip4(&frames[1], IPPROTO_TCP, 0, 20);
+  tcp(&frames[1], 1002);
+
+  ethernet(&frames[2], 0x8847);
+  mpls(&frames[2], 16, false);
+  mpls(&frames[2], 17, true);
+  ip4(&frames[2], IPPROTO_TCP, 0, 20);
+  tcp(&frames[2], 1003);
+
+  ethernet(&frames[3], 0x8100);
+  frames[3].push_back(0);
+  frames[3].push_back(10);
+
+  std::vector<parsed> packets;
+  if (!parse(frames, &packets)) {
+    std::cerr << "Failed to parse the tagged frames" << std::endl;
+    return 4;
+  }
+  parsed const expected[3] = {
+      {IPPROTO_TCP, 1001, 80, 14 + 4 + 20 + 20},
+      {IPPROTO_TCP, 1002, 80, 14 + 8 + 20 + 20},
+      {IPPROTO_TCP, 1003, 80, 14 + 8 + 20 + 20}};
+  if (!expect("Tagged frames", packets, expected, 3))
+    return 5;
+  return 0;
+}
+
+/* IPv4 options, an IPv6 hop-by-hop and destination options chain, the two
+ * fragments of an IPv6 datagram, and an IPv6 frame that ends inside its
+ * extension header. The transport header is found behind all of them */
+static int extension_headers() {
+  std::vector<std::vector<u_char> > frames(5);
+
+  ethernet(&frames[0], 0x0800);
+  ip4(&frames[0], IPPROTO_TCP, 8, 20 + 10);
+  tcp(&frames[0], 2001);
+  grow(&frames[0], 10);
+
+  ethernet(&frames[1], 0x86dd);
+  ip6(&frames[1], IPPROTO_HOPOPTS, 8 + 8 + 20);
+  ip6_exthdr(&frames[1], IPPROTO_DSTOPTS, 0, 0);
+  ip6_exthdr(&frames[1], IPPROTO_TCP, 0, 0);
+  tcp(&frames[1], 2002);
+
+  ethernet(&frames[2], 0x86dd);
+  ip6(&frames[2], IPPROTO_FRAGMENT, 8 + 20 + 20);
+  ip6_exthdr(&frames[2], IPPROTO_TCP, 0x0001, 7);
+  tcp(&frames[2], 2003);
+  grow(&frames[2], 20);
+
+  ethernet(&frames[3], 0x86dd);
+  ip6(&frames[3], IPPROTO_FRAGMENT, 8 + 16);
+  ip6_exthdr(&frames[3], IPPROTO_TCP, 5 << 3, 7);
+  grow(&frames[3], 16);
+
+  ethernet(&frames[4], 0x86dd);
+  ip6(&frames[4], IPPROTO_HOPOPTS, 8 + 20);
+  grow(&frames[4], 4);
+
+  std::vector<parsed> packets;
+  if (!parse(frames, &packets)) {
+    std::cerr << "Failed to parse the extension headers" << std::endl;
+    return 6;
+  }
+  parsed const expected[4] = {
+      {IPPROTO_TCP, 2001, 80, 14 + 28 + 20 + 10},
+      {IPPROTO_TCP, 2002, 80, 14 + 40 + 16 + 20},
+      {IPPROTO_TCP, 2003, 80, 14 + 40 + 8 + 20 + 20},
+      {IPPROTO_TCP, 2003, 80, 14 + 40 + 8 + 16}};
+  if (!expect("Extension headers", packets, expected, 4))
+    return 7;
+  return 0;
+}
+
+/* parses a single frame of a link type, which should be a TCP packet from
+ * port 'sport' */
+static bool link_frame(const char *what, int linktype,
+                       const std::vector<u_char> &frame, u_int16_t sport) {
+  std::vector<std::vector<u_char> > frames(1, frame);
+  std::vector<parsed> packets;
+  if (!parse(frames, &packets, linktype)) {
+    std::cerr << "Failed to parse the " << what << " frame" << std::endl;
+    return false;
+  }
+  parsed const expected = {IPPROTO_TCP, sport, 80, (u_int32_t)frame.size()};
+  return expect(what, packets, &expected, 1);
+}
+
+/* a TCP packet on each of the link types other than Ethernet */
+static int link_types() {
+  std::vector<u_char> frame;
+
+  sll(&frame, 0, 0x0800);
+  ip4(&frame, IPPROTO_TCP, 0, 20);
+  tcp(&frame, 3001);
+  if (!link_frame("DLT_LINUX_SLL", DLT_LINUX_SLL, frame, 3001))
+    return 8;
+
+#ifdef DLT_LINUX_SLL2
+  frame.clear();
+  sll2(&frame, 0, 2, 0x86dd);
+  ip6(&frame, IPPROTO_TCP, 20);
+  tcp(&frame, 3002);
+  if (!link_frame("DLT_LINUX_SLL2", DLT_LINUX_SLL2, frame, 3002))
+    return 8;
+#endif
+
+  frame.clear();
+  family(&frame, 2, false);
+  ip4(&frame, IPPROTO_TCP, 0, 20);
+  tcp(&frame, 3003);
+  if (!link_frame("DLT_NULL", DLT_NULL, frame, 3003))
+    return 8;
+
+  frame.clear();
+  family(&frame, 28, true);
+  ip6(&frame, IPPROTO_TCP, 20);
+  tcp(&frame, 3004);
+  if (!link_frame("DLT_NULL of the other byte order", DLT_NULL, frame, 3004))
+    return 8;
+
+  frame.clear();
+  family(&frame, htonl(30), false);
+  ip6(&frame, IPPROTO_TCP, 20);
+  tcp(&frame, 3005);
+  if (!link_frame("DLT_LOOP", DLT_LOOP, frame, 3005))
+    return 8;
+
+  frame.clear();
+  ip4(&frame, IPPROTO_TCP, 0, 20);
+  tcp(&frame, 3006);
+  if (!link_frame("DLT_RAW", DLT_RAW, frame, 3006))
+    return 8;
+
+  frame.clear();
+  ip6(&frame, IPPROTO_TCP, 20);
+  tcp(&frame, 3007);
+  if (!link_frame("DLT_RAW IPv6", DLT_RAW, frame, 3007))
+    return 8;
+  return 0;
+}
+
+/* the parser of the link layer is picked per handle when it is opened. The
+ * same TCP packet is captured on handles of different link types that are
+ * all open at the same time, and dispatched in the reverse order; each is
+ * parsed by the parser of its own link type. A cooked frame read as
+ * Ethernet, and a link type without a parser, give nothing */
+static int link_dispatch() {
+  static const int linktypes[] = {DLT_EN10MB, DLT_PPP, DLT_LINUX_SLL,
+                                  DLT_RAW,    DLT_EN10MB, 147};
+  int const n = sizeof(linktypes) / sizeof(linktypes[0]);
+  std::vector<std::vector<u_char> > frames[n];
+  dp_handle *handles[n];
+  std::vector<parsed> packets[n];
+
+  for (int i = 0; i < n; i++) {
+    std::vector<u_char> frame;
+    switch (i) {
+    case 0:
+      ethernet(&frame, 0x0800);
+      break;
+    case 1:
+      ppp(&frame, 0x0800);
+      break;
+    case 2:
+    case 4:
+      sll(&frame, 0, 0x0800);
+      break;
+    default:
+      break;
+    }
+    ip4(&frame, IPPROTO_TCP, 0, 20);
+    tcp(&frame, 4000 + i);
+    frames[i].push_back(frame);
+    handles[i] = open_frames(frames[i], linktypes[i]);
+    if (handles[i] == NULL) {
+      std::cerr << "Failed to open link type " << linktypes[i] << std::endl;
+      while (i-- > 0)
+        dp_close(handles[i]);
+      return 9;
+    }
+  }
+
+  for (int i = n - 1; i >= 0; i--) {
+    dp_dispatch(handles[i], -1, (u_char *)&packets[i], sizeof(packets[i]));
+    dp_close(handles[i]);
+  }
+
+  for (int i = 0; i < n; i++) {
+    parsed const expected = {IPPROTO_TCP, (u_int16_t)(4000 + i), 80,
+                             (u_int32_t)frames[i][0].size()};
+    size_t const count = i < 4 ? 1 : 0;
+    char what[64];
+    snprintf(what, sizeof(what), "Link type %d of handle %d", linktypes[i],
+             i);
+    if (!expect(what, packets[i], &expected, count))
+      return 10;
+  }
+  return 0;
+}
+
+/* the packet type of a cooked header says which way a packet went: sent by
+ * this host, received by it, or (captured promiscuously) neither */
+static int directions() {
+  static const struct {
+    int pkttype;
+    int direction;
+  } cases[] = {
+      {0, dp_dir_incoming}, /* PACKET_HOST */
+      {1, dp_dir_incoming}, /* PACKET_BROADCAST */
+      {3, dp_dir_unknown},  /* PACKET_OTHERHOST */
+      {4, dp_dir_outgoing}, /* PACKET_OUTGOING */
+  };
+  int const n = sizeof(cases) / sizeof(cases[0]);
+  int linktypes[2] = {DLT_LINUX_SLL}, passes = 1;
+#ifdef DLT_LINUX_SLL2
+  linktypes[passes++] = DLT_LINUX_SLL2;
+#endif
+
+  for (int pass = 0; pass < passes; pass++) {
+    std::vector<std::vector<u_char> > frames(n);
+    for (int i = 0; i < n; i++) {
+#ifdef DLT_LINUX_SLL2
+      if (linktypes[pass] == DLT_LINUX_SLL2)
+        sll2(&frames[i], cases[i].pkttype, 2, 0x0800);
+      else
+#endif
+        sll(&frames[i], cases[i].pkttype, 0x0800);
+      ip4(&frames[i], IPPROTO_TCP, 0, 20);
+      tcp(&frames[i], 5000 + i);
+    }
+    dp_handle *handle = open_frames(frames, linktypes[pass]);
+    if (handle == NULL) {
+      std::cerr << "Failed to open the cooked frames" << std::endl;
+      return 11;
+    }
+    std::vector<int> seen;
+    dp_setbatch(handle, collect_direction);
+    dp_dispatch(handle, -1, (u_char *)&seen, sizeof(seen));
+    dp_close(handle);
+
+    if (seen.size() != (size_t)n) {
+      std::cerr << "Cooked frames gave " << seen.size()
+                << " packets instead of " << n << std::endl;
+      return 12;
+    }
+    for (int i = 0; i < n; i++) {
+      if (seen[i] != cases[i].direction) {
+        std::cerr << "Link type " << linktypes[pass] << " packet type "
+                  << cases[i].pkttype << " has direction " << seen[i]
+                  << " instead of " << cases[i].direction << std::endl;
+        return 13;
+      }
+    }
+  }
+  return 0;
+}
+
+/* a dispatch of more packets than fit in a batch hands them over in full
+ * batches and one with the rest, in the order of the savefile, without
+ * losing or repeating a packet at the boundaries */
+static int batch_boundaries() {
+  int const n = 2 * DP_BATCH + 5;
+  std::vector<std::vector<u_char> > frames(n);
+  for (int i = 0; i < n; i++) {
+    ethernet(&frames[i], 0x0800);
+    ip4(&frames[i], IPPROTO_TCP, 0, 20);
+    tcp(&frames[i], 6000 + i);
+  }
+  dp_handle *handle = open_frames(frames, DLT_EN10MB);
+  if (handle == NULL) {
+    std::cerr << "Failed to open the batch savefile" << std::endl;
+    return 14;
+  }
+  struct batches seen;
+  dp_setbatch(handle, collect_batch);
+  int dispatched = dp_dispatch(handle, -1, (u_char *)&seen, sizeof(seen));
+  dp_close(handle);
+
+  if (dispatched != n || seen.sizes.size() != 3 ||
+      seen.sizes[0] != DP_BATCH || seen.sizes[1] != DP_BATCH ||
+      seen.sizes[2] != 5) {
+    std::cerr << "A dispatch of " << dispatched << " packets gave "
+              << seen.sizes.size() << " batches:";
+    for (size_t i = 0; i < seen.sizes.size(); i++)
+      std::cerr << " " << seen.sizes[i];
+    std::cerr << std::endl;
+    return 15;
+  }
+  std::vector<parsed> expected(n);
+  for (int i = 0; i < n; i++) {
+    parsed const packet = {IPPROTO_TCP, (u_int16_t)(6000 + i), 80,
+                           (u_int32_t)frames[i].size()};
+    expected[i] = packet;
+  }
+  if (!expect("Batches", seen.packets, &expected[0], n))
+    return 16;
+  return 0;
+}
+
+int main() {
+  catchall = true;
+
+  int failed = fragmented_vxlan();
+  if (failed)
+    return failed;
+
+  failed = tagged();
+  if (failed)
+    return failed;
+
+  failed = extension_headers();
+  if (failed)
+    return failed;
+
+  failed = link_types();
+  if (failed)
+    return failed;
+
+  failed = link_dispatch();
+  if (failed)
+    return failed;
+
+  failed = directions();
+  if (failed)
+    return failed;
+
+  failed = batch_boundaries();
+  if (failed)
+    return failed;
+
+  return 0;
+}
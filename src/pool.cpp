@@ -0,0 +1,29 @@
+/*
+ * pool.cpp
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ *USA.
+ *
+ */
+
+#include "pool.h"
+
+PoolStats *pools = NULL;
+
+void pool_report(std::ostream &out) {
+  for (PoolStats *pool = pools; pool != NULL; pool = pool->next)
+    out << "Pool " << pool->name << "\t" << pool->inuse << "/"
+        << pool->capacity << " of " << pool->size << " bytes" << std::endl;
+}
@@ -0,0 +1,114 @@
+/*
+ * pool.h
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ *USA.
+ *
+ */
+
+#ifndef __POOL_H
+#define __POOL_H
+
+#include <cassert>
+#include <cstdlib>
+#include <new>
+#include <ostream>
+#include <sys/types.h>
+
+/* objects per slab */
+#define POOL_SLAB 64
+
+/* the occupancy of one pool */
+struct PoolStats {
+  const char *name;
+  size_t size;
+  /* objects in all slabs, and the ones handed out */
+  unsigned long capacity;
+  unsigned long inuse;
+  PoolStats *next;
+};
+
+/* the pools that have allocated a slab, newest first */
+extern PoolStats *pools;
+
+/* writes one line per pool */
+void pool_report(std::ostream &out);
+
+/* fixed-size objects of type T, carved from slabs of POOL_SLAB. Freed
+ * objects go on a free list and are handed out again first, so once the
+ * pools have grown to the busiest moment nothing is allocated any more and
+ * the heap doesn't fragment under connection churn. Slabs are never given
+ * back. Like the rest of nethogs, not thread-safe. */
+template <class T> class Pool {
+public:
+  static void *alloc(const char *name) {
+    if (freelist == NULL)
+      grow(name);
+    Free *object = freelist;
+    freelist = object->next;
+    stats.inuse++;
+    return object;
+  }
+
+  static void release(void *p) {
+    if (p == NULL)
+      return;
+    Free *object = (Free *)p;
+    object->next = freelist;
+    freelist = object;
+    stats.inuse--;
+  }
+
+private:
+  union Free {
+    Free *next;
+    u_int64_t align;
+    char object[sizeof(T)];
+  };
+
+  static void grow(const char *name) {
+    Free *slab = (Free *)malloc(POOL_SLAB * sizeof(Free));
+    if (slab == NULL)
+      throw std::bad_alloc();
+    for (int i = POOL_SLAB - 1; i >= 0; i--) {
+      slab[i].next = freelist;
+      freelist = &slab[i];
+    }
+    if (stats.capacity == 0) {
+      stats.name = name;
+      stats.size = sizeof(Free);
+      stats.next = pools;
+      pools = &stats;
+    }
+    stats.capacity += POOL_SLAB;
+  }
+
+  static Free *freelist;
+  static PoolStats stats;
+};
+
+template <class T> typename Pool<T>::Free *Pool<T>::freelist = NULL;
+template <class T> PoolStats Pool<T>::stats;
+
+/* makes 'new' and 'delete' of class T use its pool */
+#define POOLED(T)                                                              \
+  static void *operator new(size_t size) {                                     \
+    assert(size == sizeof(T));                                                 \
+    (void)size;                                                                \
+    return Pool<T>::alloc(#T);                                                 \
+  }                                                                            \
+  static void operator delete(void *p) { Pool<T>::release(p); }
+
+#endif
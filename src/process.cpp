@@ -34,13 +34,17 @@
 #include <stdlib.h>
 #include <pwd.h>
 #include <map>
+#include <algorithm>
+#include <cmath>
+#include <vector>
 
 #include "process.h"
 #include "nethogs.h"
 #include "inode2prog.h"
+#include "sockdiag.h"
 #include "conninode.h"
 
-extern timeval curtime;
+extern u_int64_t curtime;
 extern bool catchall;
 /*
  * connection-inode table. takes information from /proc/net/tcp.
@@ -65,10 +69,56 @@ Process *unknownudp;
 Process *unknownip;
 ProcList *processes;
 
+/* the tuples of the connections closed in the last CLOSEDKEEP seconds, by
+ * hash string, and when they were */
+static std::map<std::string, u_int64_t> closedtuples;
+
+static void rememberClosed(Connection *connection) {
+  if (closedtuples.size() >= CLOSEDTUPLES) {
+    std::map<std::string, u_int64_t>::iterator it = closedtuples.begin();
+    while (it != closedtuples.end()) {
+      if (it->second + CLOSEDKEEP * NSEC_PER_SEC <= curtime)
+        closedtuples.erase(it++);
+      else
+        ++it;
+    }
+    if (closedtuples.size() >= CLOSEDTUPLES)
+      closedtuples.clear();
+  }
+  closedtuples[connection->refpacket->gethashstring()] = curtime;
+}
+
+static bool recentlyClosed(Connection *connection) {
+  std::map<std::string, u_int64_t>::iterator it =
+      closedtuples.find(connection->refpacket->gethashstring());
+  if (it == closedtuples.end())
+    return false;
+  if (it->second + CLOSEDKEEP * NSEC_PER_SEC > curtime)
+    return true;
+  closedtuples.erase(it);
+  return false;
+}
+
 float tomb(u_int64_t bytes) { return ((double)bytes) / 1024 / 1024; }
 float tokb(u_int64_t bytes) { return ((double)bytes) / 1024; }
 
-float tokbps(u_int64_t bytes) { return (((double)bytes) / PERIOD) / 1024; }
+/* PackList::sumanddel keeps the whole buckets after 't - PERIOD', so the
+ * bytes it sums up were sent in the last PERIOD minus one bucket, plus the
+ * part of the current bucket that has passed */
+float tokbps(u_int64_t bytes, u_int64_t t) {
+  u_int64_t window = PERIOD * NSEC_PER_SEC - BUCKET_NSEC + t % BUCKET_NSEC;
+  return (((double)bytes) * NSEC_PER_SEC / window) / 1024;
+}
+
+/* with sampling, the bytes of a connection are an estimate with the
+ * variance of Connection::account. The 'bytes' of the last PERIOD are taken
+ * to have their share of it: the rate may have changed in between */
+static double samplevariance(u_int64_t bytes, u_int64_t total,
+                             double variance) {
+  if (variance == 0 || total == 0)
+    return 0;
+  return variance * bytes / total;
+}
 
 void process_init() {
   unknowntcp = new Process(0, "", "unknown TCP");
@@ -83,8 +133,8 @@ void process_init() {
   }
 }
 
-int Process::getLastPacket() {
-  int lastpacket = 0;
+u_int64_t Process::getLastPacket() {
+  u_int64_t lastpacket = closed_lastpacket;
   ConnList *curconn = connections;
   while (curconn != NULL) {
     assert(curconn != NULL);
@@ -96,20 +146,29 @@ int Process::getLastPacket() {
   return lastpacket;
 }
 
-/** Get the kb/s values for this process */
+/** Get the kb/s values for this process, and note its peaks */
 void Process::getkbps(float *recvd, float *sent) {
   u_int64_t sum_sent = 0, sum_recv = 0;
 
+  sent_variance = 0;
+  rcvd_variance = 0;
+  memset(sent_peak, 0, sizeof(sent_peak));
+  memset(rcvd_peak, 0, sizeof(rcvd_peak));
+
   /* walk though all this process's connections, and sum
    * them up */
   ConnList *curconn = this->connections;
   ConnList *previous = NULL;
   while (curconn != NULL) {
-    if (curconn->getVal()->getLastPacket() <= curtime.tv_sec - CONNTIMEOUT) {
+    bool const closed = curconn->getVal()->isClosed(curtime);
+    if (curconn->getVal()->getLastPacket() + CONNTIMEOUT * NSEC_PER_SEC <=
+            curtime ||
+        closed) {
+      if (closed)
+        rememberClosed(curconn->getVal());
       /* capture sent and received totals before deleting */
-      this->sent_by_closed_bytes += curconn->getVal()->sumSent;
-      this->rcvd_by_closed_bytes += curconn->getVal()->sumRecv;
-      /* stalled connection, remove. */
+      addclosed(curconn->getVal());
+      /* stalled or closed connection, remove. */
       ConnList *todelete = curconn;
       Connection *conn_todelete = curconn->getVal();
       curconn = curconn->getNext();
@@ -121,15 +180,108 @@ void Process::getkbps(float *recvd, float *sent) {
       delete (conn_todelete);
     } else {
       u_int64_t sent = 0, recv = 0;
-      curconn->getVal()->sumanddel(curtime, &recv, &sent);
+      u_int64_t peak_sent[PEAK_WINDOWS], peak_recv[PEAK_WINDOWS];
+      Connection *conn = curconn->getVal();
+      conn->sumanddel(curtime, &recv, &sent);
+      conn->takepeaks(peak_recv, peak_sent);
       sum_sent += sent;
       sum_recv += recv;
+      u_int64_t const total = conn->sumSent + conn->sumRecv;
+      sent_variance += samplevariance(sent, total, conn->sampledVariance);
+      rcvd_variance += samplevariance(recv, total, conn->sampledVariance);
+      for (int i = 0; i < PEAK_WINDOWS; i++) {
+        sent_peak[i] = std::max(sent_peak[i], peak_sent[i]);
+        rcvd_peak[i] = std::max(rcvd_peak[i], peak_recv[i]);
+      }
       previous = curconn;
       curconn = curconn->getNext();
     }
   }
-  *recvd = tokbps(sum_recv);
-  *sent = tokbps(sum_sent);
+  u_int64_t closed_sent = closed_sent_packets.sumanddel(curtime);
+  u_int64_t closed_recv = closed_recv_packets.sumanddel(curtime);
+  sum_sent += closed_sent;
+  sum_recv += closed_recv;
+  u_int64_t const closed_total = sent_by_closed_bytes + rcvd_by_closed_bytes;
+  sent_variance += samplevariance(closed_sent, closed_total, closed_variance);
+  rcvd_variance += samplevariance(closed_recv, closed_total, closed_variance);
+  *recvd = tokbps(sum_recv, curtime);
+  *sent = tokbps(sum_sent, curtime);
+}
+
+void Process::addclosed(Connection *conn) {
+  u_int64_t peak_sent[PEAK_WINDOWS], peak_recv[PEAK_WINDOWS];
+
+  sent_by_closed_bytes += conn->sumSent;
+  rcvd_by_closed_bytes += conn->sumRecv;
+  sent_by_closed_packets += conn->pktsSent;
+  rcvd_by_closed_packets += conn->pktsRecv;
+  closed_variance += conn->sampledVariance;
+  closed_sizes.merge(conn->sizes);
+  if (conn->gaps != NULL)
+    closed_gaps.merge(*conn->gaps);
+  if (conn->tcp != NULL)
+    conn->tcp->addto(&closed_tcp);
+  /* a connection closed by FIN or RST still counts for the rate and the
+   * peaks, and keeps the process alive */
+  conn->mergepackets(&closed_recv_packets, &closed_sent_packets);
+  conn->takepeaks(peak_recv, peak_sent);
+  for (int i = 0; i < PEAK_WINDOWS; i++) {
+    sent_peak[i] = std::max(sent_peak[i], peak_sent[i]);
+    rcvd_peak[i] = std::max(rcvd_peak[i], peak_recv[i]);
+  }
+  closed_lastpacket = std::max(closed_lastpacket, conn->getLastPacket());
+}
+
+/** Get the peaks noted by the last getkbps as kb/s */
+void Process::getpeakkbps(int window, float *recvd, float *sent) {
+  double width = (double)PeakCounter::width[window] / NSEC_PER_SEC;
+  *recvd = rcvd_peak[window] / width / 1024;
+  *sent = sent_peak[window] / width / 1024;
+}
+
+/* 1.96 standard deviations cover 95% of a normal distribution */
+void Process::geterrorkbps(float *recvd, float *sent) {
+  *recvd = tokbps(1.96 * sqrt(rcvd_variance), curtime);
+  *sent = tokbps(1.96 * sqrt(sent_variance), curtime);
+}
+
+void Process::getpps(float *recvd, float *sent) {
+  u_int64_t sum_sent = sent_by_closed_packets, sum_recv = rcvd_by_closed_packets;
+  for (ConnList *curconn = connections; curconn != NULL;
+       curconn = curconn->getNext()) {
+    sum_sent += curconn->getVal()->pktsSent;
+    sum_recv += curconn->getVal()->pktsRecv;
+  }
+
+  if (pps_time == 0 || curtime <= pps_time) {
+    *recvd = *sent = 0;
+  } else {
+    double elapsed = (double)(curtime - pps_time) / NSEC_PER_SEC;
+    *recvd = (sum_recv - pps_recv) / elapsed;
+    *sent = (sum_sent - pps_sent) / elapsed;
+  }
+  pps_time = curtime;
+  pps_sent = sum_sent;
+  pps_recv = sum_recv;
+}
+
+void Process::gethistograms(LogHistogram *sizes, LogHistogram *gaps) {
+  *sizes = closed_sizes;
+  *gaps = closed_gaps;
+  for (ConnList *curconn = connections; curconn != NULL;
+       curconn = curconn->getNext()) {
+    sizes->merge(curconn->getVal()->sizes);
+    if (curconn->getVal()->gaps != NULL)
+      gaps->merge(*curconn->getVal()->gaps);
+  }
+}
+
+void Process::gettcpstats(TcpStats *stats) {
+  *stats = closed_tcp;
+  for (ConnList *curconn = connections; curconn != NULL;
+       curconn = curconn->getNext())
+    if (curconn->getVal()->tcp != NULL)
+      curconn->getVal()->tcp->addto(stats);
 }
 
 /** get total values for this process */
@@ -270,6 +422,155 @@ Process *getProcess(unsigned long inode, const char *devicename) {
   return newproc;
 }
 
+/* the processes holding the TCP connections that have none, by device and
+ * local port */
+typedef std::pair<std::string, unsigned short> UnknownKey;
+static std::map<UnknownKey, Process *> unknownbuckets;
+static u_int64_t last_retry = 0;
+
+static unsigned short localPort(Packet *packet) {
+  return packet->Outgoing() ? packet->sport : packet->dport;
+}
+
+/* the bucket of a connection without a process. A port scan or a routed
+ * host would otherwise make a process per connection */
+static Process *unknownBucket(Connection *connection, const char *devicename) {
+  unsigned short port = localPort(connection->refpacket);
+  UnknownKey key(devicename, port);
+  std::map<UnknownKey, Process *>::iterator it = unknownbuckets.find(key);
+  if (it != unknownbuckets.end())
+    return it->second;
+
+  if (unknownbuckets.size() >= UNKNOWN_BUCKETS)
+    return unknowntcp;
+
+  char name[32];
+  snprintf(name, sizeof(name), "unknown TCP :%d", port);
+  Process *proc = new Process(0, devicename, name);
+  processes = new ProcList(proc, processes);
+  unknownbuckets[key] = proc;
+  return proc;
+}
+
+void forgetProcess(Process *proc) {
+  for (std::map<UnknownKey, Process *>::iterator it = unknownbuckets.begin();
+       it != unknownbuckets.end(); ++it) {
+    if (it->second == proc) {
+      unknownbuckets.erase(it);
+      return;
+    }
+  }
+}
+
+Process *attachProcess(Connection *connection, unsigned long inode,
+                       const char *devicename) {
+  Process *proc = NULL;
+  if (inode != 0)
+    proc = getProcess(inode, devicename);
+
+  if (proc == NULL)
+    proc = unknownBucket(connection, devicename);
+
+  proc->connections = new ConnList(connection, proc->connections);
+  return proc;
+}
+
+/* where retry_unknown stopped: in unknowntcp or the bucket of retry_key,
+ * after retry_skip connections */
+static bool retry_inbucket = false;
+static UnknownKey retry_key;
+static size_t retry_skip = 0;
+
+/* looks up the connections of 'proc' after the first 'retry_skip', at most
+ * 'budget' of them. Returns true when it got to the end */
+static bool retryConnections(Process *proc, size_t *budget, u_int64_t now) {
+  ConnList *previous = NULL;
+  ConnList *current = proc->connections;
+  for (size_t i = 0; i < retry_skip && current != NULL; i++) {
+    previous = current;
+    current = current->getNext();
+  }
+
+  while (current != NULL) {
+    if (*budget == 0)
+      return false;
+    (*budget)--;
+
+    ConnList *next = current->getNext();
+    Connection *connection = current->getVal();
+    std::map<std::string, unsigned long>::iterator it =
+        conninode.find(connection->refpacket->gethashstring());
+    unsigned long inode = it == conninode.end() ? 0 : it->second;
+
+    /* rereading the processes is what's slow, so it's done at most every
+     * UNKNOWN_RETRY seconds */
+    struct prg_node *node = inode == 0 ? NULL : findPID(inode, false);
+    if (inode != 0 && node == NULL &&
+        last_retry + UNKNOWN_RETRY * NSEC_PER_SEC <= now) {
+      last_retry = now;
+#ifndef __APPLE__
+      reread_mapping();
+#endif
+      node = findPID(inode, false);
+    }
+
+    Process *found = node == NULL ? NULL : getProcess(inode, proc->devicename);
+    if (found == NULL) {
+      previous = current;
+      retry_skip++;
+    } else {
+      /* the connection takes its bytes along */
+      if (previous)
+        previous->setNext(next);
+      else
+        proc->connections = next;
+      current->setNext(found->connections);
+      found->connections = current;
+      if (bughuntmode)
+        std::cout << "RETRY: " << connection->refpacket->gethashstring()
+                  << " found, inode " << inode << std::endl;
+    }
+    current = next;
+  }
+  return true;
+}
+
+void retry_unknown(u_int64_t now) {
+  size_t budget = UNKNOWN_BUDGET;
+  /* at most one round through the unknown processes */
+  size_t rounds = unknownbuckets.size() + 1;
+
+  for (size_t i = 0; i < rounds; i++) {
+    Process *proc = unknowntcp;
+    if (retry_inbucket) {
+      std::map<UnknownKey, Process *>::iterator it =
+          unknownbuckets.lower_bound(retry_key);
+      if (it == unknownbuckets.end()) {
+        retry_inbucket = false;
+        retry_skip = 0;
+        continue;
+      }
+      /* the bucket was timed out */
+      if (it->first != retry_key) {
+        retry_key = it->first;
+        retry_skip = 0;
+      }
+      proc = it->second;
+    }
+
+    if (!retryConnections(proc, &budget, now))
+      return;
+
+    retry_skip = 0;
+    std::map<UnknownKey, Process *>::iterator it =
+        retry_inbucket ? unknownbuckets.upper_bound(retry_key)
+                       : unknownbuckets.begin();
+    retry_inbucket = it != unknownbuckets.end();
+    if (retry_inbucket)
+      retry_key = it->first;
+  }
+}
+
 /*
  * Used when a new connection is encountered. Finds corresponding
  * process and adds the connection. If the connection  doesn't belong
@@ -280,6 +581,25 @@ Process *getProcess(unsigned long inode, const char *devicename) {
 Process *getProcess(Connection *connection, const char *devicename) {
   unsigned long inode = conninode[connection->refpacket->gethashstring()];
 
+  /* the last packets of a connection that was just closed: it was looked
+   * up when it started, and its socket may well be gone by now */
+  if (inode == 0 && recentlyClosed(connection)) {
+    if (bughuntmode)
+      std::cout << ":| closed connection "
+                << connection->refpacket->gethashstring()
+                << " not looked up again.\n";
+    return attachProcess(connection, 0, devicename);
+  }
+
+  // ask the kernel about this one socket before rereading all of them
+  diag_socket sock;
+  if (inode == 0 && sockdiag_find(connection->refpacket, &sock)) {
+    inode = sock.inode;
+    conninode[connection->refpacket->gethashstring()] = inode;
+    if (bughuntmode)
+      std::cout << ";) new connection found through sock_diag.\n";
+  }
+
   if (inode == 0) {
     // no? refresh and check conn/inode table
     if (bughuntmode) {
@@ -340,17 +660,59 @@ Process *getProcess(Connection *connection, const char *devicename) {
     std::cout << "   inode # " << inode << std::endl;
   }
 
-  Process *proc = NULL;
-  if (inode != 0)
-    proc = getProcess(inode, devicename);
+  return attachProcess(connection, inode, devicename);
+}
 
-  if (proc == NULL) {
-    proc = new Process(inode, "", connection->refpacket->gethashstring());
-    processes = new ProcList(proc, processes);
+/* connections that started with a SYN, waiting to be looked up */
+struct PendingConnection {
+  Connection *connection;
+  const char *devicename;
+  u_int64_t since;
+};
+static std::vector<PendingConnection> pending;
+static u_int64_t last_lookup = 0;
+
+void getProcessLater(Connection *connection, const char *devicename) {
+  std::map<std::string, unsigned long>::iterator it =
+      conninode.find(connection->refpacket->gethashstring());
+
+  /* a reused tuple may still be known */
+  if (it != conninode.end() && it->second != 0) {
+    attachProcess(connection, it->second, devicename);
+    return;
   }
 
-  proc->connections = new ConnList(connection, proc->connections);
-  return proc;
+  PendingConnection p = {connection, devicename, curtime};
+  pending.push_back(p);
+}
+
+void lookup_pending(u_int64_t now) {
+  if (pending.empty() ||
+      last_lookup + LOOKUP_MSEC * conninodeevery * NSEC_PER_MSEC > now)
+    return;
+  last_lookup = now;
+
+#ifndef __APPLE__
+  reread_mapping();
+#endif
+  refreshconninode();
+
+  size_t kept = 0;
+  for (size_t i = 0; i < pending.size(); i++) {
+    PendingConnection &p = pending[i];
+    unsigned long inode = conninode[p.connection->refpacket->gethashstring()];
+    /* an accepted socket only shows up after the handshake */
+    if (inode == 0 && p.since + SYNWAIT * NSEC_PER_SEC > now) {
+      pending[kept++] = p;
+      continue;
+    }
+    if (bughuntmode)
+      std::cout << "SYN: " << p.connection->refpacket->gethashstring()
+                << (inode ? " found" : " not found") << " after "
+                << (now - p.since) / NSEC_PER_MSEC << " ms\n";
+    attachProcess(p.connection, inode, p.devicename);
+  }
+  pending.resize(kept);
 }
 
 void procclean() {
@@ -362,8 +724,8 @@ void remove_timed_out_processes() {
   ProcList *previousproc = NULL;
 
   for (ProcList *curproc = processes; curproc != NULL; curproc = curproc->next) {
-    if ((curproc->getVal()->getLastPacket() + PROCESSTIMEOUT <=
-         curtime.tv_sec) &&
+    if ((curproc->getVal()->getLastPacket() + PROCESSTIMEOUT * NSEC_PER_SEC <=
+         curtime) &&
         (curproc->getVal() != unknowntcp) &&
         (curproc->getVal() != unknownudp) && (curproc->getVal() != unknownip)) {
       if (DEBUG)
@@ -378,6 +740,7 @@ void remove_timed_out_processes() {
         curproc = processes;
       }
       delete todelete;
+      forgetProcess(p_todelete);
       delete p_todelete;
     }
     previousproc = curproc;
@@ -34,6 +34,8 @@ void check_all_procs();
 
 class ConnList {
 public:
+  POOLED(ConnList)
+
   ConnList(Connection *m_val, ConnList *m_next) {
     assert(m_val != NULL);
     val = m_val;
@@ -54,6 +56,8 @@ private:
 
 class Process {
 public:
+  POOLED(Process)
+
   /* the process makes a copy of the name. the device name needs to be stable.
    */
   Process(const unsigned long m_inode, const char *m_devicename,
@@ -80,6 +84,18 @@ public:
     uid = 0;
     sent_by_closed_bytes = 0;
     rcvd_by_closed_bytes = 0;
+    memset(sent_peak, 0, sizeof(sent_peak));
+    memset(rcvd_peak, 0, sizeof(rcvd_peak));
+    memset(&closed_tcp, 0, sizeof(closed_tcp));
+    closed_lastpacket = 0;
+    closed_variance = 0;
+    sent_variance = 0;
+    rcvd_variance = 0;
+    sent_by_closed_packets = 0;
+    rcvd_by_closed_packets = 0;
+    pps_time = 0;
+    pps_sent = 0;
+    pps_recv = 0;
   }
   void check() { assert(pid >= 0); }
 
@@ -89,10 +105,22 @@ public:
     if (DEBUG)
       std::cout << "PROC: Process deleted at " << this << std::endl;
   }
-  int getLastPacket();
+  u_int64_t getLastPacket();
 
   void gettotal(u_int64_t *recvd, u_int64_t *sent);
   void getkbps(float *recvd, float *sent);
+  void getpeakkbps(int window, float *recvd, float *sent);
+  /* when sampling, the kb/s by which the last getkbps may be off either
+   * way, at 95% confidence */
+  void geterrorkbps(float *recvd, float *sent);
+  /* packets per second since the previous call */
+  void getpps(float *recvd, float *sent);
+  /* merges the histograms of all connections, past and present */
+  void gethistograms(LogHistogram *sizes, LogHistogram *gaps);
+  /* sums up the TCP health of all connections, past and present */
+  void gettcpstats(TcpStats *stats);
+  /* keeps the totals of a connection that's about to be deleted */
+  void addclosed(Connection *conn);
   void gettotalmb(float *recvd, float *sent);
   void gettotalkb(float *recvd, float *sent);
   void gettotalb(float *recvd, float *sent);
@@ -103,6 +131,21 @@ public:
   int pid;
   u_int64_t sent_by_closed_bytes;
   u_int64_t rcvd_by_closed_bytes;
+  /* the biggest burst of any one connection in the interval up to the last
+   * getkbps, in bytes per PeakCounter window */
+  u_int64_t sent_peak[PEAK_WINDOWS];
+  u_int64_t rcvd_peak[PEAK_WINDOWS];
+  u_int64_t sent_by_closed_packets;
+  u_int64_t rcvd_by_closed_packets;
+  LogHistogram closed_sizes;
+  LogHistogram closed_gaps;
+  TcpStats closed_tcp;
+  /* the recent bytes of closed connections, and their last packet */
+  PackList closed_sent_packets;
+  PackList closed_recv_packets;
+  u_int64_t closed_lastpacket;
+  /* the sampling variance of the closed connections' bytes */
+  double closed_variance;
 
   ConnList *connections;
   uid_t getUid() { return uid; }
@@ -114,10 +157,19 @@ public:
 private:
   const unsigned long inode;
   uid_t uid;
+  /* the variance of the bytes summed up by the last getkbps */
+  double sent_variance;
+  double rcvd_variance;
+  /* the time and packet totals of the last getpps */
+  u_int64_t pps_time;
+  u_int64_t pps_sent;
+  u_int64_t pps_recv;
 };
 
 class ProcList {
 public:
+  POOLED(ProcList)
+
   ProcList(Process *m_val, ProcList *m_next) {
     assert(m_val != NULL);
     val = m_val;
@@ -134,9 +186,30 @@ private:
 
 Process *getProcess(Connection *connection, const char *devicename = NULL);
 
+/* adds the connection to the process owning 'inode', or to the unknown
+ * process of its device and local port when there is none */
+Process *attachProcess(Connection *connection, unsigned long inode,
+                       const char *devicename);
+/* looks up the next UNKNOWN_BUDGET connections of the unknown TCP processes
+ * in the connection-to-inode table, which should have just been refreshed,
+ * and moves the ones found to their process */
+void retry_unknown(u_int64_t now);
+/* to be called before deleting a process */
+void forgetProcess(Process *proc);
+
+/* like getProcess, for a connection that starts with a SYN: its socket may
+ * not be in the tables yet, so it's looked up by lookup_pending */
+void getProcessLater(Connection *connection, const char *devicename);
+/* looks up the connections passed to getProcessLater in one go, at most
+ * every LOOKUP_MSEC times conninodeevery */
+void lookup_pending(u_int64_t now);
+
 void process_init();
 
 void refreshconninode();
+/* the refreshes reread the socket tables only once in this many, see the
+ * CPU governor */
+extern unsigned int conninodeevery;
 
 void procclean();
 
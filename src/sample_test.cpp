@@ -0,0 +1,239 @@
+/*
+ * sample_test.cpp
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ *USA.
+ *
+ */
+
+#include "nethogs.cpp"
+
+#include <vector>
+
+/* the frame the filters are run on: Ethernet, with the "random" word the
+ * pick loads at RANDOM_AT */
+#define FRAME_LEN 64
+#define RANDOM_AT 60
+
+static void frame(u_char *buffer, u_int16_t ethertype, u_int32_t random) {
+  memset(buffer, 0, FRAME_LEN);
+  buffer[12] = ethertype >> 8;
+  buffer[13] = ethertype & 0xff;
+  buffer[RANDOM_AT] = random >> 24;
+  buffer[RANDOM_AT + 1] = (random >> 16) & 0xff;
+  buffer[RANDOM_AT + 2] = (random >> 8) & 0xff;
+  buffer[RANDOM_AT + 3] = random & 0xff;
+}
+
+/* the kernel filter of dp_setsample, after a filter for IPv4. The random
+ * number of the kernel is read from the frame instead */
+static int kernel_filter() {
+  struct bpf_insn ipv4[] = {
+      BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 12),
+      BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x0800, 0, 1),
+      BPF_STMT(BPF_RET | BPF_K, 262144),
+      BPF_STMT(BPF_RET | BPF_K, 0),
+  };
+  struct bpf_program filter = {sizeof(ipv4) / sizeof(ipv4[0]), ipv4};
+  u_int32_t const threshold = 0xffffffffU / 4;
+  struct bpf_program sampled;
+  dp_sample_program(&filter, DLT_EN10MB, threshold, &sampled);
+
+  struct bpf_insn *pick = sampled.bf_insns + filter.bf_len;
+  if (sampled.bf_len != filter.bf_len + 4 ||
+      pick->code != (BPF_LD | BPF_W | BPF_ABS)) {
+    std::cerr << "The sampling filter doesn't end in the random pick"
+              << std::endl;
+    free(sampled.bf_insns);
+    return 1;
+  }
+  pick->k = RANDOM_AT;
+
+  static const struct {
+    u_int16_t ethertype;
+    u_int32_t random;
+    u_int32_t expected;
+  } cases[] = {
+      {0x0800, 0, 262144},
+      {0x0800, threshold - 1, 262144},
+      {0x0800, threshold, 0},
+      {0x0800, 0xffffffffU, 0},
+      {0x0806, 0, 0},
+  };
+  u_char buffer[FRAME_LEN];
+  int failed = 0;
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    frame(buffer, cases[i].ethertype, cases[i].random);
+    u_int const snaplen =
+        bpf_filter(sampled.bf_insns, buffer, FRAME_LEN, FRAME_LEN);
+    if (snaplen != cases[i].expected) {
+      std::cerr << "The sampling filter returns " << snaplen
+                << " for ethertype " << std::hex << cases[i].ethertype
+                << " and random number " << cases[i].random << std::dec
+                << " instead of " << cases[i].expected << std::endl;
+      failed = 2;
+    }
+  }
+  free(sampled.bf_insns);
+  return failed;
+}
+
+static void count(u_char *userdata, const dp_batch *batch) {
+  *(int *)userdata += batch->count;
+}
+
+/* the sampling in userspace, on a savefile of TCP packets: about 1 in rate
+ * should be left */
+static int userland_sample() {
+  int const packets = 20000, rate = 10;
+  char name[] = "/tmp/sample_testXXXXXX";
+  int fd = mkstemp(name);
+  if (fd == -1)
+    return 3;
+  FILE *f = fdopen(fd, "wb");
+  u_int32_t global[6] = {0xa1b2c3d4, 0x00040002, 0, 0, 65535, DLT_EN10MB};
+  fwrite(global, sizeof(global), 1, f);
+  u_char tcp[14 + 20 + 20];
+  memset(tcp, 0, sizeof(tcp));
+  tcp[12] = 0x08;
+  tcp[14] = 0x45;
+  tcp[17] = 40;
+  tcp[22] = 64;
+  tcp[23] = IPPROTO_TCP;
+  tcp[26] = tcp[30] = 10;
+  tcp[33] = 1;
+  tcp[35] = 80;
+  tcp[46] = 0x50;
+  for (int i = 0; i < packets; i++) {
+    u_int32_t record[4] = {1, (u_int32_t)i, sizeof(tcp), sizeof(tcp)};
+    fwrite(record, sizeof(record), 1, f);
+    fwrite(tcp, sizeof(tcp), 1, f);
+  }
+  fclose(f);
+
+  char errbuf[DP_ERRBUF_SIZE];
+  dp_handle *handle = dp_open_offline(name, errbuf);
+  unlink(name);
+  if (handle == NULL) {
+    std::cerr << "Failed to open the savefile: " << errbuf << std::endl;
+    return 3;
+  }
+  int kept = 0;
+  dp_setbatch(handle, count);
+  if (dp_setsample(handle, rate)) {
+    std::cerr << "A savefile is sampled by the kernel" << std::endl;
+    dp_close(handle);
+    return 4;
+  }
+  dp_dispatch(handle, -1, (u_char *)&kept, sizeof(kept));
+  dp_close(handle);
+
+  /* the standard deviation is 42 packets */
+  if (kept < packets / rate * 8 / 10 || kept > packets / rate * 12 / 10) {
+    std::cerr << "Sampling 1 in " << rate << " of " << packets
+              << " packets kept " << kept << std::endl;
+    return 5;
+  }
+  return 0;
+}
+
+/* the error of the rates of a process with packets of 1000 bytes, captured
+ * while 1 in 'rate' were */
+static float sent_error(unsigned int rate) {
+  in_addr local, remote;
+  local.s_addr = htonl(0x0a000001);
+  remote.s_addr = htonl(0x0a000002);
+
+  Process process(0, "", "sample_test");
+  for (int i = 0; i < 100; i++) {
+    curtime = (u_int64_t)(i + 1) * NSEC_PER_MSEC;
+    Packet packet(local, 1111, remote, 80, 1000, curtime, dir_outgoing);
+    packet.sample = rate;
+    if (process.connections == NULL)
+      process.connections = new ConnList(new Connection(&packet), NULL);
+    else
+      process.connections->getVal()->add(&packet);
+  }
+  float recv, sent, recv_error, error;
+  process.getkbps(&recv, &sent);
+  process.geterrorkbps(&recv_error, &error);
+  delete process.connections->getVal();
+  delete process.connections;
+  return error;
+}
+
+static int kbs_error() {
+  float const unsampled = sent_error(1), sampled = sent_error(4);
+  if (unsampled != 0) {
+    std::cerr << "Without sampling the rate is off by " << unsampled
+              << " kB/s" << std::endl;
+    return 6;
+  }
+  if (!(sampled > 0)) {
+    std::cerr << "Sampling 1 in 4 has no error" << std::endl;
+    return 7;
+  }
+  return 0;
+}
+
+/* a big packet at the highest rate the governor can reach stands for more
+ * than 4 GB, which has to add up without wrapping around */
+static int scaled_bytes() {
+  in_addr local, remote;
+  local.s_addr = htonl(0x0a000001);
+  remote.s_addr = htonl(0x0a000002);
+  u_int32_t const rate = MAX_SAMPLERATE * 64, len = 65535;
+
+  curtime = NSEC_PER_SEC;
+  Packet packet(local, 1111, remote, 80, len, curtime, dir_outgoing);
+  packet.sample = rate;
+  Connection *connection = new Connection(&packet);
+  u_int64_t recv, sent, recv_peaks[PEAK_WINDOWS], sent_peaks[PEAK_WINDOWS];
+  connection->sumanddel(curtime, &recv, &sent);
+  connection->takepeaks(recv_peaks, sent_peaks);
+  u_int64_t const total = connection->sumSent;
+  delete connection;
+
+  /* the bucket of the last period saturates */
+  if (total != (u_int64_t)len * rate || sent != UINT32_MAX ||
+      sent_peaks[0] != total) {
+    std::cerr << "A packet of " << len << " bytes sampled 1 in " << rate
+              << " counts " << total << " bytes, " << sent
+              << " in the last period and a peak of " << sent_peaks[0]
+              << std::endl;
+    return 8;
+  }
+  return 0;
+}
+
+int main() {
+  int failed = kernel_filter();
+  if (failed)
+    return failed;
+
+  failed = userland_sample();
+  if (failed)
+    return failed;
+
+  failed = kbs_error();
+  if (failed)
+    return failed;
+
+  failed = scaled_bytes();
+  if (failed)
+    return failed;
+
+  return 0;
+}
@@ -0,0 +1,457 @@
+/*
+ * sockdiag.cpp
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ *USA.
+ *
+ */
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "nethogs.h"
+#include "sockdiag.h"
+#include "packet.h"
+#include "connection.h"
+#include "process.h"
+#include "inode2prog.h"
+
+#ifdef __linux__
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/sock_diag.h>
+#include <linux/inet_diag.h>
+
+/* the start of the kernel's struct tcp_info, up to the byte counters added
+ * in 4.1. <linux/tcp.h> can't be included next to <netinet/tcp.h>, and the
+ * libc version of the struct stops before the counters */
+struct diag_tcp_info {
+  u_int8_t state, ca_state, retransmits, probes, backoff, options, wscale,
+      flags;
+  u_int32_t rto, ato, snd_mss, rcv_mss;
+  u_int32_t unacked, sacked, lost, retrans, fackets;
+  u_int32_t last_data_sent, last_ack_sent, last_data_recv, last_ack_recv;
+  u_int32_t pmtu, rcv_ssthresh, rtt, rttvar, snd_ssthresh, snd_cwnd, advmss,
+      reordering;
+  u_int32_t rcv_rtt, rcv_space;
+  u_int32_t total_retrans;
+  u_int64_t pacing_rate, max_pacing_rate;
+  u_int64_t bytes_acked, bytes_received;
+};
+
+/* TCP states worth dumping: everything but LISTEN, TIME_WAIT and CLOSE */
+#define DIAG_STATES (0xfff & ~((1 << 10) | (1 << 6) | (1 << 7)))
+
+/* fills in a diag_socket from the id, turning IPv4-mapped addresses into
+ * IPv4 ones like refreshconninode does */
+static void diag_fill(diag_socket *sock, const inet_diag_msg *msg) {
+  const inet_diag_sockid *id = &msg->id;
+
+  memset(sock, 0, sizeof(diag_socket));
+  sock->lport = ntohs(id->idiag_sport);
+  sock->rport = ntohs(id->idiag_dport);
+  sock->inode = msg->idiag_inode;
+  sock->cookie = id->idiag_cookie[0] | (u_int64_t)id->idiag_cookie[1] << 32;
+  sock->uid = msg->idiag_uid;
+
+  if (msg->idiag_family == AF_INET) {
+    sock->family = AF_INET;
+    memcpy(&sock->local4, id->idiag_src, sizeof(in_addr));
+    memcpy(&sock->remote4, id->idiag_dst, sizeof(in_addr));
+  } else if (IN6_IS_ADDR_V4MAPPED((const in6_addr *)id->idiag_src)) {
+    sock->family = AF_INET;
+    memcpy(&sock->local4, &id->idiag_src[3], sizeof(in_addr));
+    memcpy(&sock->remote4, &id->idiag_dst[3], sizeof(in_addr));
+  } else {
+    sock->family = AF_INET6;
+    memcpy(&sock->local6, id->idiag_src, sizeof(in6_addr));
+    memcpy(&sock->remote6, id->idiag_dst, sizeof(in6_addr));
+  }
+}
+
+/* reads the byte counters from the INET_DIAG_INFO attribute, if any */
+static void diag_bytes(diag_socket *sock, const nlmsghdr *nlh) {
+  const inet_diag_msg *msg = (const inet_diag_msg *)NLMSG_DATA(nlh);
+  int len = nlh->nlmsg_len - NLMSG_LENGTH(sizeof(*msg));
+  const rtattr *attr = (const rtattr *)(msg + 1);
+
+  for (; RTA_OK(attr, len); attr = RTA_NEXT(attr, len)) {
+    if (attr->rta_type != INET_DIAG_INFO ||
+        RTA_PAYLOAD(attr) < sizeof(diag_tcp_info))
+      continue;
+    diag_tcp_info info;
+    memcpy(&info, RTA_DATA(attr), sizeof(info));
+    sock->has_bytes = true;
+    sock->bytes_acked = info.bytes_acked;
+    sock->bytes_received = info.bytes_received;
+  }
+}
+
+/* the netlink socket all queries go through. It's opened on first use and
+ * kept, a lookup on the packet path shouldn't cost a socket() and close() */
+static int diag_fd = -1;
+
+/* sends one inet_diag request and passes the sockets in the reply to 'cb'.
+ * A dump is read up to NLMSG_DONE, anything else is a single reply */
+static bool diag_query(inet_diag_req_v2 *req, u_int16_t flags,
+                       diag_callback cb, void *arg) {
+  if (diag_fd < 0)
+    diag_fd =
+        socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_SOCK_DIAG);
+  if (diag_fd < 0)
+    return false;
+
+  struct {
+    nlmsghdr nlh;
+    inet_diag_req_v2 req;
+  } request;
+  memset(&request, 0, sizeof(request));
+  request.nlh.nlmsg_len = sizeof(request);
+  request.nlh.nlmsg_type = SOCK_DIAG_BY_FAMILY;
+  request.nlh.nlmsg_flags = flags;
+  request.req = *req;
+
+  sockaddr_nl kernel;
+  memset(&kernel, 0, sizeof(kernel));
+  kernel.nl_family = AF_NETLINK;
+  if (sendto(diag_fd, &request, sizeof(request), 0, (sockaddr *)&kernel,
+             sizeof(kernel)) < 0) {
+    close(diag_fd);
+    diag_fd = -1;
+    return false;
+  }
+
+  bool ok = true;
+  bool done = false;
+  long buffer[8192];
+  while (!done) {
+    ssize_t len = recv(diag_fd, buffer, sizeof(buffer), 0);
+    if (len < 0) {
+      /* the rest of the reply would be in the way of the next one, start
+       * over with a new socket */
+      close(diag_fd);
+      diag_fd = -1;
+      return false;
+    }
+    done = !(flags & NLM_F_DUMP);
+    for (const nlmsghdr *nlh = (const nlmsghdr *)buffer; NLMSG_OK(nlh, len);
+         nlh = NLMSG_NEXT(nlh, len)) {
+      if (nlh->nlmsg_type == NLMSG_DONE) {
+        done = true;
+        break;
+      }
+      if (nlh->nlmsg_type == NLMSG_ERROR) {
+        ok = false;
+        done = true;
+        break;
+      }
+      if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(inet_diag_msg)))
+        continue;
+
+      diag_socket sock;
+      diag_fill(&sock, (const inet_diag_msg *)NLMSG_DATA(nlh));
+      if (req->idiag_ext & (1 << (INET_DIAG_INFO - 1)))
+        diag_bytes(&sock, nlh);
+      cb(&sock, arg);
+    }
+  }
+  return ok;
+}
+
+bool sockdiag_dump(int family, bool bytes, diag_callback cb, void *arg) {
+  inet_diag_req_v2 req;
+  memset(&req, 0, sizeof(req));
+  req.sdiag_family = family;
+  req.sdiag_protocol = IPPROTO_TCP;
+  req.idiag_states = DIAG_STATES;
+  if (bytes)
+    req.idiag_ext = 1 << (INET_DIAG_INFO - 1);
+  return diag_query(&req, NLM_F_REQUEST | NLM_F_DUMP, cb, arg);
+}
+
+static void diag_copy(const diag_socket *sock, void *arg) {
+  *(diag_socket *)arg = *sock;
+}
+
+/* a tuple the kernel had no socket for isn't asked about again for this
+ * long: a forwarded flow or one in TIME_WAIT would take a query for every
+ * connection made for it */
+#define DIAG_MISS_NSEC (PERIOD * NSEC_PER_SEC)
+/* the misses are swept for expired ones when there are this many, and
+ * dropped if none has */
+#define DIAG_MISS_SWEEP 4096
+
+/* the time of the last miss of each tuple, by hash string */
+static std::map<std::string, u_int64_t> diag_misses;
+
+bool sockdiag_find(Packet *packet, diag_socket *sock) {
+  std::string const key = packet->gethashstring();
+  std::map<std::string, u_int64_t>::iterator miss = diag_misses.find(key);
+  if (miss != diag_misses.end()) {
+    if (packet->time < miss->second + DIAG_MISS_NSEC)
+      return false;
+    diag_misses.erase(miss);
+  }
+
+  inet_diag_req_v2 req;
+  memset(&req, 0, sizeof(req));
+  req.sdiag_family = packet->getFamily();
+  req.sdiag_protocol = IPPROTO_TCP;
+  req.idiag_states = DIAG_STATES;
+  req.id.idiag_cookie[0] = INET_DIAG_NOCOOKIE;
+  req.id.idiag_cookie[1] = INET_DIAG_NOCOOKIE;
+
+  /* the id is seen from the socket: source is the local end */
+  bool outgoing = packet->Outgoing();
+  req.id.idiag_sport = htons(outgoing ? packet->sport : packet->dport);
+  req.id.idiag_dport = htons(outgoing ? packet->dport : packet->sport);
+  if (req.sdiag_family == AF_INET) {
+    memcpy(req.id.idiag_src, outgoing ? &packet->sip : &packet->dip,
+           sizeof(in_addr));
+    memcpy(req.id.idiag_dst, outgoing ? &packet->dip : &packet->sip,
+           sizeof(in_addr));
+  } else {
+    memcpy(req.id.idiag_src, outgoing ? &packet->sip6 : &packet->dip6,
+           sizeof(in6_addr));
+    memcpy(req.id.idiag_dst, outgoing ? &packet->dip6 : &packet->sip6,
+           sizeof(in6_addr));
+  }
+
+  sock->inode = 0;
+  /* a socket that's gone is an ENOENT error */
+  if (diag_query(&req, NLM_F_REQUEST, diag_copy, sock) && sock->inode != 0)
+    return true;
+
+  if (diag_misses.size() >= DIAG_MISS_SWEEP) {
+    for (miss = diag_misses.begin(); miss != diag_misses.end();) {
+      if (packet->time >= miss->second + DIAG_MISS_NSEC)
+        diag_misses.erase(miss++);
+      else
+        ++miss;
+    }
+    if (diag_misses.size() >= DIAG_MISS_SWEEP)
+      diag_misses.clear();
+  }
+  diag_misses[key] = packet->time;
+  return false;
+}
+
+/* the multicast groups of SKNLGRP_INET_TCP_DESTROY and
+ * SKNLGRP_INET6_TCP_DESTROY (Linux 4.9+), which report each TCP socket as
+ * it's destroyed, with its final tcp_info */
+#define DIAG_GROUP_TCP_DESTROY 1
+#define DIAG_GROUP_TCP6_DESTROY 3
+
+/* the socket subscribed to those groups, -1 if the kernel wouldn't */
+static int diag_destroy_fd = -1;
+static bool diag_destroy_tried = false;
+
+/* passes the sockets destroyed since the previous call to 'cb' */
+static void diag_destroyed(diag_callback cb, void *arg) {
+  if (!diag_destroy_tried) {
+    diag_destroy_tried = true;
+    diag_destroy_fd = socket(AF_NETLINK,
+                             SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK,
+                             NETLINK_SOCK_DIAG);
+    sockaddr_nl groups;
+    memset(&groups, 0, sizeof(groups));
+    groups.nl_family = AF_NETLINK;
+    groups.nl_groups = (1 << (DIAG_GROUP_TCP_DESTROY - 1)) |
+                       (1 << (DIAG_GROUP_TCP6_DESTROY - 1));
+    if (diag_destroy_fd >= 0 &&
+        bind(diag_destroy_fd, (sockaddr *)&groups, sizeof(groups)) < 0) {
+      close(diag_destroy_fd);
+      diag_destroy_fd = -1;
+    }
+  }
+  if (diag_destroy_fd < 0)
+    return;
+
+  long buffer[8192];
+  for (;;) {
+    ssize_t len = recv(diag_destroy_fd, buffer, sizeof(buffer), 0);
+    /* more were destroyed than fit in the socket's buffer, those are lost */
+    if (len < 0 && errno == ENOBUFS)
+      continue;
+    if (len <= 0)
+      break;
+    for (const nlmsghdr *nlh = (const nlmsghdr *)buffer; NLMSG_OK(nlh, len);
+         nlh = NLMSG_NEXT(nlh, len)) {
+      if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(inet_diag_msg)))
+        continue;
+      const inet_diag_msg *msg = (const inet_diag_msg *)NLMSG_DATA(nlh);
+      if (msg->idiag_family != AF_INET && msg->idiag_family != AF_INET6)
+        continue;
+      diag_socket sock;
+      diag_fill(&sock, msg);
+      diag_bytes(&sock, nlh);
+      cb(&sock, arg);
+    }
+  }
+}
+#else
+bool sockdiag_dump(int, bool, diag_callback, void *) { return false; }
+
+bool sockdiag_find(Packet *, diag_socket *) { return false; }
+
+static void diag_destroyed(diag_callback, void *) {}
+#endif
+
+/* the counters of a socket at the previous poll, and the connection its
+ * bytes go to (NULL until there is one) */
+struct diag_counters {
+  u_int64_t acked;
+  u_int64_t received;
+  unsigned generation;
+  Connection *conn;
+};
+
+/* by socket cookie rather than inode: a closed socket has no inode any
+ * more, but still sends what was left in its buffer */
+static std::map<u_int64_t, diag_counters> diag_last;
+/* the cookie of each connection in diag_last, for sockdiag_forget */
+static std::map<Connection *, u_int64_t> diag_cookies;
+static unsigned diag_generation = 0;
+static u_int64_t diag_last_poll = 0;
+
+/* sockets with new bytes, collected during the dump */
+struct diag_delta {
+  diag_socket sock;
+  u_int64_t sent;
+  u_int64_t recv;
+  Connection *conn;
+};
+
+static void diag_collect(const diag_socket *sock, void *arg) {
+  std::vector<diag_delta> *deltas = (std::vector<diag_delta> *)arg;
+
+  if (!sock->has_bytes)
+    return;
+
+  std::map<u_int64_t, diag_counters>::iterator it =
+      diag_last.find(sock->cookie);
+  diag_delta delta = {*sock, sock->bytes_acked, sock->bytes_received, NULL};
+  if (it != diag_last.end()) {
+    delta.sent -= std::min(delta.sent, it->second.acked);
+    delta.recv -= std::min(delta.recv, it->second.received);
+    delta.conn = it->second.conn;
+    it->second.acked = sock->bytes_acked;
+    it->second.received = sock->bytes_received;
+    it->second.generation = diag_generation;
+  } else {
+    /* a socket first seen closed can't be told whose it was */
+    if (sock->inode == 0)
+      return;
+    /* don't count what was sent before we started */
+    if (diag_last_poll == 0)
+      delta.sent = delta.recv = 0;
+    diag_counters counters = {sock->bytes_acked, sock->bytes_received,
+                              diag_generation, NULL};
+    diag_last[sock->cookie] = counters;
+  }
+
+  if (delta.sent != 0 || delta.recv != 0)
+    deltas->push_back(delta);
+}
+
+/* a packet of a socket, in the outgoing direction */
+static Packet *diag_packet(const diag_socket *sock, u_int64_t time) {
+  if (sock->family == AF_INET)
+    return new Packet(sock->local4, sock->lport, sock->remote4, sock->rport, 0,
+                      time, dir_outgoing);
+  return new Packet(sock->local6, sock->lport, sock->remote6, sock->rport, 0,
+                    time, dir_outgoing);
+}
+
+bool sockdiag_poll(u_int64_t now) {
+  std::vector<diag_delta> deltas;
+
+  diag_generation++;
+  /* the final counters of the sockets destroyed since the last poll, which
+   * the dump won't have */
+  diag_destroyed(diag_collect, &deltas);
+  if (!sockdiag_dump(AF_INET, true, diag_collect, &deltas) ||
+      !sockdiag_dump(AF_INET6, true, diag_collect, &deltas))
+    return false;
+
+  /* forget the sockets that are gone */
+  for (std::map<u_int64_t, diag_counters>::iterator it = diag_last.begin();
+       it != diag_last.end();) {
+    if (it->second.generation != diag_generation) {
+      if (it->second.conn != NULL)
+        diag_cookies.erase(it->second.conn);
+      diag_last.erase(it++);
+    } else {
+      ++it;
+    }
+  }
+
+  u_int64_t from = diag_last_poll ? diag_last_poll : now;
+  diag_last_poll = now;
+  if (deltas.empty())
+    return true;
+
+  /* whether a new socket has an inode the processes haven't been read for */
+  bool missing = false;
+  for (size_t i = 0; i < deltas.size(); i++)
+    if (deltas[i].conn == NULL && findPID(deltas[i].sock.inode, false) == NULL)
+      missing = true;
+
+  /* one rescan for all the new sockets */
+#ifndef __APPLE__
+  if (missing)
+    reread_mapping();
+#endif
+  for (size_t i = 0; i < deltas.size(); i++) {
+    const diag_socket *sock = &deltas[i].sock;
+    Connection *conn = deltas[i].conn;
+    if (conn == NULL) {
+      Packet *packet = diag_packet(sock, now);
+      conn = new Connection(packet, false);
+      delete packet;
+      /* an inode that's still unknown isn't looked for again */
+      attachProcess(conn, findPID(sock->inode, false) != NULL ? sock->inode : 0,
+                    "any");
+      diag_last[sock->cookie].conn = conn;
+      diag_cookies[conn] = sock->cookie;
+    }
+    /* the bytes are spread over the poll interval, so the rates come out
+     * smooth; sock_diag doesn't count the packets */
+    if (deltas[i].sent != 0)
+      conn->addcounts(true, deltas[i].sent, 0, from, now);
+    if (deltas[i].recv != 0)
+      conn->addcounts(false, deltas[i].recv, 0, from, now);
+  }
+  return true;
+}
+
+void sockdiag_forget(Connection *connection) {
+  std::map<Connection *, u_int64_t>::iterator it =
+      diag_cookies.find(connection);
+  if (it == diag_cookies.end())
+    return;
+  std::map<u_int64_t, diag_counters>::iterator last =
+      diag_last.find(it->second);
+  if (last != diag_last.end())
+    last->second.conn = NULL;
+  diag_cookies.erase(it);
+}
@@ -0,0 +1,72 @@
+/*
+ * sockdiag.h
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ *USA.
+ *
+ */
+
+#ifndef __SOCKDIAG_H
+#define __SOCKDIAG_H
+
+#include <netinet/in.h>
+#include <sys/types.h>
+
+/* one TCP socket as the kernel's sock_diag interface reports it. IPv4
+ * sockets, including IPv4-mapped ones on IPv6 sockets, have family AF_INET
+ * and their addresses in local4/remote4 */
+struct diag_socket {
+  int family;
+  in_addr local4;
+  in_addr remote4;
+  in6_addr local6;
+  in6_addr remote6;
+  unsigned short lport;
+  unsigned short rport;
+  /* 0 once the socket is closed, the cookie stays until it's destroyed */
+  unsigned long inode;
+  u_int64_t cookie;
+  uid_t uid;
+  /* from tcp_info, only when asked for and the kernel has them (4.1+) */
+  bool has_bytes;
+  u_int64_t bytes_acked;
+  u_int64_t bytes_received;
+};
+
+typedef void (*diag_callback)(const diag_socket *sock, void *arg);
+
+/* dumps the TCP sockets of one address family, with their byte counters
+ * when 'bytes' is set. Returns false when sock_diag isn't available */
+bool sockdiag_dump(int family, bool bytes, diag_callback cb, void *arg);
+
+class Packet;
+
+/* looks up the one TCP socket of a packet by its exact addresses and ports,
+ * without dumping the others. Returns false when there is no such socket
+ * or sock_diag isn't available */
+bool sockdiag_find(Packet *packet, diag_socket *sock);
+
+/* the capture-free backend: dumps all TCP sockets and accounts the growth
+ * of their byte counters since the previous call to their processes.
+ * Returns false when the sockets can't be dumped */
+bool sockdiag_poll(u_int64_t now);
+
+class Connection;
+
+/* forgets a connection that is being deleted, sockdiag_poll makes a new
+ * one if its socket has more bytes */
+void sockdiag_forget(Connection *connection);
+
+#endif
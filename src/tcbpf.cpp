@@ -0,0 +1,544 @@
+/*
+ * tcbpf.cpp
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ *USA.
+ *
+ */
+
+#include <iostream>
+#include <algorithm>
+#include <map>
+#include <vector>
+#include <cstddef>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+
+#include "nethogs.h"
+#include "tcbpf.h"
+#include "packet.h"
+#include "connection.h"
+#include "process.h"
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/pkt_sched.h>
+#include <linux/pkt_cls.h>
+
+extern Process *unknownudp;
+extern bool catchall;
+
+/* the map key, as the program builds it on its stack. Addresses and ports
+ * are in network order, IPv4 addresses only use the first word */
+struct flow_key {
+  u_int8_t family;
+  u_int8_t protocol;
+  u_int8_t outgoing;
+  u_int8_t pad;
+  u_int16_t sport;
+  u_int16_t dport;
+  u_int32_t ifindex;
+  u_int32_t saddr[4];
+  u_int32_t daddr[4];
+  u_int32_t pad2;
+};
+
+struct flow_value {
+  u_int64_t bytes;
+  u_int64_t packets;
+};
+
+/* flows the map can hold before the least recently used ones go */
+#define FLOW_ENTRIES 65536
+/* the tc priority of our filters, out of the way of hand-made ones */
+#define FLOW_PRIO 0xc0de
+
+/* stack layout of the program: key, value and a scratch area for headers */
+#define STACK_KEY (-48)
+#define STACK_VALUE (-64)
+#define STACK_HDR (-104)
+#define KEY(field) (STACK_KEY + (int)offsetof(flow_key, field))
+#define VALUE(field) (STACK_VALUE + (int)offsetof(flow_value, field))
+
+enum { L_IPV4, L_IPV6, L_PORTS, L_L4, L_COUNT, L_INSERT, L_OUT, N_LABELS };
+
+/* a little assembler: jumps go to labels, which are resolved at the end */
+struct bpf_asm {
+  std::vector<bpf_insn> insns;
+  std::vector<std::pair<size_t, int> > fixups;
+  size_t labels[N_LABELS];
+};
+
+static void emit(bpf_asm *a, u_int8_t code, u_int8_t dst, u_int8_t src,
+                 int16_t off, int32_t imm) {
+  bpf_insn insn;
+  memset(&insn, 0, sizeof(insn));
+  insn.code = code;
+  insn.dst_reg = dst;
+  insn.src_reg = src;
+  insn.off = off;
+  insn.imm = imm;
+  a->insns.push_back(insn);
+}
+
+static void jump(bpf_asm *a, u_int8_t op, u_int8_t dst, int32_t imm,
+                 int label) {
+  a->fixups.push_back(std::make_pair(a->insns.size(), label));
+  emit(a, BPF_JMP | op | BPF_K, dst, 0, 0, imm);
+}
+
+static void mark(bpf_asm *a, int label) { a->labels[label] = a->insns.size(); }
+
+static void ldmap(bpf_asm *a, u_int8_t dst, int fd) {
+  emit(a, BPF_LD | BPF_DW | BPF_IMM, dst, BPF_PSEUDO_MAP_FD, 0, fd);
+  emit(a, 0, 0, 0, 0, 0);
+}
+
+/* bpf_skb_load_bytes(skb, offset in 'reg' or 'offset', stack, len) */
+static void loadbytes(bpf_asm *a, int reg, int offset, int stack, int len) {
+  emit(a, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_6, 0, 0);
+  if (reg >= 0)
+    emit(a, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, reg, 0, 0);
+  else
+    emit(a, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_2, 0, 0, offset);
+  emit(a, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_3, BPF_REG_10, 0, 0);
+  emit(a, BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_3, 0, 0, stack);
+  emit(a, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_4, 0, 0, len);
+  emit(a, BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_skb_load_bytes);
+}
+
+/* copies 'size' bytes at stack offset 'from' to 'to' through r1 */
+static void copy(bpf_asm *a, u_int8_t size, int from, int to) {
+  emit(a, BPF_LDX | size | BPF_MEM, BPF_REG_1, BPF_REG_10, from, 0);
+  emit(a, BPF_STX | size | BPF_MEM, BPF_REG_10, BPF_REG_1, to, 0);
+}
+
+/* the counting program for one direction. r6 holds the skb, r8 the offset
+ * of the transport header and r9 the length of the packet */
+static std::vector<bpf_insn> flow_program(int map, bool outgoing) {
+  bpf_asm a;
+  const int key = STACK_KEY;
+  const int hdr = STACK_HDR;
+
+  emit(&a, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0);
+  for (int i = 0; i < (int)sizeof(flow_key); i += 8)
+    emit(&a, BPF_ST | BPF_DW | BPF_MEM, BPF_REG_10, 0, key + i, 0);
+  emit(&a, BPF_ST | BPF_B | BPF_MEM, BPF_REG_10, 0, KEY(outgoing), outgoing);
+  emit(&a, BPF_LDX | BPF_W | BPF_MEM, BPF_REG_1, BPF_REG_6,
+       offsetof(__sk_buff, ifindex), 0);
+  emit(&a, BPF_STX | BPF_W | BPF_MEM, BPF_REG_10, BPF_REG_1, KEY(ifindex), 0);
+  emit(&a, BPF_LDX | BPF_W | BPF_MEM, BPF_REG_7, BPF_REG_6,
+       offsetof(__sk_buff, protocol), 0);
+  jump(&a, BPF_JEQ, BPF_REG_7, htons(ETH_P_IP), L_IPV4);
+  jump(&a, BPF_JEQ, BPF_REG_7, htons(ETH_P_IPV6), L_IPV6);
+  jump(&a, BPF_JA, 0, 0, L_OUT);
+
+  mark(&a, L_IPV4);
+  loadbytes(&a, -1, ETH_HLEN, hdr, 20);
+  jump(&a, BPF_JNE, BPF_REG_0, 0, L_OUT);
+  emit(&a, BPF_ST | BPF_B | BPF_MEM, BPF_REG_10, 0, KEY(family), AF_INET);
+  copy(&a, BPF_B, hdr + 9, KEY(protocol));
+  copy(&a, BPF_W, hdr + 12, KEY(saddr));
+  copy(&a, BPF_W, hdr + 16, KEY(daddr));
+  emit(&a, BPF_LDX | BPF_B | BPF_MEM, BPF_REG_8, BPF_REG_10, hdr, 0);
+  emit(&a, BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_8, 0, 0, 0xf);
+  emit(&a, BPF_ALU64 | BPF_LSH | BPF_K, BPF_REG_8, 0, 0, 2);
+  emit(&a, BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_8, 0, 0, ETH_HLEN);
+  /* only the first fragment has ports */
+  emit(&a, BPF_LDX | BPF_H | BPF_MEM, BPF_REG_1, BPF_REG_10, hdr + 6, 0);
+  emit(&a, BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_1, 0, 0, htons(0x1fff));
+  jump(&a, BPF_JNE, BPF_REG_1, 0, L_COUNT);
+  jump(&a, BPF_JA, 0, 0, L_PORTS);
+
+  mark(&a, L_IPV6);
+  loadbytes(&a, -1, ETH_HLEN, hdr, 40);
+  jump(&a, BPF_JNE, BPF_REG_0, 0, L_OUT);
+  emit(&a, BPF_ST | BPF_B | BPF_MEM, BPF_REG_10, 0, KEY(family), AF_INET6);
+  copy(&a, BPF_B, hdr + 6, KEY(protocol));
+  for (int i = 0; i < 16; i += 4) {
+    copy(&a, BPF_W, hdr + 8 + i, KEY(saddr) + i);
+    copy(&a, BPF_W, hdr + 24 + i, KEY(daddr) + i);
+  }
+  emit(&a, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_8, 0, 0, ETH_HLEN + 40);
+
+  mark(&a, L_PORTS);
+  emit(&a, BPF_LDX | BPF_B | BPF_MEM, BPF_REG_1, BPF_REG_10, KEY(protocol), 0);
+  jump(&a, BPF_JEQ, BPF_REG_1, IPPROTO_TCP, L_L4);
+  jump(&a, BPF_JEQ, BPF_REG_1, IPPROTO_UDP, L_L4);
+  jump(&a, BPF_JA, 0, 0, L_COUNT);
+
+  mark(&a, L_L4);
+  loadbytes(&a, BPF_REG_8, 0, hdr, 4);
+  jump(&a, BPF_JNE, BPF_REG_0, 0, L_COUNT);
+  copy(&a, BPF_H, hdr, KEY(sport));
+  copy(&a, BPF_H, hdr + 2, KEY(dport));
+
+  mark(&a, L_COUNT);
+  emit(&a, BPF_LDX | BPF_W | BPF_MEM, BPF_REG_9, BPF_REG_6,
+       offsetof(__sk_buff, len), 0);
+  ldmap(&a, BPF_REG_1, map);
+  emit(&a, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0);
+  emit(&a, BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, key);
+  emit(&a, BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem);
+  jump(&a, BPF_JEQ, BPF_REG_0, 0, L_INSERT);
+  emit(&a, BPF_STX | BPF_DW | BPF_XADD, BPF_REG_0, BPF_REG_9,
+       offsetof(flow_value, bytes), 0);
+  emit(&a, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_1, 0, 0, 1);
+  emit(&a, BPF_STX | BPF_DW | BPF_XADD, BPF_REG_0, BPF_REG_1,
+       offsetof(flow_value, packets), 0);
+  jump(&a, BPF_JA, 0, 0, L_OUT);
+
+  /* a racing insert on another CPU may win, losing this packet */
+  mark(&a, L_INSERT);
+  emit(&a, BPF_STX | BPF_DW | BPF_MEM, BPF_REG_10, BPF_REG_9, VALUE(bytes), 0);
+  emit(&a, BPF_ST | BPF_DW | BPF_MEM, BPF_REG_10, 0, VALUE(packets), 1);
+  ldmap(&a, BPF_REG_1, map);
+  emit(&a, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0);
+  emit(&a, BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, key);
+  emit(&a, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_3, BPF_REG_10, 0, 0);
+  emit(&a, BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_3, 0, 0, STACK_VALUE);
+  emit(&a, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_4, 0, 0, BPF_NOEXIST);
+  emit(&a, BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_update_elem);
+
+  /* let the packet go on as if we weren't there */
+  mark(&a, L_OUT);
+  emit(&a, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, TC_ACT_UNSPEC);
+  emit(&a, BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+
+  for (size_t i = 0; i < a.fixups.size(); i++)
+    a.insns[a.fixups[i].first].off =
+        a.labels[a.fixups[i].second] - a.fixups[i].first - 1;
+  return a.insns;
+}
+
+static long sys_bpf(int cmd, bpf_attr *attr) {
+  return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+static u_int64_t ptr(const void *p) { return (u_int64_t)(unsigned long)p; }
+
+static int flow_map = -1;
+static int flow_progs[2] = {-1, -1};
+
+/* creates the map and loads the programs, once */
+static bool flow_load() {
+  if (flow_map >= 0)
+    return true;
+
+  bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.map_type = BPF_MAP_TYPE_LRU_HASH;
+  attr.key_size = sizeof(flow_key);
+  attr.value_size = sizeof(flow_value);
+  attr.max_entries = FLOW_ENTRIES;
+  flow_map = sys_bpf(BPF_MAP_CREATE, &attr);
+  if (flow_map < 0) {
+    std::cerr << "Error creating the eBPF flow map: " << strerror(errno)
+              << std::endl;
+    return false;
+  }
+
+  for (int outgoing = 0; outgoing < 2; outgoing++) {
+    std::vector<bpf_insn> insns = flow_program(flow_map, outgoing);
+    static char log[65536];
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_SCHED_CLS;
+    attr.insns = ptr(&insns[0]);
+    attr.insn_cnt = insns.size();
+    attr.license = ptr("GPL");
+    attr.log_buf = ptr(log);
+    attr.log_size = sizeof(log);
+    attr.log_level = 1;
+    flow_progs[outgoing] = sys_bpf(BPF_PROG_LOAD, &attr);
+    if (flow_progs[outgoing] < 0) {
+      std::cerr << "Error loading the eBPF flow counter: " << strerror(errno)
+                << std::endl
+                << log << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+/* a tc request: the message, its tcmsg and room for the attributes */
+struct tc_request {
+  nlmsghdr nlh;
+  tcmsg tcm;
+  char attrs[128];
+};
+
+static rtattr *addattr(nlmsghdr *nlh, int type, const void *data, int len) {
+  rtattr *rta = (rtattr *)((char *)nlh + NLMSG_ALIGN(nlh->nlmsg_len));
+  rta->rta_type = type;
+  rta->rta_len = RTA_LENGTH(len);
+  if (len != 0)
+    memcpy(RTA_DATA(rta), data, len);
+  nlh->nlmsg_len = NLMSG_ALIGN(nlh->nlmsg_len) + RTA_ALIGN(rta->rta_len);
+  return rta;
+}
+
+static void tc_init(tc_request *req, int type, int flags, int ifindex,
+                    u_int32_t parent) {
+  memset(req, 0, sizeof(*req));
+  req->nlh.nlmsg_len = NLMSG_LENGTH(sizeof(tcmsg));
+  req->nlh.nlmsg_type = type;
+  req->nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | flags;
+  req->tcm.tcm_family = AF_UNSPEC;
+  req->tcm.tcm_ifindex = ifindex;
+  req->tcm.tcm_parent = parent;
+}
+
+/* sends a request and returns the (negative) errno of the answer */
+static int tc_talk(tc_request *req) {
+  int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_ROUTE);
+  if (fd < 0)
+    return -errno;
+
+  sockaddr_nl kernel;
+  memset(&kernel, 0, sizeof(kernel));
+  kernel.nl_family = AF_NETLINK;
+  int error = 0;
+  if (sendto(fd, req, req->nlh.nlmsg_len, 0, (sockaddr *)&kernel,
+             sizeof(kernel)) < 0) {
+    error = -errno;
+  } else {
+    char buffer[4096];
+    ssize_t len = recv(fd, buffer, sizeof(buffer), 0);
+    const nlmsghdr *nlh = (const nlmsghdr *)buffer;
+    if (len < 0)
+      error = -errno;
+    else if (NLMSG_OK(nlh, len) && nlh->nlmsg_type == NLMSG_ERROR)
+      error = ((const nlmsgerr *)NLMSG_DATA(nlh))->error;
+  }
+  close(fd);
+  return error;
+}
+
+static int tc_delfilter(int ifindex, u_int32_t hook) {
+  tc_request req;
+  tc_init(&req, RTM_DELTFILTER, 0, ifindex, TC_H_MAKE(TC_H_CLSACT, hook));
+  req.tcm.tcm_info = TC_H_MAKE(FLOW_PRIO << 16, 0);
+  return tc_talk(&req);
+}
+
+static int tc_addfilter(int ifindex, u_int32_t hook, int prog) {
+  tc_request req;
+  tc_init(&req, RTM_NEWTFILTER, NLM_F_CREATE | NLM_F_EXCL, ifindex,
+          TC_H_MAKE(TC_H_CLSACT, hook));
+  req.tcm.tcm_info = TC_H_MAKE(FLOW_PRIO << 16, htons(ETH_P_ALL));
+  addattr(&req.nlh, TCA_KIND, "bpf", 4);
+  rtattr *options = addattr(&req.nlh, TCA_OPTIONS, NULL, 0);
+  u_int32_t fd = prog;
+  u_int32_t flags = TCA_BPF_FLAG_ACT_DIRECT;
+  addattr(&req.nlh, TCA_BPF_FD, &fd, sizeof(fd));
+  addattr(&req.nlh, TCA_BPF_NAME, "nethogs", 8);
+  addattr(&req.nlh, TCA_BPF_FLAGS, &flags, sizeof(flags));
+  options->rta_len = (char *)&req.nlh + req.nlh.nlmsg_len - (char *)options;
+  return tc_talk(&req);
+}
+
+static int tc_qdisc(int type, int flags, int ifindex) {
+  tc_request req;
+  tc_init(&req, type, flags, ifindex, TC_H_CLSACT);
+  req.tcm.tcm_handle = TC_H_MAKE(TC_H_CLSACT, 0);
+  addattr(&req.nlh, TCA_KIND, "clsact", 7);
+  return tc_talk(&req);
+}
+
+/* the devices we're attached to, and whether we added their clsact */
+struct flow_device {
+  const char *name;
+  bool own_qdisc;
+};
+static std::map<int, flow_device> flow_devices;
+
+bool tcbpf_attach(const char *device) {
+  int ifindex = if_nametoindex(device);
+  if (ifindex == 0) {
+    std::cerr << "Can't attach the eBPF flow counter to " << device
+              << ": no such interface" << std::endl;
+    return false;
+  }
+  if (!flow_load())
+    return false;
+
+  int error = tc_qdisc(RTM_NEWQDISC, NLM_F_CREATE | NLM_F_EXCL, ifindex);
+  if (error != 0 && error != -EEXIST) {
+    std::cerr << "Error adding a clsact qdisc to " << device << ": "
+              << strerror(-error) << std::endl;
+    return false;
+  }
+  flow_device dev = {device, error == 0};
+  flow_devices[ifindex] = dev;
+
+  static const u_int32_t hooks[2] = {TC_H_MIN_INGRESS, TC_H_MIN_EGRESS};
+  for (int outgoing = 0; outgoing < 2; outgoing++) {
+    /* left behind by a nethogs that didn't exit cleanly */
+    tc_delfilter(ifindex, hooks[outgoing]);
+    error = tc_addfilter(ifindex, hooks[outgoing], flow_progs[outgoing]);
+    if (error != 0) {
+      std::cerr << "Error attaching the eBPF flow counter to " << device
+                << ": " << strerror(-error) << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+void tcbpf_detach() {
+  for (std::map<int, flow_device>::iterator it = flow_devices.begin();
+       it != flow_devices.end(); ++it) {
+    if (it->second.own_qdisc) {
+      tc_qdisc(RTM_DELQDISC, 0, it->first);
+    } else {
+      tc_delfilter(it->first, TC_H_MIN_INGRESS);
+      tc_delfilter(it->first, TC_H_MIN_EGRESS);
+    }
+  }
+  flow_devices.clear();
+}
+
+struct flow_key_less {
+  bool operator()(const flow_key &a, const flow_key &b) const {
+    return memcmp(&a, &b, sizeof(flow_key)) < 0;
+  }
+};
+
+/* the counters of each flow at the previous drain */
+struct flow_seen {
+  flow_value value;
+  unsigned generation;
+};
+static std::map<flow_key, flow_seen, flow_key_less> flows_seen;
+static unsigned flow_generation = 0;
+static u_int64_t flow_last_drain = 0;
+
+static Packet *flow_packet(const flow_key *key, u_int32_t len,
+                           u_int64_t time) {
+  direction dir = key->outgoing ? dir_outgoing : dir_incoming;
+  if (key->family == AF_INET) {
+    in_addr saddr, daddr;
+    memcpy(&saddr, key->saddr, sizeof(saddr));
+    memcpy(&daddr, key->daddr, sizeof(daddr));
+    return new Packet(saddr, ntohs(key->sport), daddr, ntohs(key->dport), len,
+                      time, dir);
+  }
+  in6_addr saddr, daddr;
+  memcpy(&saddr, key->saddr, sizeof(saddr));
+  memcpy(&daddr, key->daddr, sizeof(daddr));
+  return new Packet(saddr, ntohs(key->sport), daddr, ntohs(key->dport), len,
+                    time, dir);
+}
+
+/* accounts the growth of a flow over [from, to] to its connection, which
+ * is looked up or made the way process_tcp and process_udp would have */
+static void flow_account(const flow_key *key, u_int64_t bytes,
+                         u_int64_t packets, u_int64_t from, u_int64_t to) {
+  if (key->protocol != IPPROTO_TCP &&
+      (key->protocol != IPPROTO_UDP || !catchall))
+    return;
+  /* non-first fragments, which can't be told apart */
+  if (key->sport == 0 && key->dport == 0)
+    return;
+  std::map<int, flow_device>::iterator dev = flow_devices.find(key->ifindex);
+  if (dev == flow_devices.end())
+    return;
+
+  Packet *packet = flow_packet(key, 0, to);
+  Connection *connection = findConnection(packet, key->protocol);
+  if (connection == NULL) {
+    connection = new Connection(packet, false);
+    if (key->protocol == IPPROTO_TCP)
+      getProcess(connection, dev->second.name);
+    else
+      unknownudp->connections =
+          new ConnList(connection, unknownudp->connections);
+  }
+  delete packet;
+  connection->addcounts(key->outgoing, bytes, packets, from, to);
+}
+
+void tcbpf_drain(u_int64_t now) {
+  if (flow_map < 0)
+    return;
+
+  u_int64_t from = flow_last_drain ? flow_last_drain : now;
+  flow_last_drain = now;
+  flow_generation++;
+
+  flow_key key, next;
+  memset(&next, 0, sizeof(next));
+  flow_value value;
+  bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.map_fd = flow_map;
+  attr.key = 0;
+  attr.next_key = ptr(&next);
+  while (sys_bpf(BPF_MAP_GET_NEXT_KEY, &attr) == 0) {
+    key = next;
+    attr.key = ptr(&key);
+
+    bpf_attr lookup;
+    memset(&lookup, 0, sizeof(lookup));
+    lookup.map_fd = flow_map;
+    lookup.key = ptr(&key);
+    lookup.value = ptr(&value);
+    if (sys_bpf(BPF_MAP_LOOKUP_ELEM, &lookup) != 0)
+      continue;
+
+    /* a flow that was evicted and came back starts from zero */
+    flow_seen &seen = flows_seen[key];
+    flow_value delta = value;
+    if (seen.generation != 0 && value.bytes >= seen.value.bytes &&
+        value.packets >= seen.value.packets) {
+      delta.bytes -= seen.value.bytes;
+      delta.packets -= seen.value.packets;
+    }
+    seen.value = value;
+    seen.generation = flow_generation;
+
+    if (delta.bytes != 0)
+      flow_account(&key, delta.bytes, delta.packets, from, now);
+  }
+
+  /* forget the flows the map has dropped */
+  for (std::map<flow_key, flow_seen, flow_key_less>::iterator it =
+           flows_seen.begin();
+       it != flows_seen.end();) {
+    if (it->second.generation != flow_generation)
+      flows_seen.erase(it++);
+    else
+      ++it;
+  }
+}
+#else
+bool tcbpf_attach(const char *device) {
+  std::cerr << "Can't attach to " << device
+            << ": eBPF flow counting needs Linux" << std::endl;
+  return false;
+}
+
+void tcbpf_drain(u_int64_t) {}
+
+void tcbpf_detach() {}
+#endif
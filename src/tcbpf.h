@@ -0,0 +1,42 @@
+/*
+ * tcbpf.h
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ *USA.
+ *
+ */
+
+#ifndef __TCBPF_H
+#define __TCBPF_H
+
+#include <sys/types.h>
+
+/* the in-kernel backend: an eBPF program at tc ingress and egress counts
+ * bytes and packets per flow in an LRU hash map, which nethogs reads at
+ * each refresh. No packet is copied to userspace. */
+
+/* attaches the counting program to 'device', which must have an Ethernet
+ * header (or be the loopback). Returns false, after telling why on stderr,
+ * when that fails */
+bool tcbpf_attach(const char *device);
+
+/* accounts the traffic counted since the previous call to its connections
+ * and processes */
+void tcbpf_drain(u_int64_t now);
+
+/* removes the program from all devices again */
+void tcbpf_detach();
+
+#endif
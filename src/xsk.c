@@ -0,0 +1,400 @@
+/*
+ * xsk.c
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ *USA.
+ *
+ */
+
+#include "xsk.h"
+#include <stdio.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <dirent.h>
+#include <errno.h>
+#include <net/if.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+/* the fill ring holds all frames of the UMEM, so giving back the frames we
+ * took from the receive ring always fits */
+#define XSK_RX_SIZE XSK_FRAMES
+#define XSK_FILL_SIZE XSK_FRAMES
+/* we don't transmit, but a socket can't be bound without one */
+#define XSK_COMPLETION_SIZE 64
+
+/* a ring shared with the kernel: it produces and we consume, or the other
+ * way around */
+struct xsk_ring {
+  u_int32_t *producer;
+  u_int32_t *consumer;
+  void *desc;
+  u_int32_t mask;
+  void *map;
+  size_t maplen;
+};
+
+struct xsk_queue {
+  int fd;
+  u_char *umem;
+  struct xsk_ring fill;
+  struct xsk_ring rx;
+  bool zerocopy;
+};
+
+struct dp_xsk {
+  int nqueues;
+  struct xsk_queue *queues;
+  int map;
+  int prog;
+  int link;
+  int epoll;
+  u_int64_t received;
+  char errbuf[256];
+};
+
+static long sys_bpf(int cmd, union bpf_attr *attr) {
+  return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+static u_int64_t ptr(const void *p) { return (u_int64_t)(unsigned long)p; }
+
+/* the receive queues of the device, 1 when sysfs doesn't tell */
+static int xsk_count_queues(const char *device) {
+  char path[64 + IF_NAMESIZE];
+  snprintf(path, sizeof(path), "/sys/class/net/%s/queues", device);
+  DIR *dir = opendir(path);
+  if (dir == NULL)
+    return 1;
+  int count = 0;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL)
+    if (strncmp(entry->d_name, "rx-", 3) == 0)
+      count++;
+  closedir(dir);
+  return count > 0 ? count : 1;
+}
+
+/* redirects every frame to the socket of its receive queue, or lets it pass
+ * when that queue has none:
+ *   r2 = ctx->rx_queue_index
+ *   r1 = the XSKMAP
+ *   r0 = bpf_redirect_map(r1, r2, XDP_PASS)
+ */
+static int xsk_load(int map, char *log, size_t loglen) {
+  struct bpf_insn insns[] = {
+      {BPF_LDX | BPF_MEM | BPF_W, 2, 1, 16, 0},
+      {BPF_LD | BPF_DW | BPF_IMM, 1, BPF_PSEUDO_MAP_FD, 0, map},
+      {0, 0, 0, 0, 0},
+      {BPF_ALU64 | BPF_MOV | BPF_K, 3, 0, 0, XDP_PASS},
+      {BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map},
+      {BPF_JMP | BPF_EXIT, 0, 0, 0, 0},
+  };
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.prog_type = BPF_PROG_TYPE_XDP;
+  attr.expected_attach_type = BPF_XDP;
+  attr.insns = ptr(insns);
+  attr.insn_cnt = sizeof(insns) / sizeof(insns[0]);
+  attr.license = ptr("GPL");
+  attr.log_buf = ptr(log);
+  attr.log_size = loglen;
+  attr.log_level = 1;
+  return sys_bpf(BPF_PROG_LOAD, &attr);
+}
+
+static bool xsk_map_ring(struct xsk_ring *ring, int fd,
+                         const struct xdp_ring_offset *offset, size_t entry,
+                         u_int32_t size, off_t pgoff) {
+  ring->maplen = offset->desc + size * entry;
+  ring->map = mmap(NULL, ring->maplen, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, pgoff);
+  if (ring->map == MAP_FAILED) {
+    ring->map = NULL;
+    return false;
+  }
+  ring->producer = (u_int32_t *)((char *)ring->map + offset->producer);
+  ring->consumer = (u_int32_t *)((char *)ring->map + offset->consumer);
+  ring->desc = (char *)ring->map + offset->desc;
+  ring->mask = size - 1;
+  return true;
+}
+
+/* sets up the socket of one queue. Returns the step that failed, with the
+ * reason in errno */
+static const char *xsk_queue_open(struct xsk_queue *q, int ifindex,
+                                  int queue) {
+  q->fd = socket(AF_XDP, SOCK_RAW | SOCK_CLOEXEC, 0);
+  if (q->fd < 0)
+    return "creating an AF_XDP socket";
+
+  /* the kernel pins these pages for as long as the socket lives */
+  q->umem = (u_char *)mmap(NULL, XSK_FRAMES * XSK_FRAME_SIZE,
+                           PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (q->umem == MAP_FAILED) {
+    q->umem = NULL;
+    return "allocating the UMEM";
+  }
+  struct xdp_umem_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.addr = ptr(q->umem);
+  reg.len = XSK_FRAMES * XSK_FRAME_SIZE;
+  reg.chunk_size = XSK_FRAME_SIZE;
+  if (setsockopt(q->fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) != 0)
+    return "registering the UMEM";
+
+  int fill = XSK_FILL_SIZE, completion = XSK_COMPLETION_SIZE,
+      rx = XSK_RX_SIZE;
+  if (setsockopt(q->fd, SOL_XDP, XDP_UMEM_FILL_RING, &fill, sizeof(fill)) ||
+      setsockopt(q->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &completion,
+                 sizeof(completion)) ||
+      setsockopt(q->fd, SOL_XDP, XDP_RX_RING, &rx, sizeof(rx)))
+    return "sizing the rings";
+
+  struct xdp_mmap_offsets offsets;
+  socklen_t len = sizeof(offsets);
+  if (getsockopt(q->fd, SOL_XDP, XDP_MMAP_OFFSETS, &offsets, &len) != 0)
+    return "getting the ring offsets";
+  if (!xsk_map_ring(&q->fill, q->fd, &offsets.fr, sizeof(u_int64_t),
+                    XSK_FILL_SIZE, XDP_UMEM_PGOFF_FILL_RING) ||
+      !xsk_map_ring(&q->rx, q->fd, &offsets.rx, sizeof(struct xdp_desc),
+                    XSK_RX_SIZE, XDP_PGOFF_RX_RING))
+    return "mapping the rings";
+
+  /* hand all frames to the kernel */
+  u_int64_t *addrs = (u_int64_t *)q->fill.desc;
+  for (u_int32_t i = 0; i < XSK_FILL_SIZE; i++)
+    addrs[i] = (u_int64_t)i * XSK_FRAME_SIZE;
+  __atomic_store_n(q->fill.producer, XSK_FILL_SIZE, __ATOMIC_RELEASE);
+
+  struct sockaddr_xdp addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sxdp_family = AF_XDP;
+  addr.sxdp_ifindex = ifindex;
+  addr.sxdp_queue_id = queue;
+  addr.sxdp_flags = XDP_ZEROCOPY;
+  q->zerocopy = true;
+  if (bind(q->fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    /* the driver can't, so the kernel copies the frames into the UMEM */
+    addr.sxdp_flags = XDP_COPY;
+    q->zerocopy = false;
+    if (bind(q->fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+      return "binding the AF_XDP socket";
+  }
+  return NULL;
+}
+
+static void xsk_queue_close(struct xsk_queue *q) {
+  if (q->rx.map != NULL)
+    munmap(q->rx.map, q->rx.maplen);
+  if (q->fill.map != NULL)
+    munmap(q->fill.map, q->fill.maplen);
+  if (q->fd >= 0)
+    close(q->fd);
+  if (q->umem != NULL)
+    munmap(q->umem, XSK_FRAMES * XSK_FRAME_SIZE);
+}
+
+static struct dp_xsk *xsk_fail(struct dp_xsk *xsk, const char *device,
+                               const char *what, char *errbuf,
+                               size_t errlen) {
+  snprintf(errbuf, errlen, "AF_XDP on %s: error %s: %s", device, what,
+           strerror(errno));
+  xsk_close(xsk);
+  return NULL;
+}
+
+struct dp_xsk *xsk_open(const char *device, char *errbuf, size_t errlen) {
+  int ifindex = if_nametoindex(device);
+  if (ifindex == 0) {
+    snprintf(errbuf, errlen, "AF_XDP on %s: no such interface", device);
+    return NULL;
+  }
+
+  struct dp_xsk *xsk = (struct dp_xsk *)calloc(1, sizeof(struct dp_xsk));
+  xsk->map = xsk->prog = xsk->link = xsk->epoll = -1;
+  xsk->nqueues = xsk_count_queues(device);
+  xsk->queues = (struct xsk_queue *)calloc(xsk->nqueues,
+                                           sizeof(struct xsk_queue));
+  for (int i = 0; i < xsk->nqueues; i++)
+    xsk->queues[i].fd = -1;
+
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.map_type = BPF_MAP_TYPE_XSKMAP;
+  attr.key_size = sizeof(u_int32_t);
+  attr.value_size = sizeof(u_int32_t);
+  attr.max_entries = xsk->nqueues;
+  xsk->map = sys_bpf(BPF_MAP_CREATE, &attr);
+  if (xsk->map < 0)
+    return xsk_fail(xsk, device, "creating the XSKMAP", errbuf, errlen);
+
+  xsk->epoll = epoll_create1(EPOLL_CLOEXEC);
+  if (xsk->epoll < 0)
+    return xsk_fail(xsk, device, "creating an epoll instance", errbuf,
+                    errlen);
+
+  for (int i = 0; i < xsk->nqueues; i++) {
+    struct xsk_queue *q = &xsk->queues[i];
+    const char *what = xsk_queue_open(q, ifindex, i);
+    if (what != NULL)
+      return xsk_fail(xsk, device, what, errbuf, errlen);
+
+    u_int32_t key = i, value = q->fd;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = xsk->map;
+    attr.key = ptr(&key);
+    attr.value = ptr(&value);
+    if (sys_bpf(BPF_MAP_UPDATE_ELEM, &attr) != 0)
+      return xsk_fail(xsk, device, "adding a socket to the XSKMAP", errbuf,
+                      errlen);
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.u32 = i;
+    if (epoll_ctl(xsk->epoll, EPOLL_CTL_ADD, q->fd, &event) != 0)
+      return xsk_fail(xsk, device, "polling the AF_XDP socket", errbuf,
+                      errlen);
+  }
+
+  static char log[4096];
+  xsk->prog = xsk_load(xsk->map, log, sizeof(log));
+  if (xsk->prog < 0)
+    return xsk_fail(xsk, device, "loading the XDP program", errbuf, errlen);
+
+  /* as a link, the program is detached when we exit, however we exit. The
+   * kernel picks native XDP when the driver has it */
+  memset(&attr, 0, sizeof(attr));
+  attr.link_create.prog_fd = xsk->prog;
+  attr.link_create.target_ifindex = ifindex;
+  attr.link_create.attach_type = BPF_XDP;
+  xsk->link = sys_bpf(BPF_LINK_CREATE, &attr);
+  if (xsk->link < 0)
+    return xsk_fail(xsk, device, "attaching the XDP program", errbuf, errlen);
+
+  fprintf(stdout, "AF_XDP on %s: %d queue%s, %s\n", device, xsk->nqueues,
+          xsk->nqueues == 1 ? "" : "s",
+          xsk->queues[0].zerocopy ? "zero-copy" : "copy mode");
+  return xsk;
+}
+
+int xsk_receive(struct dp_xsk *xsk, xsk_handler handler, u_char *user) {
+  int count = 0;
+  for (int i = 0; i < xsk->nqueues; i++) {
+    struct xsk_queue *q = &xsk->queues[i];
+    u_int32_t consumer = *q->rx.consumer;
+    u_int32_t n = __atomic_load_n(q->rx.producer, __ATOMIC_ACQUIRE) - consumer;
+    if (n == 0)
+      continue;
+
+    const struct xdp_desc *descs = (const struct xdp_desc *)q->rx.desc;
+    u_int64_t *fill = (u_int64_t *)q->fill.desc;
+    u_int32_t producer = *q->fill.producer;
+    for (u_int32_t j = 0; j < n; j++) {
+      const struct xdp_desc *desc = &descs[(consumer + j) & q->rx.mask];
+      handler(user, q->umem + desc->addr, desc->len);
+      /* parsed, so the frame can go back to the kernel */
+      fill[(producer + j) & q->fill.mask] =
+          desc->addr & ~(u_int64_t)(XSK_FRAME_SIZE - 1);
+    }
+    __atomic_store_n(q->fill.producer, producer + n, __ATOMIC_RELEASE);
+    __atomic_store_n(q->rx.consumer, consumer + n, __ATOMIC_RELEASE);
+    count += n;
+  }
+  xsk->received += count;
+  return count;
+}
+
+int xsk_fd(struct dp_xsk *xsk) { return xsk->epoll; }
+
+void xsk_stats(struct dp_xsk *xsk, u_int64_t *received, u_int64_t *dropped) {
+  *received = xsk->received;
+  *dropped = 0;
+  for (int i = 0; i < xsk->nqueues; i++) {
+    struct xdp_statistics stats;
+    socklen_t len = sizeof(stats);
+    memset(&stats, 0, sizeof(stats));
+    if (getsockopt(xsk->queues[i].fd, SOL_XDP, XDP_STATISTICS, &stats,
+                   &len) == 0)
+      *dropped += stats.rx_dropped + stats.rx_ring_full +
+                  stats.rx_fill_ring_empty_descs;
+  }
+  *received += *dropped;
+}
+
+char *xsk_geterr(struct dp_xsk *xsk) { return xsk->errbuf; }
+
+void xsk_close(struct dp_xsk *xsk) {
+  if (xsk->link >= 0)
+    close(xsk->link);
+  if (xsk->prog >= 0)
+    close(xsk->prog);
+  for (int i = 0; i < xsk->nqueues; i++)
+    xsk_queue_close(&xsk->queues[i]);
+  if (xsk->map >= 0)
+    close(xsk->map);
+  if (xsk->epoll >= 0)
+    close(xsk->epoll);
+  free(xsk->queues);
+  free(xsk);
+}
+#else
+struct dp_xsk *xsk_open(const char *device, char *errbuf, size_t errlen) {
+  snprintf(errbuf, errlen, "Can't capture on %s: AF_XDP needs Linux",
+           device);
+  return NULL;
+}
+
+int xsk_receive(struct dp_xsk *xsk, xsk_handler handler, u_char *user) {
+  (void)xsk;
+  (void)handler;
+  (void)user;
+  return -1;
+}
+
+int xsk_fd(struct dp_xsk *xsk) {
+  (void)xsk;
+  return -1;
+}
+
+void xsk_stats(struct dp_xsk *xsk, u_int64_t *received, u_int64_t *dropped) {
+  (void)xsk;
+  *received = 0;
+  *dropped = 0;
+}
+
+char *xsk_geterr(struct dp_xsk *xsk) {
+  (void)xsk;
+  return (char *)"AF_XDP needs Linux";
+}
+
+void xsk_close(struct dp_xsk *xsk) { (void)xsk; }
+#endif
@@ -0,0 +1,63 @@
+/*
+ * xsk.h
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ *USA.
+ *
+ */
+#ifndef __XSK_H
+#define __XSK_H
+
+#include <sys/types.h>
+#include <stdbool.h>
+
+/* the AF_XDP backend of decpcap: an XDP program redirects the frames
+ * arriving on each receive queue of a device to an AF_XDP socket, which
+ * places them in a UMEM region shared with us. They're parsed right where
+ * they are, and then given back to the kernel. Only Ethernet devices, and
+ * only received frames: those don't reach the network stack of the host any
+ * more, so this is for mirror ports (or a veth pair, to try it out). */
+
+struct dp_xsk;
+
+/* frames per receive queue */
+#define XSK_FRAMES 2048
+#define XSK_FRAME_SIZE 2048
+
+typedef void (*xsk_handler)(u_char *user, const u_char *frame,
+                            u_int32_t len);
+
+/* sets up a socket on every receive queue of 'device' and attaches the
+ * redirecting program. Zero-copy where the driver supports it, copy mode
+ * otherwise. Returns NULL, with the reason in errbuf, when that fails */
+struct dp_xsk *xsk_open(const char *device, char *errbuf, size_t errlen);
+
+/* hands the frames waiting on all queues to 'handler'. Returns how many
+ * there were, or -1 */
+int xsk_receive(struct dp_xsk *xsk, xsk_handler handler, u_char *user);
+
+/* a descriptor that's readable when frames are waiting */
+int xsk_fd(struct dp_xsk *xsk);
+
+/* the frames received, and the ones the kernel dropped because the rings
+ * were full */
+void xsk_stats(struct dp_xsk *xsk, u_int64_t *received, u_int64_t *dropped);
+
+char *xsk_geterr(struct dp_xsk *xsk);
+
+/* detaches the program and releases the sockets */
+void xsk_close(struct dp_xsk *xsk);
+
+#endif